@@ -0,0 +1,784 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * bench.c
+ *
+ * Standard kvdb workloads, in the manner of LevelDB's db_bench:
+ *
+ *   kvbench block-device [--flag=value ...]
+ *
+ * --benchmarks  comma separated, run in order (default: all of them)
+ *                 fillseq          keys in order into an empty kvdb
+ *                 fillrandom       keys in random order into an empty kvdb
+ *                 overwrite        random keys of a filled kvdb
+ *                 readrandom       random keys of a filled kvdb
+ *                 readmissing      keys that are not there
+ *                 readwhilewriting readrandom with one more thread overwriting
+ *                 zipfian          reads and overwrites of zipfian hot keys
+ * --num         keys (default: 1000000)
+ * --reads       operations of the read and mixed workloads (default: num)
+ * --key_size    bytes per key (default: 16)
+ * --value_size  bytes per value (default: 100)
+ * --threads     threads issuing operations (default: 1)
+ * --theta       skew of zipfian (default: 0.99)
+ * --read_pct    share of reads in zipfian (default: 90)
+ * --cache_mb    read cache, 0 for the default (default: 0)
+ * --sync        KVDB_SYNC_* (default: 0)
+ * --compress    compress values of at least this many bytes (default: 0)
+ * --json        one JSON object per benchmark instead of text
+ * --stats       kvdb_stats() after each benchmark, counted since the kvdb opened
+ *
+ * The fill workloads start from an empty kvdb, the others run on whatever
+ * the previous ones left, so a fill goes first.
+ */
+
+#include <math.h>
+#include <pthread.h>
+
+#include "kvdb.h"
+
+/* latency histogram: per power of two of nanoseconds, SUB linear buckets */
+
+#define SUB 16
+#define BUCKETS (64 * SUB)
+
+struct histogram {
+    uint64_t n;
+    uint64_t sum; /* nanoseconds */
+    uint64_t max;
+    uint64_t counts[BUCKETS];
+};
+
+struct config {
+    uint64_t num;
+    uint64_t reads;
+    uint64_t key_size;
+    uint64_t value_size;
+    uint64_t threads;
+    double theta;
+    uint64_t read_pct;
+    uint64_t cache_mb;
+    int sync;
+    uint64_t compress;
+    int json;
+    int stats;
+    const char *benchmarks;
+};
+
+/* YCSB's zipfian generator over [0, n), see Gray et al., SIGMOD 1994 */
+
+struct zipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+struct bench;
+
+struct worker {
+    struct bench *bench;
+    int (*fn)(struct worker *worker);
+    uint64_t id;
+    uint64_t seed;
+    uint64_t ops;
+    uint64_t reads;
+    uint64_t found; /* of reads */
+    uint64_t bytes;
+    struct histogram hist;
+    pthread_t thread;
+    int r;
+};
+
+struct bench {
+    const struct config *config;
+    struct kvdb *kvdb;
+    const char *pathname;
+    const char *name;
+    int (*fn)(struct worker *worker);
+    struct zipf zipf;
+    char *values; /* random bytes values are cut from */
+    int done; /* the measured threads are finished */
+};
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64* */
+
+static uint64_t
+next_rand(uint64_t *state) {
+    (*state) ^= (*state) >> 12;
+    (*state) ^= (*state) << 25;
+    (*state) ^= (*state) >> 27;
+    return (*state) * 0x2545f4914f6cdd1dULL;
+}
+
+static double
+next_unit(uint64_t *state) {
+    return (double)(next_rand(state) >> 11) / (double)(1ULL << 53);
+}
+
+/* histogram */
+
+static uint64_t
+bucket_of(uint64_t ns) {
+    uint64_t b;
+
+    if (SUB > ns) {
+        return ns;
+    }
+    b = 63 - (uint64_t)__builtin_clzll(ns); /* ns is in [2^b, 2^(b + 1)) */
+    return (b - 3) * SUB + ((ns >> (b - 4)) - SUB);
+}
+
+/* the smallest latency bucket i holds */
+
+static uint64_t
+bucket_low(uint64_t i) {
+    uint64_t b;
+
+    if (SUB > i) {
+        return i;
+    }
+    b = i / SUB + 3;
+    return ((uint64_t)1 << b) + (i % SUB) * ((uint64_t)1 << (b - 4));
+}
+
+static void
+hist_add(struct histogram *hist, uint64_t ns) {
+    ++hist->counts[MIN(bucket_of(ns), BUCKETS - 1)];
+    ++hist->n;
+    hist->sum += ns;
+    hist->max = MAX(hist->max, ns);
+}
+
+static void
+hist_merge(struct histogram *hist, const struct histogram *other) {
+    uint64_t i;
+
+    for (i = 0; i < BUCKETS; ++i) {
+        hist->counts[i] += other->counts[i];
+    }
+    hist->n += other->n;
+    hist->sum += other->sum;
+    hist->max = MAX(hist->max, other->max);
+}
+
+/* microseconds below which a fraction p of the samples are, to a bucket */
+
+static double
+hist_percentile(const struct histogram *hist, double p) {
+    uint64_t i, n, rank;
+
+    if (!hist->n) {
+        return 0.0;
+    }
+    rank = (uint64_t)(p * hist->n);
+    for (n = i = 0; i < BUCKETS; ++i) {
+        n += hist->counts[i];
+        if (n > rank) {
+            return 1e-3 * (double)MIN(bucket_low(i + 1), hist->max);
+        }
+    }
+    return 1e-3 * (double)hist->max;
+}
+
+/* zipfian */
+
+static double
+zeta(uint64_t n, double theta) {
+    double sum;
+    uint64_t i;
+
+    sum = 0.0;
+    for (i = 1; i <= n; ++i) {
+        sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void
+zipf_init(struct zipf *zipf, uint64_t n, double theta) {
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = zeta(n, theta);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / zipf->zetan);
+}
+
+/* a rank, 0 the most popular, scattered over the keys so hot keys are not adjacent */
+
+static uint64_t
+zipf_next(const struct zipf *zipf, uint64_t *state) {
+    double u, uz;
+    uint64_t rank;
+
+    u = next_unit(state);
+    uz = u * zipf->zetan;
+    if (1.0 > uz) {
+        rank = 0;
+    } else if ((1.0 + pow(0.5, zipf->theta)) > uz) {
+        rank = 1;
+    } else {
+        rank = (uint64_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    }
+    rank = MIN(rank, zipf->n - 1);
+    return (rank * 0x9e3779b97f4a7c15ULL) % zipf->n;
+}
+
+/* keys and values */
+
+/* key k, or a key past the num there are when missing */
+
+static void
+mk_key(const struct config *config, char *key, uint64_t k, int missing) {
+    char buf[32];
+    uint64_t n;
+
+    /* the number, zero padded on the left or cut to the key size */
+    safe_sprintf(buf, sizeof(buf), "%016lu", (unsigned long)(k + (missing ? config->num : 0)));
+    n = safe_strlen(buf);
+    memset(key, '0', config->key_size);
+    memcpy(key + config->key_size - MIN(n, config->key_size),
+           buf + n - MIN(n, config->key_size),
+           MIN(n, config->key_size));
+}
+
+static const char *
+mk_value(const struct bench *bench, uint64_t *state) {
+    return bench->values + next_rand(state) % (1024 * 1024);
+}
+
+/* workloads: each runs the share of one worker */
+
+static uint64_t
+share(const struct worker *worker, uint64_t total) {
+    const uint64_t threads = worker->bench->config->threads;
+
+    return total / threads + ((worker->id < (total % threads)) ? 1 : 0);
+}
+
+static int
+write_one(struct worker *worker, uint64_t k, char *key) {
+    const struct config *config = worker->bench->config;
+    const char *val;
+    uint64_t t;
+
+    mk_key(config, key, k, 0);
+    val = mk_value(worker->bench, &worker->seed);
+    t = now_ns();
+    if (kvdb_update(worker->bench->kvdb, key, config->key_size, val, config->value_size)) {
+        TRACE(0);
+        return -1;
+    }
+    hist_add(&worker->hist, now_ns() - t);
+    worker->bytes += config->key_size + config->value_size;
+    ++worker->ops;
+    return 0;
+}
+
+static int
+read_one(struct worker *worker, uint64_t k, int missing, char *key, char *val) {
+    const struct config *config = worker->bench->config;
+    uint64_t t, val_len;
+    int r;
+
+    mk_key(config, key, k, missing);
+    val_len = config->value_size;
+    t = now_ns();
+    if (0 > (r = kvdb_lookup(worker->bench->kvdb, key, config->key_size, val, &val_len))) {
+        TRACE(0);
+        return -1;
+    }
+    hist_add(&worker->hist, now_ns() - t);
+    ++worker->reads;
+    worker->found += r ? 0 : 1;
+    worker->bytes += r ? 0 : (config->key_size + val_len);
+    ++worker->ops;
+    return 0;
+}
+
+static int
+fillseq(struct worker *worker) {
+    const struct config *config = worker->bench->config;
+    uint64_t i, n, first;
+    char key[KVDB_MAX_KEY_LEN];
+
+    /* thread i fills the i-th range of keys */
+    n = share(worker, config->num);
+    first = worker->id * (config->num / config->threads) + MIN(worker->id, config->num % config->threads);
+    for (i = 0; i < n; ++i) {
+        if (write_one(worker, first + i, key)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+fillrandom(struct worker *worker) {
+    const struct config *config = worker->bench->config;
+    uint64_t i, n;
+    char key[KVDB_MAX_KEY_LEN];
+
+    n = share(worker, config->num);
+    for (i = 0; i < n; ++i) {
+        if (write_one(worker, next_rand(&worker->seed) % config->num, key)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+readrandom(struct worker *worker) {
+    const struct config *config = worker->bench->config;
+    uint64_t i, n;
+    char key[KVDB_MAX_KEY_LEN], *val;
+
+    if (!(val = malloc(config->value_size + 1))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    n = share(worker, config->reads);
+    for (i = 0; i < n; ++i) {
+        if (read_one(worker, next_rand(&worker->seed) % config->num, 0, key, val)) {
+            FREE(val);
+            return -1;
+        }
+    }
+    FREE(val);
+    return 0;
+}
+
+static int
+readmissing(struct worker *worker) {
+    const struct config *config = worker->bench->config;
+    uint64_t i, n;
+    char key[KVDB_MAX_KEY_LEN], *val;
+
+    if (!(val = malloc(config->value_size + 1))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    n = share(worker, config->reads);
+    for (i = 0; i < n; ++i) {
+        if (read_one(worker, next_rand(&worker->seed) % config->num, 1, key, val)) {
+            FREE(val);
+            return -1;
+        }
+    }
+    FREE(val);
+    return 0;
+}
+
+/* the extra thread of readwhilewriting, unmeasured, until the readers are done */
+
+static int
+background_writer(struct worker *worker) {
+    const struct config *config = worker->bench->config;
+    char key[KVDB_MAX_KEY_LEN];
+
+    while (!__atomic_load_n(&worker->bench->done, __ATOMIC_ACQUIRE)) {
+        if (write_one(worker, next_rand(&worker->seed) % config->num, key)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+zipfian(struct worker *worker) {
+    const struct config *config = worker->bench->config;
+    uint64_t i, n, k;
+    char key[KVDB_MAX_KEY_LEN], *val;
+    int r;
+
+    if (!(val = malloc(config->value_size + 1))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    n = share(worker, config->reads);
+    for (i = 0; i < n; ++i) {
+        k = zipf_next(&worker->bench->zipf, &worker->seed);
+        if ((next_rand(&worker->seed) % 100) < config->read_pct) {
+            r = read_one(worker, k, 0, key, val);
+        } else {
+            r = write_one(worker, k, key);
+        }
+        if (r) {
+            FREE(val);
+            return -1;
+        }
+    }
+    FREE(val);
+    return 0;
+}
+
+/* driver */
+
+static void *
+run_worker(void *arg) {
+    struct worker *worker = (struct worker *)arg;
+
+    worker->r = worker->fn(worker);
+    return NULL;
+}
+
+static int
+open_kvdb(struct bench *bench) {
+    struct kvdb_options options;
+
+    kvdb_close(bench->kvdb);
+    memset(&options, 0, sizeof(options));
+    options.cache_budget = bench->config->cache_mb << 20;
+    options.sync = bench->config->sync;
+    options.expected_keys = bench->config->num;
+    options.compress_min = bench->config->compress;
+    if (!(bench->kvdb = kvdb_open_options(bench->pathname, &options))) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+report(const struct bench *bench,
+       const struct histogram *hist,
+       uint64_t reads,
+       uint64_t found,
+       uint64_t bytes,
+       uint64_t ns) {
+    const struct config *config = bench->config;
+    const double secs = 1e-9 * (double)MAX(ns, 1);
+
+    if (config->json) {
+        printf("{\"benchmark\":\"%s\",\"ops\":%lu,\"reads\":%lu,\"found\":%lu,\"threads\":%lu,"
+               "\"key_size\":%lu,\"value_size\":%lu,\"seconds\":%.6f,"
+               "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"avg_us\":%.3f,"
+               "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+               bench->name,
+               (unsigned long)hist->n,
+               (unsigned long)reads,
+               (unsigned long)found,
+               (unsigned long)config->threads,
+               (unsigned long)config->key_size,
+               (unsigned long)config->value_size,
+               secs,
+               hist->n / secs,
+               1e-6 * bytes / secs,
+               hist->n ? 1e-3 * hist->sum / hist->n : 0.0,
+               hist_percentile(hist, 0.50),
+               hist_percentile(hist, 0.99),
+               hist_percentile(hist, 0.999),
+               1e-3 * hist->max);
+        return;
+    }
+    printf("%-16s : %10.3f micros/op %10.0f ops/sec %8.1f MB/s",
+           bench->name,
+           hist->n ? 1e6 * secs * config->threads / hist->n : 0.0,
+           hist->n / secs,
+           1e-6 * bytes / secs);
+    if (found != reads) {
+        printf(" (%lu of %lu found)", (unsigned long)found, (unsigned long)reads);
+    }
+    printf("\n%-16s   p50 %.3f p99 %.3f p999 %.3f max %.3f us\n",
+           "",
+           hist_percentile(hist, 0.50),
+           hist_percentile(hist, 0.99),
+           hist_percentile(hist, 0.999),
+           1e-3 * hist->max);
+}
+
+/* mean of a log2 histogram, taking each bucket at its lower bound */
+
+static double
+hist_mean(const uint64_t *buckets, uint64_t n) {
+    uint64_t i, count, sum;
+
+    for (i = 0, count = 0, sum = 0; i < n; ++i) {
+        count += buckets[i];
+        sum += buckets[i] << i;
+    }
+    return count ? (double)sum / count : 0.0;
+}
+
+static void
+report_stats(const struct bench *bench) {
+    struct kvdb_stats stats;
+    const struct logfs_stats *logfs = &stats.logfs;
+
+    kvdb_stats(bench->kvdb, &stats);
+    if (bench->config->json) {
+        printf("{\"stats\":\"%s\",\"lookups\":%lu,\"memtable_hits\":%lu,\"chain_hops\":%lu,\"chain_walks\":%lu,"
+               "\"cache_hits\":%lu,\"cache_misses\":%lu,\"cache_rejections\":%lu,\"reads_cache\":%lu,"
+               "\"reads_write_buffer\":%lu,\"reads_both\":%lu,\"append_stalls\":%lu,"
+               "\"stall_us\":%lu,\"flushes\":%lu,\"device_reads\":%lu,\"device_writes\":%lu,"
+               "\"write_amp\":%.3f}\n",
+               bench->name,
+               (unsigned long)stats.lookups,
+               (unsigned long)stats.memtable_hits,
+               (unsigned long)stats.chain_hops,
+               (unsigned long)stats.chain_walks,
+               (unsigned long)logfs->cache_hits,
+               (unsigned long)logfs->cache_misses,
+               (unsigned long)logfs->cache_rejections,
+               (unsigned long)logfs->reads_cache,
+               (unsigned long)logfs->reads_write_buffer,
+               (unsigned long)logfs->reads_both,
+               (unsigned long)logfs->append_stalls,
+               (unsigned long)logfs->stall_us,
+               (unsigned long)logfs->flushes,
+               (unsigned long)logfs->device.reads,
+               (unsigned long)logfs->device.writes,
+               stats.write_amp);
+        return;
+    }
+    printf("%-16s   lookups %lu, %lu from the memtable, %.2f hops/walk, cache %lu hits %lu misses"
+           " (%lu not admitted)\n",
+           "",
+           (unsigned long)stats.lookups,
+           (unsigned long)stats.memtable_hits,
+           stats.chain_walks ? (double)stats.chain_hops / stats.chain_walks : 0.0,
+           (unsigned long)logfs->cache_hits,
+           (unsigned long)logfs->cache_misses,
+           (unsigned long)logfs->cache_rejections);
+    printf("%-16s   reads from cache %lu, write buffer %lu, both %lu\n",
+           "",
+           (unsigned long)logfs->reads_cache,
+           (unsigned long)logfs->reads_write_buffer,
+           (unsigned long)logfs->reads_both);
+    printf("%-16s   %lu append stalls for %.3f s, %lu flushes of %.1f blocks\n",
+           "",
+           (unsigned long)logfs->append_stalls,
+           1e-6 * logfs->stall_us,
+           (unsigned long)logfs->flushes,
+           hist_mean(logfs->flush_blocks, LOGFS_HIST));
+    printf("%-16s   device %lu reads ~%.0f us, %lu writes ~%.0f us, write amp %.2f\n",
+           "",
+           (unsigned long)logfs->device.reads,
+           hist_mean(logfs->device.read_us, DEVICE_HIST),
+           (unsigned long)logfs->device.writes,
+           hist_mean(logfs->device.write_us, DEVICE_HIST),
+           stats.write_amp);
+}
+
+static int
+run(struct bench *bench, const char *name) {
+    const struct config *config = bench->config;
+    struct histogram *hist;
+    struct worker *workers;
+    uint64_t i, n, reads, found, bytes, t;
+    int r;
+
+    bench->name = name;
+    bench->done = 0;
+    n = config->threads;
+    if (!strcmp(name, "fillseq")) {
+        bench->fn = fillseq;
+    } else if (!strcmp(name, "fillrandom")) {
+        bench->fn = fillrandom;
+    } else if (!strcmp(name, "overwrite")) {
+        bench->fn = fillrandom;
+    } else if (!strcmp(name, "readrandom") || !strcmp(name, "readwhilewriting")) {
+        bench->fn = readrandom;
+    } else if (!strcmp(name, "readmissing")) {
+        bench->fn = readmissing;
+    } else if (!strcmp(name, "zipfian")) {
+        bench->fn = zipfian;
+        if (bench->zipf.n != config->num) {
+            zipf_init(&bench->zipf, config->num, config->theta);
+        }
+    } else {
+        fprintf(stderr, "unknown benchmark: %s\n", name);
+        return -1;
+    }
+    if ((!strncmp(name, "fill", 4) || !bench->kvdb) && open_kvdb(bench)) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* the extra writer of readwhilewriting is last and is not measured */
+
+    if (!(workers = calloc(n + 1, sizeof(struct worker))) || !(hist = calloc(1, sizeof(struct histogram)))) {
+        FREE(workers);
+        TRACE("out of memory");
+        return -1;
+    }
+    t = now_ns();
+    for (i = 0; i <= n; ++i) {
+        workers[i].bench = bench;
+        workers[i].fn = (i < n) ? bench->fn : background_writer;
+        workers[i].id = i;
+        workers[i].seed = (t ^ (i + 1) * 0x9e3779b97f4a7c15ULL) | 1;
+    }
+    r = 0;
+    if (!strcmp(name, "readwhilewriting")) {
+        workers[n].id = 0;
+        if (pthread_create(&workers[n].thread, NULL, run_worker, &workers[n])) {
+            FREE(workers);
+            FREE(hist);
+            TRACE("pthread_create()");
+            return -1;
+        }
+    }
+    t = now_ns();
+    for (i = 0; i < n; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+            TRACE("pthread_create()");
+            workers[i].thread = 0;
+            workers[i].r = -1;
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        if (workers[i].thread) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    t = now_ns() - t;
+    __atomic_store_n(&bench->done, 1, __ATOMIC_RELEASE);
+    if (!strcmp(name, "readwhilewriting")) {
+        pthread_join(workers[n].thread, NULL);
+        r |= workers[n].r;
+    }
+    reads = found = bytes = 0;
+    for (i = 0; i < n; ++i) {
+        r |= workers[i].r;
+        hist_merge(hist, &workers[i].hist);
+        reads += workers[i].reads;
+        found += workers[i].found;
+        bytes += workers[i].bytes;
+    }
+    if (!r) {
+        report(bench, hist, reads, found, bytes, t);
+        if (config->stats) {
+            report_stats(bench);
+        }
+    }
+    FREE(workers);
+    FREE(hist);
+    return r ? -1 : 0;
+}
+
+static int
+parse(struct config *config, const char *arg) {
+    const char *val;
+    uint64_t n;
+
+    if (strncmp(arg, "--", 2)) {
+        return -1;
+    }
+    arg += 2;
+    if (!strcmp(arg, "json")) {
+        config->json = 1;
+        return 0;
+    }
+    if (!strcmp(arg, "stats")) {
+        config->stats = 1;
+        return 0;
+    }
+    if (!(val = strchr(arg, '='))) {
+        return -1;
+    }
+    ++val;
+    n = strtoull(val, NULL, 10);
+    if (!strncmp(arg, "benchmarks=", 11)) {
+        config->benchmarks = val;
+    } else if (!strncmp(arg, "num=", 4) && n) {
+        config->num = n;
+    } else if (!strncmp(arg, "reads=", 6) && n) {
+        config->reads = n;
+    } else if (!strncmp(arg, "key_size=", 9) && n && (KVDB_MAX_KEY_LEN >= n)) {
+        config->key_size = n;
+    } else if (!strncmp(arg, "value_size=", 11) && n && ((1024 * 1024) >= n)) {
+        config->value_size = n;
+    } else if (!strncmp(arg, "threads=", 8) && n) {
+        config->threads = n;
+    } else if (!strncmp(arg, "theta=", 6) && (0.0 < atof(val)) && (1.0 > atof(val))) {
+        config->theta = atof(val);
+    } else if (!strncmp(arg, "read_pct=", 9) && (100 >= n)) {
+        config->read_pct = n;
+    } else if (!strncmp(arg, "cache_mb=", 9)) {
+        config->cache_mb = n;
+    } else if (!strncmp(arg, "sync=", 5) && (KVDB_SYNC_OP >= n)) {
+        config->sync = (int)n;
+    } else if (!strncmp(arg, "compress=", 9)) {
+        config->compress = n;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct config config;
+    struct bench bench;
+    char *list, *name, *save;
+    uint64_t i, seed;
+    int r;
+
+    memset(&config, 0, sizeof(config));
+    config.num = 1000000;
+    config.key_size = 16;
+    config.value_size = 100;
+    config.threads = 1;
+    config.theta = 0.99;
+    config.read_pct = 90;
+    config.benchmarks = "fillseq,fillrandom,overwrite,readrandom,readmissing,readwhilewriting,zipfian";
+    for (i = 2; i < (uint64_t)argc; ++i) {
+        if (parse(&config, argv[i])) {
+            break;
+        }
+    }
+    if ((2 > argc) || (i < (uint64_t)argc)) {
+        printf("usage: %s block-device [--benchmarks=a,b,...] [--num=N] [--reads=N]\n"
+               "       [--key_size=N] [--value_size=N] [--threads=N] [--theta=X]\n"
+               "       [--read_pct=N] [--cache_mb=N] [--sync=N] [--compress=N] [--json]\n"
+               "       [--stats]\n",
+               argv[0]);
+        return -1;
+    }
+    if (!config.reads) {
+        config.reads = config.num;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    bench.config = &config;
+    bench.pathname = argv[1];
+    if (!(bench.values = malloc(1024 * 1024 + config.value_size)) ||
+        !(list = malloc(safe_strlen(config.benchmarks) + 1))) {
+        FREE(bench.values);
+        TRACE("out of memory");
+        return -1;
+    }
+    seed = now_ns() | 1;
+    for (i = 0; i < 1024 * 1024 + config.value_size; ++i) {
+        bench.values[i] = (char)next_rand(&seed);
+    }
+    if (!config.json) {
+        printf("keys: %lu bytes each, values: %lu bytes each, entries: %lu, threads: %lu\n",
+               (unsigned long)config.key_size,
+               (unsigned long)config.value_size,
+               (unsigned long)config.num,
+               (unsigned long)config.threads);
+    }
+    memcpy(list, config.benchmarks, safe_strlen(config.benchmarks) + 1);
+    r = 0;
+    for (name = strtok_r(list, ",", &save); name && !r; name = strtok_r(NULL, ",", &save)) {
+        r = run(&bench, name);
+    }
+    kvdb_close(bench.kvdb);
+    FREE(list);
+    FREE(bench.values);
+    return r;
+}
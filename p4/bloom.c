@@ -0,0 +1,183 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * bloom.c
+ */
+
+#include "bloom.h"
+
+#define BLOCK_BITS 512
+#define BLOCK_WORDS (BLOCK_BITS / 64)
+#define MAX_PROBES 16
+
+/**
+ * The hash picks a block of one cache line, then probes bits of that block
+ * only, at h1 + i * h2. Keeping the probes in one line costs a little in
+ * false positives against a plain Bloom filter of the same size, and saves
+ * a cache miss per probe.
+ */
+struct bloom {
+    uint64_t blocks;
+    uint64_t bits_per_key;
+    uint64_t probes;
+    uint64_t *words;
+};
+
+struct header {
+    uint64_t blocks;
+    uint64_t bits_per_key;
+    uint64_t probes;
+};
+
+/* the hashes handed in may have structure in some bits, spread them out */
+
+static inline uint64_t
+mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t *
+block(const struct bloom *bloom, uint64_t h) {
+    /* the high half scaled to the number of blocks, no division */
+    return bloom->words + BLOCK_WORDS * (((h >> 32) * bloom->blocks) >> 32);
+}
+
+static struct bloom *
+create(uint64_t blocks, uint64_t bits_per_key, uint64_t probes) {
+    struct bloom *bloom;
+
+    if (!(bloom = malloc(sizeof(struct bloom)))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(bloom, 0, sizeof(struct bloom));
+    bloom->blocks = blocks;
+    bloom->bits_per_key = bits_per_key;
+    bloom->probes = probes;
+    if (!(bloom->words = aligned_alloc(64, blocks * BLOCK_WORDS * sizeof(uint64_t)))) {
+        FREE(bloom);
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(bloom->words, 0, blocks * BLOCK_WORDS * sizeof(uint64_t));
+    return bloom;
+}
+
+struct bloom *
+bloom_open(uint64_t keys, uint64_t bits_per_key) {
+    uint64_t blocks, probes;
+
+    assert(bits_per_key);
+
+    /* bits_per_key * ln 2 probes minimize false positives */
+
+    blocks = MAX(1, (keys * bits_per_key + BLOCK_BITS - 1) / BLOCK_BITS);
+    probes = MIN(MAX(1, (bits_per_key * 69 + 50) / 100), MAX_PROBES);
+    return create(blocks, bits_per_key, probes);
+}
+
+void
+bloom_close(struct bloom *bloom) {
+    if (bloom) {
+        FREE(bloom->words);
+        memset(bloom, 0, sizeof(struct bloom));
+    }
+    FREE(bloom);
+}
+
+void
+bloom_add(struct bloom *bloom, uint64_t hash) {
+    uint64_t h, h2, i, bit, *words;
+
+    h = mix(hash);
+    words = block(bloom, h);
+    h2 = (h >> 17) | 1;
+    for (i = 0; i < bloom->probes; ++i) {
+        bit = (h + i * h2) % BLOCK_BITS;
+        __atomic_fetch_or(&words[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+    }
+}
+
+int
+bloom_maybe(const struct bloom *bloom, uint64_t hash) {
+    uint64_t h, h2, i, bit, *words;
+
+    h = mix(hash);
+    words = block(bloom, h);
+    h2 = (h >> 17) | 1;
+    for (i = 0; i < bloom->probes; ++i) {
+        bit = (h + i * h2) % BLOCK_BITS;
+        if (!(__atomic_load_n(&words[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+bloom_full(const struct bloom *bloom, uint64_t keys) {
+    return keys * bloom->bits_per_key > bloom->blocks * BLOCK_BITS;
+}
+
+uint64_t
+bloom_bits(const struct bloom *bloom) {
+    return bloom->blocks * BLOCK_BITS;
+}
+
+uint64_t
+bloom_bits_per_key(const struct bloom *bloom) {
+    return bloom->bits_per_key;
+}
+
+u8 *
+bloom_serialize(const struct bloom *bloom, /*out*/ u64 *len) {
+    const u64 bytes = bloom->blocks * BLOCK_WORDS * sizeof(uint64_t);
+    struct header header;
+    u8 *buf;
+
+    if (!(buf = malloc(sizeof(header) + bytes))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    header.blocks = bloom->blocks;
+    header.bits_per_key = bloom->bits_per_key;
+    header.probes = bloom->probes;
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), bloom->words, bytes);
+    *len = sizeof(header) + bytes;
+    return buf;
+}
+
+struct bloom *
+bloom_deserialize(const u8 *buf, u64 len) {
+    struct header header;
+    struct bloom *bloom;
+
+    if (len < sizeof(header)) {
+        TRACE("short bloom filter");
+        return NULL;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (!header.blocks ||
+        !header.bits_per_key ||
+        !header.probes ||
+        (MAX_PROBES < header.probes) ||
+        ((len - sizeof(header)) != header.blocks * BLOCK_WORDS * sizeof(uint64_t))) {
+        TRACE("corrupt bloom filter");
+        return NULL;
+    }
+    if (!(bloom = create(header.blocks, header.bits_per_key, header.probes))) {
+        TRACE(0);
+        return NULL;
+    }
+    memcpy(bloom->words, buf + sizeof(header), len - sizeof(header));
+    return bloom;
+}
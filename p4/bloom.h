@@ -0,0 +1,44 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * bloom.h
+ */
+
+#ifndef _BLOOM_H_
+#define _BLOOM_H_
+
+#include "system.h"
+
+/*
+ * A blocked Bloom filter over 64-bit hashes: every hash sets or tests bits
+ * of a single cache line. Adding is safe against concurrent tests.
+ */
+
+struct bloom;
+
+struct bloom *bloom_open(uint64_t keys, uint64_t bits_per_key);
+
+void bloom_close(struct bloom *bloom);
+
+void bloom_add(struct bloom *bloom, uint64_t hash);
+
+/* 0 if hash was never added, otherwise 1 */
+
+int bloom_maybe(const struct bloom *bloom, uint64_t hash);
+
+/* true if keys distinct hashes are more than the filter was sized for */
+
+int bloom_full(const struct bloom *bloom, uint64_t keys);
+
+uint64_t bloom_bits(const struct bloom *bloom);
+
+uint64_t bloom_bits_per_key(const struct bloom *bloom);
+
+u8 *bloom_serialize(const struct bloom *bloom, /*out*/ u64 *len);
+
+struct bloom *bloom_deserialize(const u8 *buf, u64 len);
+
+#endif /* _BLOOM_H_ */
@@ -0,0 +1,101 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * counter.c
+ */
+
+#include "counter.h"
+
+#define STRIPES 32
+#define LINE 64
+
+/**
+ * Threads take stripes round robin the first time they count anything. Past
+ * STRIPES threads, some share a stripe, which the atomic adds allow for.
+ */
+struct counter {
+    uint64_t n;
+    uint64_t stride; /* counters per stripe, rounded up to cache lines */
+    uint64_t *counts;
+};
+
+static __thread uint64_t stripe_; /* the stripe of this thread, plus one */
+static uint64_t next_;
+
+static inline uint64_t *
+stripe(const struct counter *counter) {
+    if (!stripe_) {
+        stripe_ = 1 + __atomic_fetch_add(&next_, 1, __ATOMIC_RELAXED) % STRIPES;
+    }
+    return counter->counts + (stripe_ - 1) * counter->stride;
+}
+
+struct counter *
+counter_open(uint64_t n) {
+    struct counter *counter;
+
+    assert(n);
+
+    if (!(counter = malloc(sizeof(struct counter)))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    counter->n = n;
+    counter->stride = (n * sizeof(uint64_t) + LINE - 1) / LINE * (LINE / sizeof(uint64_t));
+    if (!(counter->counts = aligned_alloc(LINE, STRIPES * counter->stride * sizeof(uint64_t)))) {
+        FREE(counter);
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(counter->counts, 0, STRIPES * counter->stride * sizeof(uint64_t));
+    return counter;
+}
+
+void
+counter_close(struct counter *counter) {
+    if (counter) {
+        FREE(counter->counts);
+        memset(counter, 0, sizeof(struct counter));
+    }
+    FREE(counter);
+}
+
+void
+counter_add(struct counter *counter, uint64_t i, uint64_t v) {
+    assert(i < counter->n);
+
+    __atomic_fetch_add(stripe(counter) + i, v, __ATOMIC_RELAXED);
+}
+
+void
+counter_hist(struct counter *counter, uint64_t i, uint64_t v) {
+    uint64_t b;
+
+    b = (2 > v) ? 0 : (63 - (uint64_t)__builtin_clzll(v));
+    counter_add(counter, i + MIN(b, COUNTER_HIST - 1), 1);
+}
+
+uint64_t
+counter_get(const struct counter *counter, uint64_t i) {
+    uint64_t v;
+
+    counter_read(counter, i, 1, &v);
+    return v;
+}
+
+void
+counter_read(const struct counter *counter, uint64_t i, uint64_t n, uint64_t *buf) {
+    uint64_t j, s;
+
+    assert((i + n) <= counter->n);
+
+    memset(buf, 0, n * sizeof(uint64_t));
+    for (s = 0; s < STRIPES; ++s) {
+        for (j = 0; j < n; ++j) {
+            buf[j] += __atomic_load_n(counter->counts + s * counter->stride + i + j, __ATOMIC_RELAXED);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * counter.h
+ */
+
+#ifndef _COUNTER_H_
+#define _COUNTER_H_
+
+#include "system.h"
+
+/* buckets of a histogram, see counter_hist() */
+
+#define COUNTER_HIST 32
+
+/*
+ * A set of statistics counters, cheap enough to leave on. Each thread adds
+ * to its own stripe of the counters, a cache line apart from the others,
+ * and reading a counter sums the stripes.
+ */
+
+struct counter;
+
+struct counter *counter_open(uint64_t n);
+
+void counter_close(struct counter *counter);
+
+void counter_add(struct counter *counter, uint64_t i, uint64_t v);
+
+/**
+ * Counts v in the histogram of COUNTER_HIST counters from i on: counter
+ * i + b counts the values in [2^b, 2^(b + 1)), counter i also 0 and 1, the
+ * last one everything past it.
+ */
+
+void counter_hist(struct counter *counter, uint64_t i, uint64_t v);
+
+uint64_t counter_get(const struct counter *counter, uint64_t i);
+
+/* n counters from i on into buf */
+
+void counter_read(const struct counter *counter, uint64_t i, uint64_t n, uint64_t *buf);
+
+#endif /* _COUNTER_H_ */
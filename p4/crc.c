@@ -0,0 +1,127 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * crc.c
+ */
+
+#include "crc.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SSE42_PATH
+#endif
+
+/* the reflected Castagnoli polynomial */
+#define POLY 0x82f63b78
+
+/**
+ * The portable path is slicing-by-8: T[k][b] is the CRC of byte b followed
+ * by k zero bytes, so the eight lookups of a 64-bit word are independent of
+ * one another and only their xor depends on the running CRC.
+ */
+
+static uint32_t T[8][256];
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void
+tables(void) {
+    uint32_t c;
+    int i, j, k;
+
+    for (i = 0; i < 256; ++i) {
+        c = (uint32_t)i;
+        for (j = 0; j < 8; ++j) {
+            c = (c >> 1) ^ ((c & 1) ? POLY : 0);
+        }
+        T[0][i] = c;
+    }
+    for (i = 0; i < 256; ++i) {
+        for (k = 1; k < 8; ++k) {
+            T[k][i] = (T[k - 1][i] >> 8) ^ T[0][T[k - 1][i] & 0xff];
+        }
+    }
+}
+
+static uint32_t
+update(uint32_t c, const uint8_t *p, uint64_t len) {
+    uint64_t w;
+
+    pthread_once(&once, tables);
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, sizeof(w));
+        w ^= c;
+        c = T[7][w & 0xff] ^
+            T[6][(w >> 8) & 0xff] ^
+            T[5][(w >> 16) & 0xff] ^
+            T[4][(w >> 24) & 0xff] ^
+            T[3][(w >> 32) & 0xff] ^
+            T[2][(w >> 40) & 0xff] ^
+            T[1][(w >> 48) & 0xff] ^
+            T[0][w >> 56];
+    }
+    for (; len; --len, ++p) {
+        c = (c >> 8) ^ T[0][(c ^ *p) & 0xff];
+    }
+    return c;
+}
+
+#ifdef HAVE_SSE42_PATH
+
+__attribute__((target("sse4.2"))) static uint32_t
+update_sse42(uint32_t c, const uint8_t *p, uint64_t len) {
+    uint64_t c64, w;
+
+    c64 = c;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, sizeof(w));
+        c64 = _mm_crc32_u64(c64, w);
+    }
+    c = (uint32_t)c64;
+    for (; len; --len, ++p) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return c;
+}
+
+static int
+sse42(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+static int
+sse42(void) {
+    return 0;
+}
+
+#endif /* HAVE_SSE42_PATH */
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, uint64_t len) {
+    assert(!len || buf);
+
+#ifdef HAVE_SSE42_PATH
+    if (sse42()) {
+        return ~update_sse42(~crc, (const uint8_t *)buf, len);
+    }
+#endif
+    return ~update(~crc, (const uint8_t *)buf, len);
+}
+
+uint32_t
+crc32c_portable(uint32_t crc, const void *buf, uint64_t len) {
+    assert(!len || buf);
+
+    return ~update(~crc, (const uint8_t *)buf, len);
+}
+
+const char *
+crc32c_backend(void) {
+    return sse42() ? "sse4.2" : "portable";
+}
@@ -0,0 +1,27 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * crc.h
+ */
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include "system.h"
+
+/* CRC32C (Castagnoli) of len bytes following those that gave crc, 0 at first */
+
+uint32_t crc32c(uint32_t crc, const void *buf, uint64_t len);
+
+/* crc32c() without the SSE4.2 instruction, to check the two against each other */
+
+uint32_t crc32c_portable(uint32_t crc, const void *buf, uint64_t len);
+
+/* the path crc32c() takes: "sse4.2" or "portable" */
+
+const char *crc32c_backend(void);
+
+#endif /* _CRC_H_ */
@@ -13,9 +13,14 @@
 #include <sys/types.h>
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include "counter.h"
 #include "device.h"
 
 /**
@@ -28,14 +33,241 @@
  *   close()
  *   pread()
  *   pwrite()
+ *   fdatasync()
+ *   io_uring_setup()
+ *   io_uring_enter()
+ *   mmap()
+ *   munmap()
  */
 
+/*
+ * An io_uring instance shared by all threads. Submitting and reaping happen
+ * under the mutex; one thread at a time waits in the kernel for completions
+ * without it, the others wait on cond for that thread to reap.
+ */
+
+struct ring {
+	int fd; /* -1 if io_uring is not available */
+	unsigned depth;
+	unsigned inflight;
+	int reaping;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	void *sq;
+	size_t sq_size;
+	void *cq;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* counters of a device, see device_stats() */
+
+enum {
+	STAT_READS,
+	STAT_WRITES,
+	STAT_SYNCS,
+	STAT_READ_BYTES,
+	STAT_WRITE_BYTES,
+	STAT_READ_US,
+	STAT_WRITE_US = STAT_READ_US + COUNTER_HIST,
+	STAT_SYNC_US = STAT_WRITE_US + COUNTER_HIST,
+	STATS = STAT_SYNC_US + COUNTER_HIST
+};
+
 struct device {
 	int fd;
 	uint64_t size;  /* immutable */
 	uint64_t block; /* immutable */
+	struct ring ring;
+	struct counter *stats;
 };
 
+static void
+account(struct device *device, int write, uint64_t len, uint64_t us)
+{
+	counter_add(device->stats, write ? STAT_WRITES : STAT_READS, 1);
+	counter_add(device->stats, write ? STAT_WRITE_BYTES : STAT_READ_BYTES, len);
+	counter_hist(device->stats, write ? STAT_WRITE_US : STAT_READ_US, us);
+}
+
+static int
+ring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter,
+			    fd,
+			    submit,
+			    complete,
+			    flags,
+			    NULL,
+			    0);
+}
+
+static void
+ring_close(struct ring *ring)
+{
+	if (0 <= ring->fd) {
+		if (ring->sqes) {
+			munmap(ring->sqes, ring->sqes_size);
+		}
+		if (ring->cq) {
+			munmap(ring->cq, ring->cq_size);
+		}
+		if (ring->sq) {
+			munmap(ring->sq, ring->sq_size);
+		}
+		close(ring->fd);
+		pthread_cond_destroy(&ring->cond);
+		pthread_mutex_destroy(&ring->mutex);
+	}
+	memset(ring, 0, sizeof (struct ring));
+	ring->fd = -1;
+}
+
+/**
+ * Sets up an io_uring of the given depth. Fails quietly, leaving ring->fd at
+ * -1, on kernels without io_uring or where it is disabled; the device then
+ * falls back to pread()/pwrite().
+ */
+
+static void
+ring_open(struct ring *ring, unsigned depth)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof (struct ring));
+	ring->fd = -1;
+	if (!depth) {
+		return;
+	}
+	memset(&params, 0, sizeof (params));
+	if (0 > (ring->fd = (int)syscall(__NR_io_uring_setup, depth, &params))) {
+		ring->fd = -1;
+		return;
+	}
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	ring->depth = MIN(depth, params.sq_entries);
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+	ring->cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof (struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	sq = mmap(NULL,
+		  ring->sq_size,
+		  PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE,
+		  ring->fd,
+		  IORING_OFF_SQ_RING);
+	cq = mmap(NULL,
+		  ring->cq_size,
+		  PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE,
+		  ring->fd,
+		  IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL,
+			  ring->sqes_size,
+			  PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE,
+			  ring->fd,
+			  IORING_OFF_SQES);
+	ring->sq = (MAP_FAILED == sq) ? NULL : sq;
+	ring->cq = (MAP_FAILED == cq) ? NULL : cq;
+	if (MAP_FAILED == ring->sqes) {
+		ring->sqes = NULL;
+	}
+	if (!ring->sq || !ring->cq || !ring->sqes) {
+		TRACE("mmap()");
+		ring_close(ring);
+		return;
+	}
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+static void
+ring_queue(struct device *device, struct device_io *io)
+{
+	struct ring *ring = &device->ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail, i;
+
+	tail = *ring->sq_tail;
+	i = tail & ring->sq_mask;
+	sqe = &ring->sqes[i];
+	memset(sqe, 0, sizeof (struct io_uring_sqe));
+	sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = device->fd;
+	sqe->addr = (uint64_t)(uintptr_t)io->buf;
+	sqe->len = (uint32_t)io->len;
+	sqe->off = io->off;
+	sqe->user_data = (uint64_t)(uintptr_t)io;
+	ring->sq_array[i] = i;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->inflight;
+}
+
+static void
+ring_reap(struct ring *ring)
+{
+	struct io_uring_cqe *cqe;
+	struct device_io *io;
+	unsigned head;
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		io = (struct device_io *)(uintptr_t)cqe->user_data;
+		io->result = ((uint64_t)cqe->res == io->len) ? 0 : -1;
+		--ring->inflight;
+		++head;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Hands the queued entries to the kernel. On a hard failure the entries are
+ * taken back off the ring, which is safe since the kernel only consumes them
+ * from within io_uring_enter(), and failed.
+ */
+
+static void
+ring_submit(struct device *device, struct device_io *ios, uint64_t *n)
+{
+	struct ring *ring = &device->ring;
+	int r;
+
+	while (*n) {
+		if (0 <= (r = ring_enter(ring->fd, (unsigned)(*n), 0, 0))) {
+			*n -= r;
+			continue;
+		}
+		if ((EINTR == errno) || (EAGAIN == errno) || (EBUSY == errno)) {
+			continue;
+		}
+		TRACE("io_uring_enter()");
+		__atomic_store_n(ring->sq_tail,
+				 *ring->sq_tail - (unsigned)(*n),
+				 __ATOMIC_RELEASE);
+		ring->inflight -= (unsigned)(*n);
+		while (*n) {
+			ios[--(*n)].result = -1;
+		}
+	}
+}
+
 static int
 geometry(struct device *device)
 {
@@ -74,6 +306,12 @@ geometry(struct device *device)
 
 struct device *
 device_open(const char *pathname)
+{
+	return device_open_queue(pathname, DEVICE_QUEUE_DEPTH);
+}
+
+struct device *
+device_open_queue(const char *pathname, unsigned depth)
 {
 	struct device *device;
 
@@ -84,6 +322,7 @@ device_open(const char *pathname)
 		return NULL;
 	}
 	memset(device, 0, sizeof (struct device));
+	device->ring.fd = -1;
 	if (0 >= (device->fd = open(pathname, O_RDWR | O_DIRECT))) {
 		if (EACCES == errno) {
 			device_close(device);
@@ -99,6 +338,12 @@ device_open(const char *pathname)
 		TRACE(0);
 		return NULL;
 	}
+	if (!(device->stats = counter_open(STATS))) {
+		device_close(device);
+		TRACE(0);
+		return NULL;
+	}
+	ring_open(&device->ring, depth);
 	return device;
 }
 
@@ -106,6 +351,8 @@ void
 device_close(struct device *device)
 {
 	if (device) {
+		ring_close(&device->ring);
+		counter_close(device->stats);
 		if (0 < device->fd) {
 			if (close(device->fd)) {
 				TRACE("close()");
@@ -119,15 +366,19 @@ device_close(struct device *device)
 int
 device_read(struct device *device, void *buf, uint64_t off, uint64_t len)
 {
+	uint64_t t;
+
 	assert( !len || buf );
 	assert( 0 == (off % device->block) );
 	assert( 0 == (len % device->block) );
 	assert( (off + len) <= device->size );
 
+	t = ref_time();
 	if (len != (uint64_t)pread(device->fd, buf, (size_t)len, (off_t)off)) {
 		TRACE("pread()");
 		return -1;
 	}
+	account(device, 0, len, ref_time() - t);
 	return 0;
 }
 
@@ -137,11 +388,14 @@ device_write(struct device *device,
 	     uint64_t off,
 	     uint64_t len)
 {
+	uint64_t t;
+
 	assert( !len || buf );
 	assert( 0 == (off % device->block) );
 	assert( 0 == (len % device->block) );
 	assert( (off + len) <= device->size );
 
+	t = ref_time();
 	if (len != (uint64_t)pwrite(device->fd,
 				    buf,
 				    (size_t)len,
@@ -149,9 +403,132 @@ device_write(struct device *device,
 		TRACE("pwrite()");
 		return -1;
 	}
+	account(device, 1, len, ref_time() - t);
 	return 0;
 }
 
+int
+device_submit(struct device *device, struct device_io *ios, uint64_t n)
+{
+	struct ring *ring = &device->ring;
+	uint64_t i, j, k, queued, t;
+
+	assert( !n || ios );
+
+	if (0 > ring->fd) {
+		for (i = 0; i < n; ++i) {
+			ios[i].result = ios[i].write ?
+				device_write(device, ios[i].buf, ios[i].off, ios[i].len) :
+				device_read(device, ios[i].buf, ios[i].off, ios[i].len);
+		}
+	}
+	else {
+		t = ref_time();
+		for (i = 0; i < n; ++i) {
+			assert( 0 == (ios[i].off % device->block) );
+			assert( 0 == (ios[i].len % device->block) );
+			assert( (ios[i].off + ios[i].len) <= device->size );
+			ios[i].result = 1;
+		}
+
+		/* i: next to queue, k: oldest that may still be in flight */
+
+		pthread_mutex_lock(&ring->mutex);
+		i = k = 0;
+		while (1) {
+			j = i;
+			while ((i < n) && (ring->inflight < ring->depth)) {
+				ring_queue(device, &ios[i++]);
+			}
+			queued = i - j;
+			ring_submit(device, &ios[j], &queued);
+			while ((k < i) && (1 != ios[k].result)) {
+				++k;
+			}
+			if (k == n) {
+				break;
+			}
+			if (ring->reaping) {
+				pthread_cond_wait(&ring->cond, &ring->mutex);
+				continue;
+			}
+			ring->reaping = 1;
+			pthread_mutex_unlock(&ring->mutex);
+			ring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			pthread_mutex_lock(&ring->mutex);
+			ring->reaping = 0;
+			ring_reap(ring);
+			pthread_cond_broadcast(&ring->cond);
+		}
+		pthread_mutex_unlock(&ring->mutex);
+
+		/* a request of a batch counts the time to complete all of it */
+
+		t = ref_time() - t;
+		for (i = 0; i < n; ++i) {
+			if (!ios[i].result) {
+				account(device, ios[i].write, ios[i].len, t);
+			}
+		}
+	}
+	for (i = 0; i < n; ++i) {
+		if (ios[i].result) {
+			TRACE(ios[i].write ? "device write" : "device read");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+const char *
+device_backend(const struct device *device)
+{
+	assert( device );
+
+	return (0 <= device->ring.fd) ? "io_uring" : "pread/pwrite";
+}
+
+unsigned
+device_depth(const struct device *device)
+{
+	assert( device );
+
+	return (0 <= device->ring.fd) ? device->ring.depth : 1;
+}
+
+int
+device_sync(struct device *device)
+{
+	uint64_t t;
+
+	assert( device );
+
+	t = ref_time();
+	if (fdatasync(device->fd)) {
+		TRACE("fdatasync()");
+		return -1;
+	}
+	counter_add(device->stats, STAT_SYNCS, 1);
+	counter_hist(device->stats, STAT_SYNC_US, ref_time() - t);
+	return 0;
+}
+
+void
+device_stats(const struct device *device, struct device_stats *stats)
+{
+	assert( device );
+	assert( stats );
+
+	stats->reads = counter_get(device->stats, STAT_READS);
+	stats->writes = counter_get(device->stats, STAT_WRITES);
+	stats->syncs = counter_get(device->stats, STAT_SYNCS);
+	stats->read_bytes = counter_get(device->stats, STAT_READ_BYTES);
+	stats->write_bytes = counter_get(device->stats, STAT_WRITE_BYTES);
+	counter_read(device->stats, STAT_READ_US, DEVICE_HIST, stats->read_us);
+	counter_read(device->stats, STAT_WRITE_US, DEVICE_HIST, stats->write_us);
+	counter_read(device->stats, STAT_SYNC_US, DEVICE_HIST, stats->sync_us);
+}
+
 uint64_t
 device_size(const struct device *device)
 {
@@ -12,10 +12,45 @@
 
 #include "system.h"
 
+#define DEVICE_QUEUE_DEPTH 32
+
 struct device;
 
+/* one block aligned request of a device_submit() batch */
+
+struct device_io {
+	void *buf;
+	uint64_t off;
+	uint64_t len;
+	int write;  /* 0: read into buf, 1: write buf */
+	int result; /* out: 0|-1 */
+};
+
+/*
+ * Latencies are in microseconds, bucket i of a histogram counts those in
+ * [2^i, 2^(i + 1)), bucket 0 also those under 1. A request of a batch
+ * counts the time the whole batch took.
+ */
+
+#define DEVICE_HIST 32
+
+struct device_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t syncs;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t read_us[DEVICE_HIST];
+	uint64_t write_us[DEVICE_HIST];
+	uint64_t sync_us[DEVICE_HIST];
+};
+
 struct device *device_open(const char *pathname);
 
+/* depth 0 or no io_uring support: pread()/pwrite(), one request at a time */
+
+struct device *device_open_queue(const char *pathname, unsigned depth);
+
 void device_close(struct device *device);
 
 int device_read(struct device *device, void *buf, uint64_t off, uint64_t len);
@@ -25,8 +60,25 @@ int device_write(struct device *device,
 		 uint64_t off,
 		 uint64_t len);
 
+/**
+ * Issues all n requests, keeping up to the queue depth of them in flight, and
+ * returns once every one has completed. Safe to call from many threads at once.
+ *
+ * return: 0 if every request succeeded, otherwise -1 (see ios[i].result)
+ */
+
+int device_submit(struct device *device, struct device_io *ios, uint64_t n);
+
+int device_sync(struct device *device);
+
+const char *device_backend(const struct device *device);
+
+unsigned device_depth(const struct device *device);
+
 uint64_t device_size(const struct device *device);
 
 uint64_t device_block(const struct device *device);
 
+void device_stats(const struct device *device, struct device_stats *stats);
+
 #endif /* _DEVICE_H_ */
@@ -0,0 +1,160 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * hash.c
+ */
+
+#include "hash.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_PATH
+#endif
+
+#define STRIPE 32
+
+#define P1 0x9e3779b185ebca87ULL
+#define P2 0xc2b2ae3d27d4eb4fULL
+#define P3 0x165667b19e3779f9ULL
+#define P4 0x85ebca77c2b2ae63ULL
+#define P5 0x27d4eb2f165667c5ULL
+
+/**
+ * The input is consumed a stripe of four 64-bit words at a time, one word
+ * per accumulator lane. A lane adds the product of the two 32-bit halves
+ * of its word xor a key, and its neighbour adds the word itself, so that no
+ * input bit is lost when a product is 0. The keys move on with every stripe,
+ * which keeps a stripe's contribution tied to its position. This is the
+ * accumulate step of XXH3, and each step maps onto one AVX2 register.
+ */
+
+static const uint64_t K[4] = {P1, P2, P3, P4};
+
+#define STEP P5
+
+static inline uint64_t
+load64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void
+accumulate(uint64_t acc[4], const uint8_t *p, uint64_t n, uint64_t s) {
+    uint64_t i, j, d, k;
+
+    for (i = 0; i < n; ++i, ++s, p += STRIPE) {
+        for (j = 0; j < 4; ++j) {
+            d = load64(p + 8 * j);
+            k = d ^ (K[j] + s * STEP);
+            acc[j] += (k & 0xffffffff) * (k >> 32);
+            acc[j ^ 1] += d;
+        }
+    }
+}
+
+#ifdef HAVE_AVX2_PATH
+
+__attribute__((target("avx2"))) static void
+accumulate_avx2(uint64_t acc[4], const uint8_t *p, uint64_t n, uint64_t s) {
+    __m256i a, k, d, x, step;
+    uint64_t i;
+
+    a = _mm256_loadu_si256((const __m256i *)acc);
+    k = _mm256_set_epi64x((long long)(K[3] + s * STEP),
+                          (long long)(K[2] + s * STEP),
+                          (long long)(K[1] + s * STEP),
+                          (long long)(K[0] + s * STEP));
+    step = _mm256_set1_epi64x((long long)STEP);
+    for (i = 0; i < n; ++i, p += STRIPE) {
+        d = _mm256_loadu_si256((const __m256i *)p);
+        x = _mm256_xor_si256(d, k);
+        x = _mm256_mul_epu32(x, _mm256_srli_epi64(x, 32));
+        /* swaps the two words of each 128-bit half: lane j ^ 1 */
+        d = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm256_add_epi64(a, _mm256_add_epi64(x, d));
+        k = _mm256_add_epi64(k, step);
+    }
+    _mm256_storeu_si256((__m256i *)acc, a);
+}
+
+static int
+avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static int
+avx2(void) {
+    return 0;
+}
+
+#endif /* HAVE_AVX2_PATH */
+
+static inline uint64_t
+mum(uint64_t a, uint64_t b) {
+    unsigned __int128 r = (unsigned __int128)a * b;
+
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+fmix(uint64_t h) {
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t
+digest(const void *buf, uint64_t len, int simd) {
+    uint64_t acc[4] = {P1, P2, P3, P4};
+    const uint8_t *p = (const uint8_t *)buf;
+    uint8_t last[STRIPE];
+    uint64_t n;
+
+    assert(!len || buf);
+
+    /* a full stripe or two is not worth the switch to vector registers */
+
+    n = len / STRIPE;
+    if (simd && (4 <= n)) {
+#ifdef HAVE_AVX2_PATH
+        accumulate_avx2(acc, p, n, 0);
+#endif
+    }
+    else {
+        accumulate(acc, p, n, 0);
+    }
+
+    /* the tail is zero padded, len below tells "a" from "a\0" */
+
+    if (len % STRIPE) {
+        memset(last, 0, sizeof(last));
+        memcpy(last, p + n * STRIPE, len % STRIPE);
+        accumulate(acc, last, 1, n);
+    }
+    return fmix(mum(acc[0], acc[1] ^ P3) ^ mum(acc[2], acc[3] ^ P4) ^ (len * P5));
+}
+
+uint64_t
+hash(const void *buf, uint64_t len) {
+    return digest(buf, len, avx2());
+}
+
+uint64_t
+hash_portable(const void *buf, uint64_t len) {
+    return digest(buf, len, 0);
+}
+
+const char *
+hash_backend(void) {
+    return avx2() ? "avx2" : "portable";
+}
@@ -0,0 +1,27 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * hash.h
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include "system.h"
+
+/* 64-bit hash of len bytes, the same value on every code path */
+
+uint64_t hash(const void *buf, uint64_t len);
+
+/* hash() without the SIMD path, to check the two against each other */
+
+uint64_t hash_portable(const void *buf, uint64_t len);
+
+/* the path hash() takes for long keys: "avx2" or "portable" */
+
+const char *hash_backend(void);
+
+#endif /* _HASH_H_ */
@@ -8,213 +8,645 @@
  */
 
 #include "index.h"
+#include "crc.h"
+#include "hash.h"
 
-#define LOAD 0.70
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define LOAD 0.875
+#define STRIPES 64
+#define GROUP 16
+#define EMPTY 0x00
+#define MIN_CAPACITY 1024
+#define MIGRATE 128
+#define CHUNK 256
+
+/* the upper 48 bits of the hash, then the key length; 0 in an empty slot */
 struct map {
     uint64_t key;
     uint64_t off;
 };
-struct index {
-    uint64_t size;
-    uint64_t capacity;
+
+/* one per cache line so readers on different stripes do not share lines */
+struct stripe {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
+/**
+ * A Swiss table. Every slot has a control byte, EMPTY or the slot's tag
+ * (the high bit set above 7 bits of the hash), and a probe compares the
+ * tags of a group of 16 slots at once, only looking at the slots whose tag
+ * matches. The first GROUP control bytes are mirrored past the end so that
+ * a group can start at any slot. EMPTY is zero so that a new table comes
+ * straight from calloc() and its pages are faulted in as they are used.
+ */
+struct table {
+    uint64_t capacity; /* a power of two, or 0 */
+    uint8_t *ctrl;
     struct map *maps;
+    struct lazy *lazy; /* parts not paged in yet, see index_attach() */
 };
 
-u8 *index_serialize(struct index *index, /*out*/ u64 *len) {
-    // serialized as a simple unsized array
-    const u64 bytes = sizeof(struct map) * index->size;
-    u8 *buf = malloc(bytes);
-    *len = bytes;
-    memcpy(buf, index->maps, bytes);
-    return buf;
-}
+/**
+ * A saved table, see index_serialize(), is the table itself: a header, the
+ * checksum of every chunk of CHUNK slots, then the chunks, each its control
+ * bytes followed by its slots. An attached table starts out zeroed, so
+ * every slot reads as EMPTY, and a probe pages in the chunks it is about to
+ * look at before it looks. Chunks only ever go from absent to present,
+ * under the mutex, before loaded says so.
+ */
+struct header {
+    uint32_t crc; /* of the rest of the header and the chunk checksums */
+    uint32_t chunk; /* CHUNK */
+    uint64_t capacity;
+    uint64_t size;
+};
 
-struct index *index_deserialize(/*move*/ u8 *buf, u64 len) {
-    struct index *index = index_open();
-    index->maps = buf;
-    const int entries = len / sizeof(struct map);
-    index->size = entries;
-    index->capacity = entries;
-    return index;
+struct lazy {
+    index_fetch_fn fetch;
+    void *arg;
+    uint64_t chunks;
+    uint64_t left; /* chunks not paged in */
+    uint64_t next; /* where index_warm() goes on from */
+    uint32_t *crcs;
+    uint8_t *loaded;
+    uint8_t *buf; /* one chunk */
+    int *failed;
+    pthread_mutex_t mutex;
+};
+
+#define CHUNK_BYTES (CHUNK + CHUNK * sizeof(struct map))
+#define IMAGE_HEAD(chunks) (sizeof(struct header) + (chunks) * sizeof(uint32_t))
+
+/**
+ * Growing does not rehash in one go. The full table becomes old, an empty
+ * table twice its size becomes cur, and every update moves the next MIGRATE
+ * slots of old over; cur is consulted first since a key that has moved may
+ * have been updated since, and an update of a key still in old moves it
+ * first. The migration is over long before cur fills up.
+ *
+ * Readers hold the stripe of the hash they look for. A single writer
+ * fills slots with atomic stores, the slot before its control byte, which
+ * readers of other keys can tolerate since slots are never emptied, and
+ * holds every stripe only to swap the tables.
+ */
+struct index {
+    uint64_t size; /* keys in both tables */
+    uint64_t migrated; /* slots of old moved so far */
+    int failed; /* a chunk did not page in, see index_failed() */
+    struct table cur;
+    struct table old;
+    struct stripe stripes[STRIPES];
+};
+
+#define HASH(k) ((k) >> 16)
+#define TAG(k) (0x80 | (HASH(k) & 0x7f))
+#define POS(k) (HASH(k) >> 7)
+
+static uint64_t
+slot_key(const void *key, uint64_t key_len) {
+    assert(key_len && (0xffff >= key_len));
+
+    return (hash(key, key_len) & ~(uint64_t)0xffff) | key_len;
 }
 
-void index_print(struct index *index) {
-    printf("index: %lu entries\n", index->size);
-    for (int i = 0; i < index->size; ++i) {
-        struct map *map = &index->maps[i];
-        printf("  %lu->%lu\n", map->key, map->off);
+/* bit i set if the control byte of slot pos + i equals byte */
+
+static inline uint32_t
+group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < GROUP; ++i) {
+        mask |= (uint32_t)(ctrl[i] == byte) << i;
     }
+    return mask;
+#endif
 }
 
-static uint64_t
-hash(const void *buf, uint64_t len) {
-    uint64_t i, a, b, c, d;
-    const char *p;
-
-    assert(!len || buf);
-
-    p = (const char *)buf;
-    a = b = c = d = len * 414507281407;
-    for (i = 0; i < len; ++i) {
-        a += (uint64_t)p[i] * 592821132889;
-        b += (uint64_t)p[i] * 963726515729;
-        c += (uint64_t)p[i] * 1765037224331;
-        d += (uint64_t)p[i] * 2428095424619;
-        d ^= c;
-        c = (c << 15) | (c >> (64 - 15));
-        d += c;
-        a ^= d;
-        d = (d << 52) | (d >> (64 - 52));
-        a += d;
-        b ^= a;
-        a = (a << 26) | (a >> (64 - 26));
-        b += a;
-        c ^= b;
-        b = (b << 51) | (b >> (64 - 51));
-        c += b;
-        d ^= c;
-        c = (c << 28) | (c >> (64 - 28));
-        d += c;
-        a ^= d;
-        d = (d << 9) | (d >> (64 - 9));
-        a += d;
-        b ^= a;
-        a = (a << 47) | (a >> (64 - 47));
-        b += a;
-        c ^= b;
-        b = (b << 54) | (b >> (64 - 54));
-        c += b;
-        d ^= c;
-        c = (c << 32) | (c >> (64 - 32));
-        d += c;
-        a ^= d;
-        d = (d << 25) | (d >> (64 - 25));
-        a += d;
-        b ^= a;
-        a = (a << 63) | (a >> (64 - 63));
-        b += a;
-    }
-    return a + b + c + d;
+static void
+drop(struct lazy *lazy) {
+    if (lazy) {
+        pthread_mutex_destroy(&lazy->mutex);
+        FREE(lazy->crcs);
+        FREE(lazy->loaded);
+        FREE(lazy->buf);
+        FREE(lazy);
+    }
 }
 
 static void
-destroy(struct index *index) {
-    FREE(index->maps);
-    memset(index, 0, sizeof(struct index));
+destroy(struct table *table) {
+    drop(table->lazy);
+    FREE(table->ctrl);
+    FREE(table->maps);
+    table->lazy = NULL;
+    table->capacity = 0;
 }
 
 static int
-create(struct index *index, uint64_t capacity) {
-    uint64_t n;
-
-    memset(index, 0, sizeof(struct index));
-    index->capacity = capacity;
-    n = index->capacity * sizeof(index->maps[0]);
-    if (!(index->maps = malloc(n))) {
-        destroy(index);
+create(struct table *table, uint64_t capacity) {
+    for (table->capacity = MIN_CAPACITY; table->capacity < capacity; table->capacity *= 2) {
+    }
+    table->lazy = NULL;
+    table->maps = calloc(table->capacity, sizeof(table->maps[0]));
+    table->ctrl = calloc(table->capacity + GROUP, 1);
+    if (!table->maps || !table->ctrl) {
+        destroy(table);
         TRACE("out of memory");
         return -1;
     }
-    memset(index->maps, 0, n);
     return 0;
 }
 
-static uint64_t *
-update(struct index *index, uint64_t key) {
-    uint64_t i, j;
+/* pages in chunk c of an attached table, at most once */
+
+static int
+page_in(const struct table *table, uint64_t c) {
+    struct lazy *lazy;
+    int r;
+
+    lazy = table->lazy;
+    if (__atomic_load_n(&lazy->loaded[c], __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    r = 0;
+    pthread_mutex_lock(&lazy->mutex);
+    if (!lazy->loaded[c]) {
+        if (lazy->fetch(lazy->arg, lazy->buf, IMAGE_HEAD(lazy->chunks) + c * CHUNK_BYTES, CHUNK_BYTES) ||
+            (lazy->crcs[c] != crc32c(0, lazy->buf, CHUNK_BYTES))) {
+            __atomic_store_n(lazy->failed, 1, __ATOMIC_RELEASE);
+            TRACE("corrupt index");
+            r = -1;
+        } else {
+            memcpy(table->ctrl + c * CHUNK, lazy->buf, CHUNK);
+            if (!c) {
+                memcpy(table->ctrl + table->capacity, lazy->buf, GROUP);
+            }
+            memcpy(table->maps + c * CHUNK, lazy->buf + CHUNK, CHUNK * sizeof(struct map));
+            --lazy->left;
+            __atomic_store_n(&lazy->loaded[c], 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&lazy->mutex);
+    return r;
+}
+
+/* the chunks a group starting at pos, and its slots, lie in */
+
+static int
+page_group(const struct table *table, uint64_t pos) {
+    if (page_in(table, pos / CHUNK) ||
+        ((CHUNK < ((pos % CHUNK) + GROUP)) && page_in(table, (pos / CHUNK + 1) % table->lazy->chunks))) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the slot of key, or NULL, also when the slots of an attached
+ * table did not page in. Groups are probed at triangular
+ * offsets, which visits every group of a power of two table; a table that
+ * is never full always has an empty slot to stop at.
+ */
+
+static struct map *
+probe(const struct table *table, uint64_t key) {
+    uint64_t mask, pos, step, j;
+    uint32_t match;
 
-    for (i = 0; i < index->capacity; ++i) {
-        j = (key + i) % index->capacity;
-        if (!index->maps[j].key) { /* insert */
-            index->maps[j].key = key;
-            index->maps[j].off = 0;
-            ++index->size;
-            return &index->maps[j].off;
+    if (!table->capacity) {
+        return NULL;
+    }
+    mask = table->capacity - 1;
+    pos = POS(key) & mask;
+    /* the slots are a separate miss from the control bytes, overlap the two */
+    __builtin_prefetch(&table->maps[pos]);
+    for (step = GROUP;; step += GROUP) {
+        if (table->lazy && page_group(table, pos)) {
+            return NULL;
+        }
+        match = group_match(table->ctrl + pos, (uint8_t)TAG(key));
+        while (match) {
+            j = (pos + __builtin_ctz(match)) & mask;
+            if (__atomic_load_n(&table->maps[j].key, __ATOMIC_ACQUIRE) == key) {
+                return &table->maps[j];
+            }
+            match &= match - 1;
+        }
+        if (group_match(table->ctrl + pos, EMPTY)) {
+            return NULL;
         }
-        if (index->maps[j].key == key) { /* update */
-            index->maps[j].key = key;
-            return &index->maps[j].off;
+        pos = (pos + step) & mask;
+    }
+}
+
+/**
+ * key must not be in table; off is in place before a reader can see key.
+ * NULL if the slots of an attached table did not page in.
+ */
+
+static struct map *
+place(struct table *table, uint64_t key, uint64_t off) {
+    uint64_t mask, pos, step, j;
+    uint32_t match;
+
+    mask = table->capacity - 1;
+    pos = POS(key) & mask;
+    for (step = GROUP;; step += GROUP) {
+        if (table->lazy && page_group(table, pos)) {
+            return NULL;
+        }
+        if ((match = group_match(table->ctrl + pos, EMPTY))) {
+            j = (pos + __builtin_ctz(match)) & mask;
+            __atomic_store_n(&table->maps[j].off, off, __ATOMIC_RELAXED);
+            __atomic_store_n(&table->maps[j].key, key, __ATOMIC_RELEASE);
+            __atomic_store_n(&table->ctrl[j], (uint8_t)TAG(key), __ATOMIC_RELEASE);
+            if (j < GROUP) {
+                __atomic_store_n(&table->ctrl[table->capacity + j], (uint8_t)TAG(key), __ATOMIC_RELEASE);
+            }
+            return &table->maps[j];
+        }
+        pos = (pos + step) & mask;
+    }
+}
+
+static void
+lock_all(struct index *index) {
+    int i;
+
+    for (i = 0; i < STRIPES; ++i) {
+        pthread_rwlock_wrlock(&index->stripes[i].lock);
+    }
+}
+
+static void
+unlock_all(struct index *index) {
+    int i;
+
+    for (i = 0; i < STRIPES; ++i) {
+        pthread_rwlock_unlock(&index->stripes[i].lock);
+    }
+}
+
+/* moves the next n slots of old to cur, dropping old once it is empty */
+
+static void
+migrate(struct index *index, uint64_t n) {
+    struct table old;
+    struct map *map;
+    uint64_t end;
+
+    if (!index->old.capacity) {
+        return;
+    }
+    end = MIN(index->migrated + n, index->old.capacity);
+    for (; index->migrated < end; ++index->migrated) {
+        map = &index->old.maps[index->migrated];
+        if (map->key && !probe(&index->cur, map->key)) {
+            place(&index->cur, map->key, map->off);
         }
     }
-    EXIT("software");
-    return NULL;
+    if (index->migrated == index->old.capacity) {
+        lock_all(index);
+        old = index->old;
+        memset(&index->old, 0, sizeof(index->old));
+        index->migrated = 0;
+        unlock_all(index);
+        destroy(&old);
+    }
 }
 
 static int
-grow(struct index *index) {
-    struct index index_;
-    double load;
-    uint64_t i;
+resize(struct index *index, uint64_t capacity) {
+    struct table table;
+
+    /* old is walked slot by slot, so it must not be waiting to page in */
+
+    if (0 > index_warm(index, UINT64_MAX)) {
+        TRACE(0);
+        return -1;
+    }
+    migrate(index, index->old.capacity);
+    if (create(&table, capacity)) {
+        TRACE(0);
+        return -1;
+    }
+    lock_all(index);
+    index->old = index->cur;
+    index->cur = table;
+    index->migrated = 0;
+    unlock_all(index);
+    return 0;
+}
 
-    load = index->capacity ? ((double)index->size / index->capacity) : 1.0;
-    if (LOAD < load) {
-        if (create(&index_, (index->capacity + 97) * 3 / 2)) {
+static int
+grow(struct index *index) {
+    if ((index->size + 1) > (uint64_t)(LOAD * index->cur.capacity)) {
+        if (resize(index, 2 * index->cur.capacity)) {
             TRACE(0);
             return -1;
         }
-        for (i = 0; i < index->capacity; ++i) {
-            if (index->maps[i].key) {
-                *(update(&index_, index->maps[i].key)) =
-                    index->maps[i].off;
-            }
+    }
+    migrate(index, MIGRATE);
+    return 0;
+}
+
+/* the slot of key in cur, moved there from old if need be */
+
+static struct map *
+find(struct index *index, uint64_t key) {
+    struct map *map;
+
+    if (!(map = probe(&index->cur, key)) && (map = probe(&index->old, key))) {
+        map = place(&index->cur, key, map->off);
+    }
+    return map;
+}
+
+int
+index_reserve(struct index *index, uint64_t n) {
+    uint64_t capacity;
+
+    capacity = (uint64_t)((index->size + n) / LOAD) + 1;
+    if (capacity > index->cur.capacity) {
+        if (resize(index, MAX(capacity, 2 * index->cur.capacity))) {
+            TRACE(0);
+            return -1;
         }
-        destroy(index);
-        (*index) = index_;
     }
     return 0;
 }
 
 struct index *
 index_open(void) {
+    pthread_rwlockattr_t attr;
     struct index *index;
+    int i;
 
     if (!(index = malloc(sizeof(struct index)))) {
         TRACE("out of memory");
         return NULL;
     }
     memset(index, 0, sizeof(struct index));
+    /* swapping tables must not starve behind a steady stream of readers */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (i = 0; i < STRIPES; ++i) {
+        pthread_rwlock_init(&index->stripes[i].lock, &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
     return index;
 }
 
 void index_close(struct index *index) {
+    int i;
+
     if (index) {
-        FREE(index->maps);
+        destroy(&index->cur);
+        destroy(&index->old);
+        for (i = 0; i < STRIPES; ++i) {
+            pthread_rwlock_destroy(&index->stripes[i].lock);
+        }
         memset(index, 0, sizeof(struct index));
     }
     FREE(index);
 }
 
+uint64_t
+index_key(const void *key, uint64_t key_len) {
+    assert(key && key_len);
+
+    return slot_key(key, key_len);
+}
+
+uint64_t
+index_size(const struct index *index) {
+    return index->size;
+}
+
+int
+index_scan(struct index *index, void (*fn)(void *arg, uint64_t key), void *arg) {
+    uint64_t i;
+
+    if (0 > index_warm(index, UINT64_MAX)) {
+        TRACE(0);
+        return -1;
+    }
+    migrate(index, index->old.capacity);
+    for (i = 0; i < index->cur.capacity; ++i) {
+        if (index->cur.maps[i].key) {
+            fn(arg, index->cur.maps[i].key);
+        }
+    }
+    return 0;
+}
+
 uint64_t *
-index_update(struct index *index, const void *key_, uint64_t key_len) {
-    uint64_t key;
+index_update(struct index *index, const void *key, uint64_t key_len) {
+    return index_update_key(index, slot_key(key, key_len));
+}
 
-    assert(key_ && key_len);
+uint64_t *
+index_update_key(struct index *index, uint64_t key) {
+    struct map *map;
+
+    assert(key);
 
     if (grow(index)) {
         TRACE(0);
         return NULL;
     }
-    key = hash(key_, key_len);
-    key = key ? key : (key + 1);
-    return update(index, key);
+    if (!(map = find(index, key))) {
+        if (index->failed || !(map = place(&index->cur, key, 0))) {
+            TRACE(0);
+            return NULL;
+        }
+        ++index->size;
+    }
+    return &map->off;
 }
 
 uint64_t *
 index_lookup(struct index *index, const char *key_, uint64_t key_len) {
-    uint64_t i, j, key;
+    struct map *map;
 
     assert(key_ && key_len);
 
-    key = hash(key_, key_len);
-    key = key ? key : (key + 1);
-    for (i = 0; i < index->capacity; ++i) {
-        j = (key + i) % index->capacity;
-        if (!index->maps[j].key) {
-            break;
-        }
-        if (index->maps[j].key == key) {
-            return &index->maps[j].off;
+    map = find(index, slot_key(key_, key_len));
+    return map ? &map->off : NULL;
+}
+
+uint64_t
+index_find(struct index *index, const char *key, uint64_t key_len) {
+    return index_find_key(index, slot_key(key, key_len));
+}
+
+uint64_t
+index_find_key(struct index *index, uint64_t key) {
+    struct stripe *stripe;
+    struct map *map;
+    uint64_t off;
+
+    assert(key);
+
+    stripe = &index->stripes[HASH(key) % STRIPES];
+    pthread_rwlock_rdlock(&stripe->lock);
+    if (!(map = probe(&index->cur, key))) {
+        map = probe(&index->old, key);
+    }
+    off = map ? __atomic_load_n(&map->off, __ATOMIC_ACQUIRE) : 0;
+    pthread_rwlock_unlock(&stripe->lock);
+    return off;
+}
+
+int
+index_failed(const struct index *index) {
+    return __atomic_load_n(&index->failed, __ATOMIC_ACQUIRE);
+}
+
+/* saved tables */
+
+u8 *
+index_serialize(struct index *index, /*out*/ u64 *len) {
+    const struct table *table = &index->cur;
+    struct header header;
+    uint32_t *crcs;
+    u64 chunks, c;
+    u8 *buf, *p;
+
+    if (0 > index_warm(index, UINT64_MAX)) {
+        TRACE(0);
+        return NULL;
+    }
+    migrate(index, index->old.capacity);
+    chunks = table->capacity / CHUNK;
+    if (!(buf = malloc(IMAGE_HEAD(chunks) + chunks * CHUNK_BYTES))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    crcs = (uint32_t *)(buf + sizeof(header));
+    for (c = 0; c < chunks; ++c) {
+        p = buf + IMAGE_HEAD(chunks) + c * CHUNK_BYTES;
+        memcpy(p, table->ctrl + c * CHUNK, CHUNK);
+        memcpy(p + CHUNK, table->maps + c * CHUNK, CHUNK * sizeof(struct map));
+        crcs[c] = crc32c(0, p, CHUNK_BYTES);
+    }
+    header.chunk = CHUNK;
+    header.capacity = table->capacity;
+    header.size = index->size;
+    header.crc = crc32c(crc32c(0, &header.chunk, sizeof(header) - sizeof(header.crc)),
+                        crcs,
+                        chunks * sizeof(uint32_t));
+    memcpy(buf, &header, sizeof(header));
+    (*len) = IMAGE_HEAD(chunks) + chunks * CHUNK_BYTES;
+    return buf;
+}
+
+struct index *
+index_attach(u64 len, index_fetch_fn fetch, void *arg) {
+    struct header header;
+    struct index *index;
+    struct lazy *lazy;
+    u64 chunks;
+
+    assert(fetch);
+
+    if (!(index = index_open())) {
+        TRACE(0);
+        return NULL;
+    }
+    memset(&header, 0, sizeof(header));
+    if ((sizeof(header) > len) || fetch(arg, &header, 0, sizeof(header))) {
+        index_close(index);
+        TRACE("corrupt index");
+        return NULL;
+    }
+    chunks = header.capacity / CHUNK;
+    if ((CHUNK != header.chunk) ||
+        (header.capacity & (header.capacity - 1)) ||
+        (header.capacity && (MIN_CAPACITY > header.capacity)) ||
+        (header.size > (uint64_t)(LOAD * header.capacity)) ||
+        (len != (IMAGE_HEAD(chunks) + chunks * CHUNK_BYTES))) {
+        index_close(index);
+        TRACE("corrupt index");
+        return NULL;
+    }
+    if (!(lazy = malloc(sizeof(struct lazy)))) {
+        index_close(index);
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(lazy, 0, sizeof(struct lazy));
+    pthread_mutex_init(&lazy->mutex, NULL);
+    lazy->crcs = malloc(chunks * sizeof(uint32_t) + 1);
+    lazy->loaded = calloc(chunks + 1, 1);
+    lazy->buf = malloc(CHUNK_BYTES);
+    if (!lazy->crcs || !lazy->loaded || !lazy->buf) {
+        drop(lazy);
+        index_close(index);
+        TRACE("out of memory");
+        return NULL;
+    }
+    if (fetch(arg, lazy->crcs, sizeof(header), chunks * sizeof(uint32_t)) ||
+        (header.crc != crc32c(crc32c(0, &header.chunk, sizeof(header) - sizeof(header.crc)),
+                              lazy->crcs,
+                              chunks * sizeof(uint32_t)))) {
+        drop(lazy);
+        index_close(index);
+        TRACE("corrupt index");
+        return NULL;
+    }
+    if (!chunks) {
+        drop(lazy);
+        return index;
+    }
+    if (create(&index->cur, header.capacity)) {
+        drop(lazy);
+        index_close(index);
+        TRACE(0);
+        return NULL;
+    }
+    lazy->fetch = fetch;
+    lazy->arg = arg;
+    lazy->chunks = chunks;
+    lazy->left = chunks;
+    lazy->failed = &index->failed;
+    index->cur.lazy = lazy;
+    index->size = header.size;
+    return index;
+}
+
+int
+index_warm(struct index *index, uint64_t n) {
+    struct lazy *lazy;
+    uint64_t left;
+
+    if (!(lazy = index->cur.lazy)) {
+        return +1;
+    }
+    for (; n && (lazy->next < lazy->chunks); --n, ++lazy->next) {
+        if (page_in(&index->cur, lazy->next)) {
+            TRACE(0);
+            return -1;
         }
     }
-    return NULL;
+    pthread_mutex_lock(&lazy->mutex);
+    left = lazy->left;
+    pthread_mutex_unlock(&lazy->mutex);
+    if (left) {
+        return 0;
+    }
+    lock_all(index);
+    index->cur.lazy = NULL;
+    unlock_all(index);
+    drop(lazy);
+    return +1;
 }
@@ -20,12 +20,65 @@ void index_close(struct index *index);
 
 uint64_t *index_update(struct index *index, const void *key, uint64_t key_len);
 
+/* makes room so that the next n index_update() calls keep their references valid */
+
+int index_reserve(struct index *index, uint64_t n);
+
 uint64_t *index_lookup(struct index *index, const char *key, uint64_t key_len);
 
-u8 *index_serialize(struct index *index, /*out*/ u64 *size);
+/* safe against a concurrent writer, returns a snapshot of the offset or 0 */
+
+uint64_t index_find(struct index *index, const char *key, uint64_t key_len);
+
+/**
+ * The slot key of a key, which the calls taking one use instead of hashing
+ * the key again: the upper 48 bits of its hash, then its length.
+ */
+
+uint64_t index_key(const void *key, uint64_t key_len);
+
+uint64_t *index_update_key(struct index *index, uint64_t key);
+
+uint64_t index_find_key(struct index *index, uint64_t key);
+
+uint64_t index_size(const struct index *index);
+
+/* calls fn with the slot key of every entry */
+
+int index_scan(struct index *index, void (*fn)(void *arg, uint64_t key), void *arg);
+
+/**
+ * The table as it is, to be handed back to index_attach(). Lookups can use
+ * a saved table as soon as it is attached, without rebuilding it.
+ */
+
+u8 *index_serialize(struct index *index, /*out*/ u64 *len);
+
+/* copies the len bytes at pos of a saved table into buf */
+
+typedef int (*index_fetch_fn)(void *arg, void *buf, u64 pos, u64 len);
+
+/**
+ * An index over the len bytes of a saved table that fetch reads from. Only
+ * the header is read up front; every chunk of the table is fetched, and
+ * checked, the first time a probe reaches it, so fetch must keep working
+ * until index_warm() returns +1.
+ */
+
+struct index *index_attach(u64 len, index_fetch_fn fetch, void *arg);
+
+/**
+ * Fetches the next n chunks not paged in yet, and lets go of fetch once they
+ * all are. Walking the whole table, to grow it, scan or save it, first
+ * fetches the rest.
+ *
+ * return: +1 once the whole table is in memory, 0 if not yet, -1 on error
+ */
+
+int index_warm(struct index *index, uint64_t n);
 
-struct index *index_deserialize(u8 *buf, u64 entries);
+/* a chunk failed to page in, lookups since may have missed keys it holds */
 
-void index_print(struct index *index);
+int index_failed(const struct index *index);
 
 #endif /* _INDEX_H_ */
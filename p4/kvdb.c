@@ -9,21 +9,120 @@
 
 #include "kvdb.h"
 
+#include <pthread.h>
+#include <sched.h>
+
+#include "bloom.h"
+#include "counter.h"
+#include "crc.h"
 #include "index.h"
 #include "kvraw.h"
+#include "logfs.h"
+#include "memtable.h"
+#include "skiplist.h"
+
+#define MUTATE_REMOVE KVDB_OP_REMOVE
+#define MUTATE_INSERT KVDB_OP_INSERT
+#define MUTATE_UPDATE KVDB_OP_UPDATE
+#define MUTATE_REPLACE KVDB_OP_REPLACE
+
+/* operations a leader applies at most on behalf of the writers queued */
+#define GROUP_OPS 4096
+
+/* operations a group stages on the stack, single-key writes among them */
+#define GROUP_STACK 8
+
+/* fraction of dead records that triggers a background compaction */
+#define COMPACT_RATIO 0.50
+/* fraction of the log in use before compaction is worth the I/O */
+#define COMPACT_USAGE 0.25
+/* fraction of the log in use at which writers compact in the foreground */
+#define COMPACT_STALL 0.90
+/* records examined per lock acquisition */
+#define COMPACT_BATCH 64
+/* bytes of the log the compactor reads at a time */
+#define COMPACT_WINDOW (256 << 10)
+
+/* Bloom filter bits per key, about 1% false positives */
+#define BLOOM_BITS 10
+/* keys the Bloom filter is sized for at least */
+#define BLOOM_MIN_KEYS 1024
+
+/* bytes appended since the last checkpoint that call for one, replay is no longer */
+#define CHECKPOINT_BYTES (8 << 20)
+
+/* bytes of recent writes lookups find without going to the log */
+#define MEMTABLE_BUDGET (4 << 20)
+
+/* chunks of a saved index the compactor pages in at a time when idle */
+#define WARM_CHUNKS 64
 
-#define MUTATE_REMOVE 1
-#define MUTATE_INSERT 2
-#define MUTATE_UPDATE 3
-#define MUTATE_REPLACE 4
+/* counters of a kvdb, see kvdb_stats() */
+
+enum {
+    STAT_LOOKUPS,
+    STAT_MEMTABLE_HITS,
+    STAT_ABSENT,
+    STAT_BLOOM_NEGATIVES,
+    STAT_CHAIN_WALKS,
+    STAT_CHAIN_HOPS,
+    STAT_USER_BYTES,
+    STAT_COMPACT_BYTES,
+    STAT_HOPS,
+    STATS = STAT_HOPS + COUNTER_HIST
+};
 
 struct kvdb {
     uint64_t size;
     uint64_t waste;
     struct kvraw *kvraw;
     struct index *index;
+    struct skiplist *ordered; /* every live key in order, or NULL */
+    struct memtable *memtable; /* the latest writes, changed holding mutex */
+    /* every slot key in the index; swapped while holding reclaim */
+    struct bloom *bloom;
+    struct counter *stats;
+    /* background compaction */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t compactor;
+    int compacting;
+    int shutdown;
+    struct kvraw_window window; /* read ahead of the walk, under mutex */
+    /* lookups hold it shared, trimming the log waits for them to drain */
+    pthread_rwlock_t reclaim;
+    /* group commit queue */
+    pthread_mutex_t queue_mutex;
+    struct writer *head;
+    struct writer *tail;
+    int sync; /* KVDB_SYNC_* */
+    /* persistence */
+    int persistent;
+    uint64_t checkpointed; /* log size at the last checkpoint */
+    uint64_t checkpoint_bytes; /* appended between checkpoints */
+    uint64_t replayed; /* bytes of log replayed at open */
+    uint64_t image; /* where the saved index being paged in starts */
 };
 
+/* index entries older than the log tail only refer to reclaimed records */
+
+static uint64_t
+chain_head(const struct kvdb *kvdb, uint64_t off) {
+    return (off >= kvraw_tail(kvdb->kvraw)) ? off : 0;
+}
+
+/**
+ * Releases the log before off. A lookup that started earlier may still be
+ * walking a chain into that space, so wait for those to finish first.
+ */
+
+static void
+release(struct kvdb *kvdb, uint64_t off) {
+    pthread_rwlock_wrlock(&kvdb->reclaim);
+    kvraw_trim(kvdb->kvraw, off);
+    pthread_rwlock_unlock(&kvdb->reclaim);
+}
+
 static int
 chain_lookup(struct kvdb *kvdb,
              const void *key,
@@ -32,14 +131,18 @@ chain_lookup(struct kvdb *kvdb,
              uint64_t *val_len, /* in/out */
              uint64_t *off)     /* in/out */
 {
-    uint64_t key_len_, val_len_, off_;
+    uint64_t key_len_, val_len_, off_, hops;
     void *key_, *val_;
     char buf[256];
+    int r;
 
+    r = 0;
+    hops = 0;
     off_ = (*off);
     while (off_) {
         /* speculate with a small key read into a stack buffer */
 
+        ++hops;
         key_ = buf;
         val_ = val;
         key_len_ = MIN(key_len, sizeof(buf));
@@ -51,23 +154,25 @@ chain_lookup(struct kvdb *kvdb,
                          &val_len_,
                          &off_)) {
             TRACE(0);
-            return -1;
+            r = -1;
+            break;
         }
 
         /* key length mismatch or partial mismatch ==> no match */
 
         if ((key_len_ != key_len) ||
-            memcmp(key_, key, MIN(key_len, sizeof(key_)))) {
+            memcmp(key_, key, MIN(key_len, sizeof(buf)))) {
             (*off) = off_;
             continue;
         }
 
         /* key larger than stack buffer ? */
 
-        if (key_len_ > sizeof(key_)) {
+        if (key_len_ > sizeof(buf)) {
             if (!(key_ = malloc(key_len_))) {
                 TRACE(0);
-                return -1;
+                r = -1;
+                break;
             }
             off_ = (*off);
             val_len_ = 0; /* not needed */
@@ -79,7 +184,8 @@ chain_lookup(struct kvdb *kvdb,
                              &off_)) {
                 FREE(key_);
                 TRACE(0);
-                return -1;
+                r = -1;
+                break;
             }
         }
 
@@ -99,9 +205,718 @@ chain_lookup(struct kvdb *kvdb,
         }
         (*off) = off_;
     }
+    counter_add(kvdb->stats, STAT_CHAIN_WALKS, 1);
+    counter_add(kvdb->stats, STAT_CHAIN_HOPS, hops);
+    counter_hist(kvdb->stats, STAT_HOPS, hops);
+    return r;
+}
+
+/* compaction */
+
+static int /* -1|0|+1 : +1 if off holds the current version of a live key */
+is_live(struct kvdb *kvdb,
+        const void *key,
+        uint64_t key_len,
+        uint64_t off,
+        uint64_t **ref) {
+    uint64_t val_len_, off_;
+
+    (*ref) = index_lookup(kvdb->index, key, key_len);
+    if (!(*ref) && index_failed(kvdb->index)) {
+        TRACE(0);
+        return -1;
+    }
+    if (!(*ref) || !(off_ = chain_head(kvdb, *(*ref)))) {
+        return 0;
+    }
+    val_len_ = 0;
+    if (chain_lookup(kvdb, key, key_len, NULL, &val_len_, &off_)) {
+        TRACE(0);
+        return -1;
+    }
+    return ((off_ == off) && val_len_) ? +1 : 0;
+}
+
+/**
+ * Walks up to COMPACT_BATCH records from the tail of the log, but not past
+ * end. Live records are appended again at the head of the log and the index
+ * is pointed at the copy, dead ones are dropped. The space walked over is
+ * released at the end, and the dead records in it are no longer waste; on an
+ * error only up to the last record fully handled. Caller holds kvdb->mutex.
+ */
+
+static int
+compact_batch(struct kvdb *kvdb, uint64_t end) {
+    uint64_t *ref, off, next, key_len, val_len, dead;
+    void *key, *val;
+    int i, live, r;
+
+    if (!(key = malloc(KVDB_MAX_KEY_LEN))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    r = 0;
+    dead = 0;
+    off = kvraw_tail(kvdb->kvraw);
+    for (i = 0; (i < COMPACT_BATCH) && (off < end); ++i) {
+        next = off;
+        key_len = KVDB_MAX_KEY_LEN;
+        val_len = 0;
+        if (kvraw_scan(kvdb->kvraw, &kvdb->window, key, &key_len, NULL, &val_len, &next)) {
+            TRACE(0);
+            r = -1;
+            break;
+        }
+        if (!key_len) {
+            /* a checkpoint, logfs keeps the last one however far the tail goes */
+            off = next;
+            continue;
+        }
+        if (0 > (live = is_live(kvdb, key, key_len, off, &ref))) {
+            TRACE(0);
+            r = -1;
+            break;
+        }
+        if (!live) {
+            /* the dummy record at 0 and tombstones are not counted as waste */
+            if (off && val_len) {
+                ++dead;
+            }
+            off = next;
+            continue;
+        }
+        if (!(val = malloc(val_len))) {
+            TRACE("out of memory");
+            r = -1;
+            break;
+        }
+        next = off;
+        key_len = KVDB_MAX_KEY_LEN;
+        if (kvraw_scan(kvdb->kvraw, &kvdb->window, key, &key_len, val, &val_len, &next) ||
+            kvraw_append(kvdb->kvraw, key, key_len, val, val_len, ref)) {
+            FREE(val);
+            TRACE(0);
+            r = -1;
+            break;
+        }
+        counter_add(kvdb->stats, STAT_COMPACT_BYTES, key_len + val_len);
+        FREE(val);
+        off = next;
+    }
+    FREE(key);
+    kvdb->waste -= MIN(dead, kvdb->waste);
+    release(kvdb, off);
+    return r;
+}
+
+static uint64_t
+log_used(const struct kvdb *kvdb) {
+    return kvraw_size(kvdb->kvraw) - kvraw_tail(kvdb->kvraw);
+}
+
+static int
+should_compact(const struct kvdb *kvdb) {
+    uint64_t records;
+
+    records = kvdb->size + kvdb->waste;
+    return kvdb->waste &&
+           (COMPACT_RATIO <= ((double)kvdb->waste / records)) &&
+           ((COMPACT_USAGE * kvraw_capacity(kvdb->kvraw)) <= log_used(kvdb));
+}
+
+/* checkpoints */
+
+static int
+should_checkpoint(const struct kvdb *kvdb) {
+    return kvdb->persistent &&
+           (kvdb->checkpoint_bytes <= (kvraw_size(kvdb->kvraw) - kvdb->checkpointed));
+}
+
+/**
+ * Appends the counters, the Bloom filter and the index to the log as one
+ * blob, which a persistent open starts from: the size, the waste, the length
+ * of the filter and a CRC of those and the filter, then the filter, then the
+ * index as index_serialize() saves it. Caller holds kvdb->mutex.
+ */
+
+static int
+checkpoint(struct kvdb *kvdb) {
+    u64 index_len, bloom_len, head[4];
+    u8 *index_buf, *bloom_buf, *buf;
+
+    index_buf = index_serialize(kvdb->index, &index_len);
+    bloom_buf = bloom_serialize(kvdb->bloom, &bloom_len);
+    buf = malloc(sizeof(head) + bloom_len + index_len);
+    if (!index_buf || !bloom_buf || !buf) {
+        FREE(index_buf);
+        FREE(bloom_buf);
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    head[0] = kvdb->size;
+    head[1] = kvdb->waste;
+    head[2] = bloom_len;
+    head[3] = crc32c(crc32c(0, head, 3 * sizeof(head[0])), bloom_buf, bloom_len);
+    memcpy(buf, head, sizeof(head));
+    memcpy(buf + sizeof(head), bloom_buf, bloom_len);
+    memcpy(buf + sizeof(head) + bloom_len, index_buf, index_len);
+    FREE(index_buf);
+    FREE(bloom_buf);
+    if (kvraw_saveindex(kvdb->kvraw, buf, sizeof(head) + bloom_len + index_len)) {
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    FREE(buf);
+    kvdb->checkpointed = kvraw_size(kvdb->kvraw);
+    return 0;
+}
+
+static void *
+compactor(void *arg) {
+    struct kvdb *kvdb;
+    uint64_t end;
+
+    kvdb = (struct kvdb *)arg;
+    end = 0;
+    pthread_mutex_lock(&kvdb->mutex);
+    while (!kvdb->shutdown) {
+        /* every so often, in the middle of a pass too, so that replay stays short */
+        if (should_checkpoint(kvdb) && checkpoint(kvdb)) {
+            TRACE(0);
+            /* try again after another interval */
+            kvdb->checkpointed = kvraw_size(kvdb->kvraw);
+        }
+        if (kvraw_tail(kvdb->kvraw) >= end) {
+            /* after a pass, which frees space for reuse */
+            if (kvdb->persistent && end && (kvdb->checkpointed < kvraw_size(kvdb->kvraw)) && checkpoint(kvdb)) {
+                TRACE(0);
+                kvdb->checkpointed = kvraw_size(kvdb->kvraw);
+            }
+            end = 0;
+            if (!should_compact(kvdb)) {
+                /* meanwhile, page in the rest of a saved index */
+                if (!index_warm(kvdb->index, WARM_CHUNKS)) {
+                    pthread_mutex_unlock(&kvdb->mutex);
+                    sched_yield();
+                    pthread_mutex_lock(&kvdb->mutex);
+                    continue;
+                }
+                pthread_cond_wait(&kvdb->cond, &kvdb->mutex);
+                continue;
+            }
+            /* a pass covers the log as it is now */
+            end = kvraw_size(kvdb->kvraw);
+        }
+        if (compact_batch(kvdb, end)) {
+            TRACE(0);
+            end = 0;
+            pthread_cond_wait(&kvdb->cond, &kvdb->mutex);
+            continue;
+        }
+        /* let foreground operations in between batches */
+        pthread_mutex_unlock(&kvdb->mutex);
+        sched_yield();
+        pthread_mutex_lock(&kvdb->mutex);
+    }
+    pthread_mutex_unlock(&kvdb->mutex);
+    return NULL;
+}
+
+/* group commit */
+
+/**
+ * Writers queue up, the one at the head becomes the leader and applies
+ * the operations of everyone queued behind it with a single log append,
+ * then hands the results back. Followers only wait.
+ */
+
+struct writer {
+    struct kvdb_op *ops;
+    uint64_t n;
+    void *val;         /* single remove: receives the removed value */
+    uint64_t *val_len; /* in/out */
+    int r;
+    int done;
+    pthread_cond_t cond;
+    struct writer *next;
+};
+
+/* map from index slot to the last record of the group chained on it */
+
+struct pending {
+    uint64_t *ref;
+    int64_t rec;
+};
+
+static struct pending *
+pending_slot(struct pending *map, uint64_t mask, const uint64_t *ref) {
+    uint64_t i;
+
+    i = (((uint64_t)(uintptr_t)ref >> 3) * 0x9e3779b97f4a7c15ULL) >> 32;
+    while (map[i & mask].ref && (map[i & mask].ref != ref)) {
+        ++i;
+    }
+    return &map[i & mask];
+}
+
+/**
+ * Decides the outcome of the operations of the writers [head, last] in
+ * order and lays out the records to append. The state a later operation
+ * observes includes the earlier ones, as if they had been applied one by
+ * one. Caller holds kvdb->mutex.
+ */
+
+static int
+stage_group(struct kvdb *kvdb,
+            struct writer *head,
+            struct writer *last,
+            struct kvraw_rec *recs,
+            int64_t *prevs,
+            struct pending *map,
+            uint64_t mask,
+            uint64_t *m) {
+    uint64_t i, off, key, val_len_;
+    struct pending *slot;
+    struct kvdb_op *op;
+    struct writer *w;
+    const void *val_;
+    uint64_t *ref;
+    int exists;
+    int64_t k;
+
+    for (w = head; w != last->next; w = w->next) {
+        for (i = 0; i < w->n; ++i) {
+            op = &w->ops[i];
+            key = index_key(op->key, op->key_len);
+            if (!(ref = index_update_key(kvdb->index, key))) {
+                TRACE(0);
+                return -1;
+            }
+            slot = pending_slot(map, mask, ref);
+            if (!slot->ref) {
+                slot->ref = ref;
+                slot->rec = -1;
+            }
+
+            /* earlier in the group ? */
+
+            exists = -1;
+            val_len_ = 0;
+            for (k = slot->rec; 0 <= k; k = prevs[k]) {
+                if ((recs[k].key_len == op->key_len) &&
+                    !memcmp(recs[k].key, op->key, op->key_len)) {
+                    exists = !!recs[k].val_len;
+                    val_len_ = recs[k].val_len;
+                    if ((MUTATE_REMOVE == op->type) && exists && w->val_len) {
+                        memcpy(w->val, recs[k].val, MIN(val_len_, (*w->val_len)));
+                    }
+                    break;
+                }
+            }
+
+            /* written lately ? */
+
+            if (0 > exists) {
+                val_ = ((MUTATE_REMOVE == op->type) && w->val_len) ? w->val : NULL;
+                val_len_ = val_ ? (*w->val_len) : 0;
+                if (!memtable_get(kvdb->memtable, key, op->key, op->key_len, (void *)val_, &val_len_)) {
+                    exists = !!val_len_;
+                }
+            }
+
+            /* chained, unless the filter knows better */
+
+            if ((0 > exists) && !bloom_maybe(kvdb->bloom, key)) {
+                exists = 0;
+                val_len_ = 0;
+            }
+            if (0 > exists) {
+                off = chain_head(kvdb, (*ref));
+                val_ = ((MUTATE_REMOVE == op->type) && w->val_len) ? w->val : NULL;
+                val_len_ = val_ ? (*w->val_len) : 0;
+                if (chain_lookup(kvdb, op->key, op->key_len, (void *)val_, &val_len_, &off)) {
+                    TRACE(0);
+                    return -1;
+                }
+                exists = off && val_len_;
+            }
+
+            /* mutate */
+
+            if (MUTATE_REMOVE == op->type) {
+                if (!exists) {
+                    op->result = +1; /* invalid key */
+                    continue;
+                }
+                if (w->val_len) {
+                    (*w->val_len) = val_len_;
+                }
+                --kvdb->size;
+                ++kvdb->waste;
+            } else if (MUTATE_INSERT == op->type) {
+                if (exists) {
+                    op->result = +1; /* key exists */
+                    continue;
+                }
+                ++kvdb->size;
+            } else if (MUTATE_UPDATE == op->type) {
+                if (!exists) {
+                    ++kvdb->size;
+                } else {
+                    ++kvdb->waste;
+                }
+            } else if (MUTATE_REPLACE == op->type) {
+                if (!exists) {
+                    op->result = +1; /* invalid key */
+                    continue;
+                }
+                ++kvdb->waste;
+            }
+            op->result = 0;
+            if (MUTATE_REMOVE != op->type) {
+                bloom_add(kvdb->bloom, key);
+            }
+            recs[*m].key = op->key;
+            recs[*m].key_len = op->key_len;
+            recs[*m].val = (MUTATE_REMOVE == op->type) ? NULL : op->val;
+            recs[*m].val_len = (MUTATE_REMOVE == op->type) ? 0 : op->val_len;
+            recs[*m].prev = slot->rec;
+            recs[*m].off = (*ref);
+            prevs[*m] = slot->rec;
+            slot->rec = (int64_t)(*m)++;
+        }
+    }
     return 0;
 }
 
+/**
+ * Allocates the ordered index nodes the keys of the successful inserts and
+ * updates may need, so that nothing can fail once the records are in the
+ * log. nodes[j] is for the j-th operation of the group.
+ */
+
+static int
+stage_order(struct writer *head, struct writer *last, struct skiplist_node **nodes) {
+    struct kvdb_op *op;
+    struct writer *w;
+    uint64_t i, j;
+
+    j = 0;
+    for (w = head; w != last->next; w = w->next) {
+        for (i = 0; i < w->n; ++i, ++j) {
+            op = &w->ops[i];
+            if (!op->result &&
+                ((MUTATE_INSERT == op->type) || (MUTATE_UPDATE == op->type)) &&
+                !(nodes[j] = skiplist_node(op->key, op->key_len))) {
+                TRACE(0);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void
+apply_order(struct kvdb *kvdb,
+            struct writer *head,
+            struct writer *last,
+            struct skiplist_node **nodes) {
+    struct kvdb_op *op;
+    struct writer *w;
+    uint64_t i, j;
+
+    j = 0;
+    for (w = head; w != last->next; w = w->next) {
+        for (i = 0; i < w->n; ++i, ++j) {
+            op = &w->ops[i];
+            if (op->result) {
+                continue;
+            }
+            if (MUTATE_REMOVE == op->type) {
+                skiplist_remove(kvdb->ordered, op->key, op->key_len);
+            } else if (nodes[j]) {
+                skiplist_insert(kvdb->ordered, nodes[j]);
+                nodes[j] = NULL;
+            }
+        }
+    }
+}
+
+static void
+free_nodes(struct skiplist_node **nodes, uint64_t n) {
+    uint64_t i;
+
+    if (nodes) {
+        for (i = 0; i < n; ++i) {
+            skiplist_free(nodes[i]);
+        }
+    }
+}
+
+/* Bloom filter */
+
+static void
+bloom_key(void *bloom, uint64_t key) {
+    bloom_add((struct bloom *)bloom, key);
+}
+
+/* a filter with room for twice the keys in the index, filled from it */
+
+static struct bloom *
+bloom_build(struct kvdb *kvdb, uint64_t keys, uint64_t bits_per_key) {
+    struct bloom *bloom;
+
+    keys = MAX(keys, 2 * index_size(kvdb->index));
+    if (!(bloom = bloom_open(MAX(keys, BLOOM_MIN_KEYS), bits_per_key))) {
+        TRACE(0);
+        return NULL;
+    }
+    if (index_scan(kvdb->index, bloom_key, bloom)) {
+        bloom_close(bloom);
+        TRACE(0);
+        return NULL;
+    }
+    return bloom;
+}
+
+/**
+ * Replaces a filter past its size, which would let through more and more
+ * absent keys, with a larger one. Caller holds kvdb->mutex.
+ */
+
+static int
+bloom_grow(struct kvdb *kvdb) {
+    struct bloom *bloom, *old;
+
+    if (!bloom_full(kvdb->bloom, index_size(kvdb->index))) {
+        return 0;
+    }
+    if (!(bloom = bloom_build(kvdb, 0, bloom_bits_per_key(kvdb->bloom)))) {
+        TRACE(0);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&kvdb->reclaim);
+    old = kvdb->bloom;
+    kvdb->bloom = bloom;
+    pthread_rwlock_unlock(&kvdb->reclaim);
+    bloom_close(old);
+    return 0;
+}
+
+/**
+ * Applies the operations of the writers [head, last] with one append to
+ * the log, then points the index at the new chain heads. On failure none
+ * of the operations take effect. Caller holds kvdb->mutex.
+ */
+
+static int
+apply_group(struct kvdb *kvdb, struct writer *head, struct writer *last) {
+    struct skiplist_node *nodes_[GROUP_STACK], **nodes;
+    struct kvraw_rec recs_[GROUP_STACK], *recs;
+    struct pending map_[2 * GROUP_STACK], *map;
+    uint64_t i, n, m, mask, size, waste;
+    int64_t prevs_[GROUP_STACK], *prevs;
+    struct writer *w;
+    int heap;
+
+    /* out of log space ? compact in the foreground */
+
+    while (kvdb->waste &&
+           ((COMPACT_STALL * kvraw_capacity(kvdb->kvraw)) <= log_used(kvdb))) {
+        if (compact_batch(kvdb, kvraw_size(kvdb->kvraw))) {
+            TRACE(0);
+            return -1;
+        }
+    }
+
+    /* space compaction freed is reused once a checkpoint has recorded it */
+
+    if (kvdb->persistent &&
+        (kvraw_saved_tail(kvdb->kvraw) < kvraw_tail(kvdb->kvraw)) &&
+        ((COMPACT_STALL * kvraw_capacity(kvdb->kvraw)) <=
+         (kvraw_size(kvdb->kvraw) - kvraw_saved_tail(kvdb->kvraw))) &&
+        checkpoint(kvdb)) {
+        TRACE(0);
+        return -1;
+    }
+
+    if (bloom_grow(kvdb)) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* references into the index must survive the whole group */
+
+    n = 0;
+    for (w = head; w != last->next; w = w->next) {
+        n += w->n;
+    }
+    if (index_reserve(kvdb->index, n)) {
+        TRACE(0);
+        return -1;
+    }
+    for (mask = 1; mask < 2 * n; mask <<= 1) {
+    }
+    heap = (GROUP_STACK < n);
+    if (heap) {
+        recs = malloc(n * sizeof(recs[0]));
+        prevs = malloc(n * sizeof(prevs[0]));
+        map = calloc(mask, sizeof(map[0]));
+        nodes = kvdb->ordered ? calloc(n, sizeof(nodes[0])) : NULL;
+        if (!recs || !prevs || !map || (kvdb->ordered && !nodes)) {
+            FREE(recs);
+            FREE(prevs);
+            FREE(map);
+            FREE(nodes);
+            TRACE("out of memory");
+            return -1;
+        }
+    } else {
+        recs = recs_;
+        prevs = prevs_;
+        map = memset(map_, 0, mask * sizeof(map[0]));
+        nodes = kvdb->ordered ? memset(nodes_, 0, n * sizeof(nodes[0])) : NULL;
+    }
+    size = kvdb->size;
+    waste = kvdb->waste;
+    m = 0;
+    if (stage_group(kvdb, head, last, recs, prevs, map, mask - 1, &m) ||
+        (nodes && stage_order(head, last, nodes)) ||
+        kvraw_append_batch(kvdb->kvraw, recs, m)) {
+        kvdb->size = size;
+        kvdb->waste = waste;
+        for (w = head; w != last->next; w = w->next) {
+            for (i = 0; i < w->n; ++i) {
+                w->ops[i].result = -1;
+            }
+        }
+        free_nodes(nodes, n);
+        if (heap) {
+            FREE(recs);
+            FREE(prevs);
+            FREE(map);
+            FREE(nodes);
+        }
+        TRACE(0);
+        return -1;
+    }
+    for (i = 0; i < mask; ++i) {
+        if (map[i].ref && (0 <= map[i].rec)) {
+            __atomic_store_n(map[i].ref, recs[map[i].rec].off, __ATOMIC_RELEASE);
+        }
+    }
+    for (i = 0; i < m; ++i) {
+        counter_add(kvdb->stats, STAT_USER_BYTES, recs[i].key_len + recs[i].val_len);
+        memtable_put(kvdb->memtable,
+                     index_key(recs[i].key, recs[i].key_len),
+                     recs[i].key,
+                     recs[i].key_len,
+                     recs[i].val,
+                     recs[i].val_len,
+                     recs[i].off);
+    }
+    if (memtable_full(kvdb->memtable)) {
+        memtable_evict(kvdb->memtable, kvraw_flushed(kvdb->kvraw));
+    }
+    if (nodes) {
+        apply_order(kvdb, head, last, nodes);
+    }
+    free_nodes(nodes, n);
+    if (heap) {
+        FREE(recs);
+        FREE(prevs);
+        FREE(map);
+        FREE(nodes);
+    }
+    return 0;
+}
+
+static int /* -1|0 */
+commit(struct kvdb *kvdb,
+       struct kvdb_op *ops,
+       uint64_t n,
+       void *val,
+       uint64_t *val_len) {
+    struct writer w, *last, *stop, *p;
+    uint64_t count, end;
+    int r;
+
+    memset(&w, 0, sizeof(w));
+    w.ops = ops;
+    w.n = n;
+    w.val = val;
+    w.val_len = val_len;
+    pthread_cond_init(&w.cond, NULL);
+
+    pthread_mutex_lock(&kvdb->queue_mutex);
+    if (kvdb->tail) {
+        kvdb->tail->next = &w;
+    } else {
+        kvdb->head = &w;
+    }
+    kvdb->tail = &w;
+    while (!w.done && (kvdb->head != &w)) {
+        pthread_cond_wait(&w.cond, &kvdb->queue_mutex);
+    }
+    if (w.done) {
+        pthread_mutex_unlock(&kvdb->queue_mutex);
+        pthread_cond_destroy(&w.cond);
+        return w.r;
+    }
+    pthread_mutex_unlock(&kvdb->queue_mutex);
+
+    /* leader: take the writers queued so far */
+
+    pthread_mutex_lock(&kvdb->mutex);
+    pthread_mutex_lock(&kvdb->queue_mutex);
+    last = &w;
+    count = w.n;
+    while (last->next && ((count + last->next->n) <= GROUP_OPS)) {
+        last = last->next;
+        count += last->n;
+    }
+    pthread_mutex_unlock(&kvdb->queue_mutex);
+
+    r = apply_group(kvdb, &w, last);
+    end = kvraw_size(kvdb->kvraw);
+    if (!r && (should_compact(kvdb) || should_checkpoint(kvdb))) {
+        pthread_cond_signal(&kvdb->cond);
+    }
+    pthread_mutex_unlock(&kvdb->mutex);
+
+    /* wake up the next leader, it appends while this group syncs */
+
+    pthread_mutex_lock(&kvdb->queue_mutex);
+    stop = last->next;
+    kvdb->head = stop;
+    if (!kvdb->head) {
+        kvdb->tail = NULL;
+    }
+    if (kvdb->head) {
+        pthread_cond_signal(&kvdb->head->cond);
+    }
+    pthread_mutex_unlock(&kvdb->queue_mutex);
+
+    if (!r && (KVDB_SYNC_BATCH == kvdb->sync) && kvraw_sync(kvdb->kvraw, end)) {
+        TRACE(0);
+        r = -1;
+    }
+
+    /* hand out the results */
+
+    pthread_mutex_lock(&kvdb->queue_mutex);
+    for (p = w.next; p != stop; p = p->next) {
+        p->r = r;
+        p->done = 1;
+        pthread_cond_signal(&p->cond);
+    }
+    pthread_mutex_unlock(&kvdb->queue_mutex);
+    pthread_cond_destroy(&w.cond);
+    return r;
+}
+
 static int /* -1|0|+1 */
 mutate(struct kvdb *kvdb,
        const void *key,
@@ -109,142 +924,294 @@ mutate(struct kvdb *kvdb,
        void *val,
        uint64_t *val_len,
        int mode) {
-    uint64_t *ref, off;
-    uint64_t val_len_;
-    void *val_;
+    struct kvdb_op op;
 
-    /* index */
+    op.type = mode;
+    op.key = key;
+    op.key_len = key_len;
+    op.val = (MUTATE_REMOVE == mode) ? NULL : val;
+    op.val_len = (MUTATE_REMOVE == mode) ? 0 : (*val_len);
+    op.result = -1;
+    if (commit(kvdb,
+               &op,
+               1,
+               (MUTATE_REMOVE == mode) ? val : NULL,
+               (MUTATE_REMOVE == mode) ? val_len : NULL)) {
+        TRACE(0);
+        return -1;
+    }
+    return op.result;
+}
+
+/* persistence */
+
+/* reads the saved index in place, see index_attach() */
 
-    if (!(ref = index_update(kvdb->index, key, key_len))) {
+static int
+fetch_index(void *arg, void *buf, u64 pos, u64 len) {
+    struct kvdb *kvdb;
+
+    kvdb = (struct kvdb *)arg;
+    return kvraw_readindex(kvdb->kvraw, buf, kvdb->image + pos, len);
+}
+
+/**
+ * Starts from the checkpoint, see checkpoint(), if there is one. Only the
+ * counters and the filter are read here, the index pages itself in as it
+ * is used. The log it does not cover starts at *off, 0 without a checkpoint.
+ */
+
+static int
+load(struct kvdb *kvdb, uint64_t *off) {
+    u64 blob, blob_len, head[4];
+    u8 *buf;
+
+    if (kvraw_getindex(kvdb->kvraw, &blob, &blob_len, off)) {
+        TRACE(0);
+        return -1;
+    }
+    if (!blob_len) {
+        (*off) = 0;
+        if (!(kvdb->index = index_open())) {
+            TRACE(0);
+            return -1;
+        }
+        return 0;
+    }
+    if ((sizeof(head) > blob_len) || kvraw_readindex(kvdb->kvraw, head, blob, sizeof(head))) {
+        TRACE("corrupt checkpoint");
+        return -1;
+    }
+    if ((blob_len - sizeof(head)) < head[2]) {
+        TRACE("corrupt checkpoint");
+        return -1;
+    }
+    if (!(buf = malloc(head[2] ? head[2] : 1))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    if (kvraw_readindex(kvdb->kvraw, buf, blob + sizeof(head), head[2]) ||
+        (head[3] != crc32c(crc32c(0, head, 3 * sizeof(head[0])), buf, head[2]))) {
+        FREE(buf);
+        TRACE("corrupt checkpoint");
+        return -1;
+    }
+    kvdb->size = head[0];
+    kvdb->waste = head[1];
+    kvdb->bloom = bloom_deserialize(buf, head[2]);
+    FREE(buf);
+    if (!kvdb->bloom) {
         TRACE(0);
         return -1;
     }
-    off = (*ref);
-
-    /* chained */
-
-    val_ = ((MUTATE_REMOVE == mode) && val_len) ? val : NULL;
-    val_len_ = ((MUTATE_REMOVE == mode) && val_len) ? (*val_len) : 0;
-    if (chain_lookup(kvdb, key, key_len, val_, &val_len_, &off)) {
+    kvdb->image = blob + sizeof(head) + head[2];
+    if (!(kvdb->index = index_attach(blob_len - sizeof(head) - head[2], fetch_index, kvdb))) {
         TRACE(0);
         return -1;
     }
+    return 0;
+}
 
-    /* mutate */
+/**
+ * Applies a record of the log past the checkpoint, as the write that appended
+ * it did. Whether the key was there before is down the chain it was written
+ * on. The counters only see writes, so after a crash waste also counts the
+ * dead records an unfinished compaction pass had already dropped.
+ */
 
-    if (MUTATE_REMOVE == mode) {
-        if (!off || !val_len_) {
-            return +1; /* invalid key */
-        }
-        if (kvraw_append(kvdb->kvraw,
-                         key,
-                         key_len,
-                         0,
-                         0,
-                         ref)) {
+static int
+replay(void *arg,
+       const void *key,
+       uint64_t key_len,
+       uint64_t val_len,
+       uint64_t off,
+       uint64_t prev) {
+    struct kvdb *kvdb;
+    uint64_t k, off_, val_len_, *ref;
+    int exists;
+
+    kvdb = (struct kvdb *)arg;
+    k = index_key(key, key_len);
+    if (!(ref = index_update_key(kvdb->index, k))) {
+        TRACE(0);
+        return -1;
+    }
+    exists = 0;
+    if (bloom_maybe(kvdb->bloom, k) && (off_ = chain_head(kvdb, prev))) {
+        val_len_ = 0;
+        if (chain_lookup(kvdb, key, key_len, NULL, &val_len_, &off_)) {
             TRACE(0);
             return -1;
         }
-        if (val_len) {
-            (*val_len) = val_len_;
+        exists = off_ && val_len_;
+    }
+    if (val_len) {
+        if (exists) {
+            ++kvdb->waste;
+        } else {
+            ++kvdb->size;
         }
+        bloom_add(kvdb->bloom, k);
+    } else if (exists) {
         --kvdb->size;
         ++kvdb->waste;
-    } else if (MUTATE_INSERT == mode) {
-        if (off && val_len_) {
-            return +1; /* key exists */
-        }
-        if (kvraw_append(kvdb->kvraw,
-                         key,
-                         key_len,
-                         val,
-                         (*val_len),
-                         ref)) {
-            TRACE(0);
-            return -1;
-        }
-        ++kvdb->size;
-    } else if (MUTATE_UPDATE == mode) {
-        if (!off || !val_len_) {
-            ++kvdb->size;
-        } else {
-            ++kvdb->waste;
-        }
-        if (kvraw_append(kvdb->kvraw,
-                         key,
-                         key_len,
-                         val,
-                         (*val_len),
-                         ref)) {
-            TRACE(0);
-            return -1;
-        }
-    } else if (MUTATE_REPLACE == mode) {
-        if (!off || !val_len_) {
-            return +1; /* invalid key */
-        }
-        if (kvraw_append(kvdb->kvraw,
-                         key,
-                         key_len,
-                         val,
-                         (*val_len),
-                         ref)) {
+    }
+    (*ref) = off;
+    return 0;
+}
+
+/**
+ * Replays the log from off, which a persistent kvraw_open() has found the end
+ * of, and starts a log that has no checkpoint yet with one.
+ */
+
+static int
+recover(struct kvdb *kvdb, uint64_t off) {
+    uint64_t end;
+
+    if (!off) {
+        if (checkpoint(kvdb)) {
             TRACE(0);
             return -1;
         }
-        ++kvdb->waste;
+        return 0;
+    }
+    end = kvraw_size(kvdb->kvraw);
+    kvdb->checkpointed = off;
+    kvdb->replayed = end - off;
+    if (kvraw_recover(kvdb->kvraw, &off, end, replay, kvdb)) {
+        TRACE(0);
+        return -1;
+    }
+    if (off != end) {
+        TRACE("corrupt data");
+        return -1;
     }
     return 0;
 }
 
 static struct kvdb *
-open(const char *pathname, bool enable_persistence) {
+open(const char *pathname,
+     bool enable_persistence,
+     const struct kvdb_options *options) {
+    struct kvraw_options kvraw_options;
+    pthread_rwlockattr_t attr;
     struct kvdb *kvdb;
-    printf("opening %s with persistence %d \n", pathname, enable_persistence);
+    uint64_t off;
+
     assert(safe_strlen(pathname));
 
+    if (enable_persistence && options && options->ordered) {
+        TRACE("the ordered option is not persistent");
+        return NULL;
+    }
+
     if (!(kvdb = malloc(sizeof(struct kvdb)))) {
         TRACE("out of memory");
         return NULL;
     }
     memset(kvdb, 0, sizeof(struct kvdb));
-    if (!(kvdb->kvraw = kvraw_open(pathname, enable_persistence)) ||
-        !(kvdb->index = index_open())) {
+    memset(&kvraw_options, 0, sizeof(kvraw_options));
+    if (options) {
+        kvraw_options.logfs.cache_budget = options->cache_budget;
+        kvraw_options.logfs.sync = options->sync;
+        kvraw_options.logfs.sync_interval = options->sync_interval;
+        kvraw_options.read_prefix = options->read_prefix;
+        kvraw_options.compress_min = options->compress_min;
+        kvdb->sync = options->sync;
+    }
+    kvdb->persistent = enable_persistence;
+    kvdb->checkpoint_bytes = (options && options->checkpoint_bytes) ? options->checkpoint_bytes : CHECKPOINT_BYTES;
+    off = 0;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&kvdb->reclaim, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&kvdb->mutex, NULL);
+    pthread_mutex_init(&kvdb->queue_mutex, NULL);
+    pthread_cond_init(&kvdb->cond, NULL);
+    kvdb->window.cap = COMPACT_WINDOW;
+    if (!(kvdb->window.buf = malloc(kvdb->window.cap))) {
+        kvdb_close(kvdb);
+        TRACE("out of memory");
+        return NULL;
+    }
+    if (!(kvdb->stats = counter_open(STATS)) ||
+        !(kvdb->memtable = memtable_open((options && options->memtable_budget) ? options->memtable_budget : MEMTABLE_BUDGET)) ||
+        !(kvdb->kvraw = kvraw_open(pathname, enable_persistence, &kvraw_options)) ||
+        (enable_persistence ? load(kvdb, &off) : !(kvdb->index = index_open()))) {
+        kvdb_close(kvdb);
+        TRACE(0);
+        return NULL;
+    }
+    if (options && index_reserve(kvdb->index, options->expected_keys)) {
+        kvdb_close(kvdb);
+        TRACE(0);
+        return NULL;
+    }
+    if (!kvdb->bloom &&
+        !(kvdb->bloom = bloom_build(kvdb,
+                                    options ? options->expected_keys : 0,
+                                    (options && options->bloom_bits) ? options->bloom_bits : BLOOM_BITS))) {
+        kvdb_close(kvdb);
+        TRACE(0);
+        return NULL;
+    }
+    if (enable_persistence && recover(kvdb, off)) {
+        kvdb_close(kvdb);
+        TRACE(0);
+        return NULL;
+    }
+    if (options && options->ordered && !(kvdb->ordered = skiplist_open())) {
         kvdb_close(kvdb);
         TRACE(0);
         return NULL;
     }
-    if (enable_persistence) {
-        u64 buf_len = 0;
-        u8 *buf = kvraw_getindex(kvdb->kvraw, &buf_len);
-        kvdb->index = index_deserialize(buf, buf_len);
-        printf("Loaded index with %ld bytes\n", buf_len);
-        index_print(kvdb->index);
+    if (pthread_create(&kvdb->compactor, NULL, compactor, kvdb)) {
+        kvdb_close(kvdb);
+        TRACE("pthread_create()");
+        return NULL;
     }
+    kvdb->compacting = 1;
     return kvdb;
 }
 
 struct kvdb *kvdb_open(const char *pathname) {
-    return open(pathname, false);
+    return open(pathname, false, NULL);
+}
+
+struct kvdb *kvdb_open_options(const char *pathname,
+                               const struct kvdb_options *options) {
+    return open(pathname, options && options->persistent, options);
 }
 
 struct kvdb *kvdb_open_persistent(const char *pathname) {
-    return open(pathname, true);
+    return open(pathname, true, NULL);
 }
 
 void kvdb_close(struct kvdb *kvdb) {
     if (kvdb) {
-        // persist the index
-        u64 size = 0;
-        u8 *index_buf = index_serialize(kvdb->index, &size);
-        printf("Saving index with %ld bytes\n", size);
-        index_print(kvdb->index);
-        kvraw_saveindex(kvdb->kvraw, index_buf, size);
-
-        free(index_buf);
-
+        if (kvdb->compacting) {
+            pthread_mutex_lock(&kvdb->mutex);
+            kvdb->shutdown = 1;
+            pthread_cond_signal(&kvdb->cond);
+            pthread_mutex_unlock(&kvdb->mutex);
+            pthread_join(kvdb->compactor, NULL);
+            if (kvdb->persistent && (kvdb->checkpointed < kvraw_size(kvdb->kvraw)) && checkpoint(kvdb)) {
+                TRACE(0);
+            }
+        }
         kvraw_close(kvdb->kvraw);
         index_close(kvdb->index);
+        bloom_close(kvdb->bloom);
+        skiplist_close(kvdb->ordered);
+        memtable_close(kvdb->memtable);
+        counter_close(kvdb->stats);
+        FREE(kvdb->window.buf);
+        pthread_cond_destroy(&kvdb->cond);
+        pthread_mutex_destroy(&kvdb->mutex);
+        pthread_mutex_destroy(&kvdb->queue_mutex);
+        pthread_rwlock_destroy(&kvdb->reclaim);
         memset(kvdb, 0, sizeof(struct kvdb));
     }
     FREE(kvdb);
@@ -324,28 +1291,60 @@ kvdb_replace(struct kvdb *kvdb,
                   MUTATE_REPLACE);
 }
 
-int /* -1|0|+1 */
-kvdb_lookup(struct kvdb *kvdb,
-            const void *key,
-            uint64_t key_len,
-            void *val,
-            uint64_t *val_len) {
-    const uint64_t *ref;
-    uint64_t val_len_;
+/**
+ * The head of the chain the key of slot key would be on, or 0 without
+ * consulting the index when the filter rules the key out. Caller holds
+ * kvdb->reclaim.
+ */
+
+static uint64_t
+find_head(struct kvdb *kvdb, uint64_t slot) {
+    if (!bloom_maybe(kvdb->bloom, slot)) {
+        counter_add(kvdb->stats, STAT_BLOOM_NEGATIVES, 1);
+        return 0;
+    }
+    return chain_head(kvdb, index_find_key(kvdb->index, slot));
+}
+
+static int
+absent(struct kvdb *kvdb) {
+    counter_add(kvdb->stats, STAT_ABSENT, 1);
+    return +1; /* invalid key */
+}
+
+static int /* -1|0|+1 */
+lookup(struct kvdb *kvdb,
+       const void *key,
+       uint64_t key_len,
+       void *val,
+       uint64_t *val_len) {
+    uint64_t val_len_, slot;
     uint64_t off;
     void *val_;
 
-    assert(kvdb);
-    assert(key);
-    assert(key_len && (KVDB_MAX_KEY_LEN >= key_len));
-    assert(!val_len || !(*val_len) || val);
+    /* written lately */
+
+    slot = index_key(key, key_len);
+    val_len_ = val_len ? (*val_len) : 0;
+    if (!memtable_get(kvdb->memtable, slot, key, key_len, val_len ? val : NULL, &val_len_)) {
+        counter_add(kvdb->stats, STAT_MEMTABLE_HITS, 1);
+        if (!val_len_) {
+            return absent(kvdb);
+        }
+        if (val_len) {
+            (*val_len) = val_len_;
+        }
+        return 0;
+    }
 
     /* index */
-    ref = index_lookup(kvdb->index, key, key_len);
-    if (!ref || !(*ref)) {
-        return +1; /* invalid key */
+    if (!(off = find_head(kvdb, slot))) {
+        if (index_failed(kvdb->index)) {
+            TRACE(0);
+            return -1;
+        }
+        return absent(kvdb);
     }
-    off = (*ref);
 
     /* chained */
 
@@ -355,7 +1354,7 @@ kvdb_lookup(struct kvdb *kvdb,
         return -1;
     }
     if (!off || !val_len_) {
-        return +1; /* invalid key */
+        return absent(kvdb);
     }
     if (val_len) {
         (*val_len) = val_len_;
@@ -363,6 +1362,221 @@ kvdb_lookup(struct kvdb *kvdb,
     return 0;
 }
 
+int /* -1|0|+1 */
+kvdb_lookup(struct kvdb *kvdb,
+            const void *key,
+            uint64_t key_len,
+            void *val,
+            uint64_t *val_len) {
+    int r;
+
+    assert(kvdb);
+    assert(key);
+    assert(key_len && (KVDB_MAX_KEY_LEN >= key_len));
+    assert(!val_len || !(*val_len) || val);
+
+    counter_add(kvdb->stats, STAT_LOOKUPS, 1);
+    pthread_rwlock_rdlock(&kvdb->reclaim);
+    r = lookup(kvdb, key, key_len, val, val_len);
+    pthread_rwlock_unlock(&kvdb->reclaim);
+    return r;
+}
+
+int /* -1|0|+1 */
+kvdb_lookup_ref(struct kvdb *kvdb,
+                const void *key,
+                uint64_t key_len,
+                struct kvdb_ref *ref) {
+    uint64_t off, val_len;
+    int r;
+
+    assert(kvdb);
+    assert(key);
+    assert(key_len && (KVDB_MAX_KEY_LEN >= key_len));
+    assert(ref);
+
+    memset(ref, 0, sizeof(struct kvdb_ref));
+    counter_add(kvdb->stats, STAT_LOOKUPS, 1);
+    pthread_rwlock_rdlock(&kvdb->reclaim);
+
+    /* find the record, learning the value length, then view the value */
+
+    r = +1;
+    val_len = 0;
+    if ((off = find_head(kvdb, index_key(key, key_len)))) {
+        r = chain_lookup(kvdb, key, key_len, NULL, &val_len, &off) ? -1 : +1;
+    } else if (index_failed(kvdb->index)) {
+        TRACE(0);
+        r = -1;
+    }
+    if ((+1 == r) && off && val_len) {
+        r = kvraw_value_ref(kvdb->kvraw, off, key_len, val_len, &ref->view) ? -1 : 0;
+        ref->val_len = r ? 0 : val_len;
+    } else if (+1 == r) {
+        absent(kvdb);
+    }
+    pthread_rwlock_unlock(&kvdb->reclaim);
+    return r;
+}
+
+/* a lookup that found a record with a value of val_len, 0 if removed */
+
+static int
+found(struct kvdb *kvdb, struct kvdb_get *get, uint64_t val_len) {
+    if (!val_len) {
+        return absent(kvdb);
+    }
+    get->val_len = val_len;
+    return 0;
+}
+
+int /* -1|0 */
+kvdb_multi_lookup(struct kvdb *kvdb, struct kvdb_get *gets, uint64_t n) {
+    uint64_t i, j, m, off, len, slot, val_len;
+    struct kvraw_get *reads;
+    struct kvdb_get *get;
+    uint64_t *which;
+    char *keys;
+
+    assert(kvdb);
+    assert(!n || gets);
+
+    for (i = 0, len = 0; i < n; ++i) {
+        assert(gets[i].key);
+        assert(gets[i].key_len && (KVDB_MAX_KEY_LEN >= gets[i].key_len));
+        assert(!gets[i].val_len || gets[i].val);
+        len += gets[i].key_len;
+    }
+    reads = malloc(n * sizeof(reads[0]));
+    which = malloc(n * sizeof(which[0]));
+    keys = malloc(len);
+    if (!reads || !which || !keys) {
+        FREE(reads);
+        FREE(which);
+        FREE(keys);
+        TRACE("out of memory");
+        return -1;
+    }
+    pthread_rwlock_rdlock(&kvdb->reclaim);
+
+    /* the memtable, the filter and the index for every key first */
+
+    m = 0;
+    len = 0;
+    for (i = 0; i < n; ++i) {
+        get = &gets[i];
+        counter_add(kvdb->stats, STAT_LOOKUPS, 1);
+        slot = index_key(get->key, get->key_len);
+        val_len = get->val_len;
+        if (!memtable_get(kvdb->memtable, slot, get->key, get->key_len, get->val, &val_len)) {
+            counter_add(kvdb->stats, STAT_MEMTABLE_HITS, 1);
+            get->result = found(kvdb, get, val_len);
+            continue;
+        }
+        if (!(off = find_head(kvdb, slot))) {
+            get->result = index_failed(kvdb->index) ? -1 : absent(kvdb);
+            continue;
+        }
+        reads[m].key = keys + len;
+        reads[m].key_len = get->key_len;
+        reads[m].val = get->val;
+        reads[m].val_len = get->val_len;
+        reads[m].off = off;
+        which[m++] = i;
+        len += get->key_len;
+    }
+
+    /* then the records at the heads of their chains, together */
+
+    if (m && kvraw_lookup_batch(kvdb->kvraw, reads, m)) {
+        TRACE(0);
+    }
+    for (j = 0; j < m; ++j) {
+        get = &gets[which[j]];
+        counter_add(kvdb->stats, STAT_CHAIN_WALKS, 1);
+        counter_add(kvdb->stats, STAT_CHAIN_HOPS, 1);
+        counter_hist(kvdb->stats, STAT_HOPS, 1);
+        if (reads[j].result) {
+            get->result = -1;
+            continue;
+        }
+        if ((reads[j].key_len == get->key_len) && !memcmp(reads[j].key, get->key, get->key_len)) {
+            get->result = found(kvdb, get, reads[j].val_len);
+            continue;
+        }
+
+        /* another key hashed to the same chain, walk the rest of it */
+
+        off = reads[j].off;
+        val_len = get->val_len;
+        if (off && chain_lookup(kvdb, get->key, get->key_len, get->val, &val_len, &off)) {
+            get->result = -1;
+            continue;
+        }
+        get->result = off ? found(kvdb, get, val_len) : absent(kvdb);
+    }
+    pthread_rwlock_unlock(&kvdb->reclaim);
+    FREE(reads);
+    FREE(which);
+    FREE(keys);
+    return 0;
+}
+
+void
+kvdb_release(struct kvdb *kvdb, struct kvdb_ref *ref) {
+    assert(kvdb);
+    assert(ref);
+
+    kvraw_release(kvdb->kvraw, &ref->view);
+    ref->val_len = 0;
+}
+
+int /* -1|0 */
+kvdb_write_batch(struct kvdb *kvdb, struct kvdb_op *ops, uint64_t n) {
+    uint64_t i;
+
+    assert(kvdb);
+    assert(!n || ops);
+
+    for (i = 0; i < n; ++i) {
+        assert(ops[i].key);
+        assert(ops[i].key_len && (KVDB_MAX_KEY_LEN >= ops[i].key_len));
+        assert((MUTATE_REMOVE == ops[i].type) ||
+               (ops[i].val &&
+                ops[i].val_len &&
+                (KVDB_MAX_VAL_LEN >= ops[i].val_len)));
+        ops[i].result = -1;
+    }
+    if (!n) {
+        return 0;
+    }
+    return commit(kvdb, ops, n, NULL, NULL);
+}
+
+int
+kvdb_compact(struct kvdb *kvdb) {
+    uint64_t end;
+
+    assert(kvdb);
+
+    pthread_mutex_lock(&kvdb->mutex);
+    end = kvraw_size(kvdb->kvraw);
+    while (kvraw_tail(kvdb->kvraw) < end) {
+        if (compact_batch(kvdb, end)) {
+            pthread_mutex_unlock(&kvdb->mutex);
+            TRACE(0);
+            return -1;
+        }
+    }
+    if (kvdb->persistent && checkpoint(kvdb)) {
+        pthread_mutex_unlock(&kvdb->mutex);
+        TRACE(0);
+        return -1;
+    }
+    pthread_mutex_unlock(&kvdb->mutex);
+    return 0;
+}
+
 uint64_t
 kvdb_size(const struct kvdb *kvdb) {
     assert(kvdb);
@@ -376,3 +1590,154 @@ kvdb_waste(const struct kvdb *kvdb) {
 
     return kvdb->waste;
 }
+
+void
+kvdb_stats(struct kvdb *kvdb, struct kvdb_stats *stats) {
+    assert(kvdb);
+    assert(stats);
+
+    memset(stats, 0, sizeof(struct kvdb_stats));
+    pthread_rwlock_rdlock(&kvdb->reclaim);
+    stats->bloom_bits = bloom_bits(kvdb->bloom);
+    pthread_rwlock_unlock(&kvdb->reclaim);
+    stats->log_bytes = log_used(kvdb);
+    stats->log_capacity = kvraw_capacity(kvdb->kvraw);
+    stats->replay_bytes = kvdb->replayed;
+    stats->lookups = counter_get(kvdb->stats, STAT_LOOKUPS);
+    stats->memtable_hits = counter_get(kvdb->stats, STAT_MEMTABLE_HITS);
+    stats->memtable_bytes = memtable_bytes(kvdb->memtable);
+    stats->absent = counter_get(kvdb->stats, STAT_ABSENT);
+    stats->bloom_negatives = counter_get(kvdb->stats, STAT_BLOOM_NEGATIVES);
+    stats->bloom_false_positives = stats->absent - MIN(stats->absent, stats->bloom_negatives);
+    stats->bloom_fp_rate = stats->absent ? (double)stats->bloom_false_positives / stats->absent : 0.0;
+    stats->chain_walks = counter_get(kvdb->stats, STAT_CHAIN_WALKS);
+    stats->chain_hops = counter_get(kvdb->stats, STAT_CHAIN_HOPS);
+    counter_read(kvdb->stats, STAT_HOPS, KVDB_HIST, stats->hops);
+    stats->user_bytes = counter_get(kvdb->stats, STAT_USER_BYTES);
+    stats->compact_bytes = counter_get(kvdb->stats, STAT_COMPACT_BYTES);
+    kvraw_stats(kvdb->kvraw, &stats->logfs);
+    stats->write_amp = stats->user_bytes ? (double)stats->logfs.device.write_bytes / stats->user_bytes : 0.0;
+}
+
+/* ordered iteration */
+
+struct kvdb_iter {
+    struct kvdb *kvdb;
+    struct skiplist_cursor cursor;
+    void *prefix;
+    uint64_t prefix_len;
+    void *key;
+    uint64_t key_len;
+    int valid;
+};
+
+/* the cursor moves in key order, so the first key out of prefix ends it */
+
+static int /* 0|+1 */
+bound(struct kvdb_iter *iter, int r) {
+    if (!r &&
+        ((iter->key_len < iter->prefix_len) ||
+         memcmp(iter->key, iter->prefix, iter->prefix_len))) {
+        r = +1;
+    }
+    iter->valid = !r;
+    return r;
+}
+
+struct kvdb_iter *
+kvdb_iter_open(struct kvdb *kvdb, const void *prefix, uint64_t prefix_len) {
+    struct kvdb_iter *iter;
+
+    assert(kvdb);
+    assert(!prefix_len || prefix);
+    assert(KVDB_MAX_KEY_LEN >= prefix_len);
+
+    if (!kvdb->ordered) {
+        TRACE("kvdb opened without an ordered index");
+        return NULL;
+    }
+    if (!(iter = malloc(sizeof(struct kvdb_iter)))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(iter, 0, sizeof(struct kvdb_iter));
+    iter->kvdb = kvdb;
+    iter->prefix_len = prefix_len;
+    if (!(iter->key = malloc(KVDB_MAX_KEY_LEN)) ||
+        !(iter->prefix = malloc(MAX(prefix_len, 1)))) {
+        kvdb_iter_close(iter);
+        TRACE("out of memory");
+        return NULL;
+    }
+    memcpy(iter->prefix, prefix, prefix_len);
+    return iter;
+}
+
+void
+kvdb_iter_close(struct kvdb_iter *iter) {
+    if (iter) {
+        FREE(iter->key);
+        FREE(iter->prefix);
+        memset(iter, 0, sizeof(struct kvdb_iter));
+    }
+    FREE(iter);
+}
+
+int /* 0|+1 */
+kvdb_iter_seek(struct kvdb_iter *iter, const void *key, uint64_t key_len) {
+    int d;
+
+    assert(iter);
+    assert(!key || (key_len && (KVDB_MAX_KEY_LEN >= key_len)));
+
+    /* nothing before the prefix can match */
+
+    d = key ? memcmp(key, iter->prefix, MIN(key_len, iter->prefix_len)) : -1;
+    if ((0 > d) || (!d && (key_len < iter->prefix_len))) {
+        key = iter->prefix;
+        key_len = iter->prefix_len;
+    }
+    return bound(iter,
+                 skiplist_seek(iter->kvdb->ordered,
+                               &iter->cursor,
+                               key,
+                               key_len,
+                               iter->key,
+                               &iter->key_len));
+}
+
+int /* 0|+1 */
+kvdb_iter_next(struct kvdb_iter *iter) {
+    assert(iter);
+
+    if (!iter->valid) {
+        return +1;
+    }
+    return bound(iter,
+                 skiplist_next(iter->kvdb->ordered,
+                               &iter->cursor,
+                               iter->key,
+                               &iter->key_len));
+}
+
+const void *
+kvdb_iter_key(const struct kvdb_iter *iter, uint64_t *key_len) {
+    assert(iter);
+    assert(key_len);
+
+    if (!iter->valid) {
+        return NULL;
+    }
+    (*key_len) = iter->key_len;
+    return iter->key;
+}
+
+int /* -1|0|+1 */
+kvdb_iter_value(struct kvdb_iter *iter, void *val, uint64_t *val_len) {
+    assert(iter);
+
+    if (!iter->valid) {
+        return +1;
+    }
+    return kvdb_lookup(iter->kvdb, iter->key, iter->key_len, val, val_len);
+}
@@ -10,15 +10,123 @@
 #ifndef _KVDB_H_
 #define _KVDB_H_
 
+#include "logfs.h"
 #include "system.h"
 
 #define KVDB_MAX_KEY_LEN 0xffff
 #define KVDB_MAX_VAL_LEN 0xffffffff
 
+#define KVDB_OP_REMOVE 1
+#define KVDB_OP_INSERT 2
+#define KVDB_OP_UPDATE 3
+#define KVDB_OP_REPLACE 4
+
+/*
+ * A kvdb handle may be shared by any number of threads. Lookups run
+ * concurrently with each other and with the writer; mutations and
+ * background compaction are serialized.
+ */
+
 struct kvdb;
 
+/*
+ * When a mutation is on stable storage:
+ *
+ * KVDB_SYNC_NONE     : eventually, and at kvdb_close()
+ * KVDB_SYNC_PERIODIC : within sync_interval microseconds
+ * KVDB_SYNC_BATCH    : before it returns; one sync per group commit
+ * KVDB_SYNC_OP       : before it returns; one sync per record appended
+ */
+
+#define KVDB_SYNC_NONE 0
+#define KVDB_SYNC_PERIODIC 1
+#define KVDB_SYNC_BATCH 2
+#define KVDB_SYNC_OP 3
+
+struct kvdb_options {
+	uint64_t cache_budget; /* bytes of read cache, 0 for the default */
+	int sync; /* KVDB_SYNC_* */
+	uint64_t sync_interval; /* KVDB_SYNC_PERIODIC, 0 for the default */
+	uint64_t read_prefix; /* bytes read per record up front, 0 for the default */
+	uint64_t expected_keys; /* sizes the index up front, 0 to grow as needed */
+	int ordered; /* keeps the keys in order as well, for kvdb_iter_*() */
+	uint64_t bloom_bits; /* Bloom filter bits per key, 0 for the default */
+	uint64_t compress_min; /* values at least this long are compressed if
+				  that saves space, 0 to store them as is */
+	int persistent; /* as kvdb_open_persistent(), not with ordered */
+	uint64_t memtable_budget; /* bytes of recent writes kept in memory
+				     for lookups, 0 for the default */
+	uint64_t checkpoint_bytes; /* persistent: log appended between
+				      checkpoints, and so about the most
+				      replayed after a crash, 0 for the
+				      default */
+};
+
+/* buckets of the kvdb_stats histograms, like those of struct device_stats */
+
+#define KVDB_HIST LOGFS_HIST
+
+/*
+ * Lookups of absent keys consult a Bloom filter before the index and the
+ * log. A false positive is one it let through, to find nothing or a
+ * removed key.
+ */
+
+struct kvdb_stats {
+	uint64_t log_bytes; /* records in the log, live or not */
+	uint64_t log_capacity; /* bytes the log holds at most */
+	uint64_t replay_bytes; /* of the log past the checkpoint, at open */
+	uint64_t lookups; /* kvdb_lookup() and kvdb_lookup_ref() calls */
+	uint64_t memtable_hits; /* of those, answered from recent writes */
+	uint64_t memtable_bytes; /* of recent writes kept */
+	uint64_t absent; /* lookups of keys not in the kvdb */
+	uint64_t bloom_negatives; /* of those, answered by the filter alone */
+	uint64_t bloom_false_positives;
+	double bloom_fp_rate; /* false positives over absent */
+	uint64_t bloom_bits; /* size of the filter */
+	uint64_t chain_walks; /* index chains walked, by reads, writes and compaction */
+	uint64_t chain_hops; /* records read on those walks */
+	uint64_t hops[KVDB_HIST]; /* walks by records read, log2 buckets */
+	uint64_t user_bytes; /* keys and values written by the caller */
+	uint64_t compact_bytes; /* keys and values rewritten by compaction */
+	double write_amp; /* bytes written to the device over user_bytes */
+	struct logfs_stats logfs;
+};
+
+struct kvdb_op {
+	int type; /* KVDB_OP_* */
+	const void *key;
+	uint64_t key_len;
+	const void *val; /* unused by KVDB_OP_REMOVE */
+	uint64_t val_len;
+	int result; /* out: -1|0|+1 as the matching kvdb_*() call */
+};
+
+struct kvdb_get {
+	const void *key;
+	uint64_t key_len;
+	void *val; /* may be NULL */
+	uint64_t val_len; /* in/out, as kvdb_lookup() */
+	int result; /* out: -1|0|+1 as kvdb_lookup() */
+};
+
+/*
+ * A read-only view of a value, valid until kvdb_release(). The val_len bytes
+ * are view.iov[0 .. view.iovcnt) in order: pinned read cache pages, or a
+ * single copy when the value is still in the write buffer, is compressed,
+ * spans more than LOGFS_REF_PAGES pages or the cache is short on slots.
+ */
+
+struct kvdb_ref {
+	uint64_t val_len;
+	struct logfs_ref view;
+};
+
 struct kvdb *kvdb_open(const char *pathname);
 
+struct kvdb *kvdb_open_options(const char *pathname,
+			       const struct kvdb_options *options);
+
 struct kvdb *kvdb_open_persistent(const char *pathname);
 
 void kvdb_close(struct kvdb *kvdb);
@@ -58,8 +166,79 @@ kvdb_lookup(struct kvdb *kvdb,
 	    void *val,
 	    uint64_t *val_len); /* in/out */
 
+/*
+ * Like kvdb_lookup() but without copying the value, or having to know its
+ * length. Every successful call must be paired with kvdb_release(), before
+ * the kvdb is closed.
+ */
+
+int /* -1|0|+1 */
+kvdb_lookup_ref(struct kvdb *kvdb,
+		const void *key,
+		uint64_t key_len,
+		struct kvdb_ref *ref); /* out */
+
+void kvdb_release(struct kvdb *kvdb, struct kvdb_ref *ref);
+
+/*
+ * Applies the operations in order, with a single log append. Writers that
+ * arrive concurrently are committed together. Returns -1 if the batch could
+ * not be written, otherwise the outcome of each operation is in its result.
+ */
+
+int /* -1|0 */
+kvdb_write_batch(struct kvdb *kvdb, struct kvdb_op *ops, uint64_t n);
+
+/*
+ * kvdb_lookup() of n keys. The index is consulted for all of them before
+ * any record is read, then the records are read together, so the device
+ * sees a few requests in flight at once in log order rather than n reads
+ * one after the other. Returns -1 if out of memory, otherwise the outcome
+ * of each lookup is in its result.
+ */
+
+int /* -1|0 */
+kvdb_multi_lookup(struct kvdb *kvdb, struct kvdb_get *gets, uint64_t n);
+
+int kvdb_compact(struct kvdb *kvdb);
+
 uint64_t kvdb_size(const struct kvdb *kvdb);
 
 uint64_t kvdb_waste(const struct kvdb *kvdb);
 
+void kvdb_stats(struct kvdb *kvdb, struct kvdb_stats *stats); /* out */
+
+/*
+ * Walks the keys in memcmp() order, shorter keys first on a tie, limited to
+ * those that start with prefix (any key if prefix_len is 0). Needs a kvdb
+ * opened with the ordered option. The walk sees the writes that commit
+ * while it goes on, and skips keys removed from under it.
+ *
+ * kvdb_iter_seek() moves to the first key at or after key, or the first key
+ * overall if key is NULL. kvdb_iter_next() moves on by one. Both return +1
+ * once the keys run out, after which kvdb_iter_key() returns NULL.
+ * kvdb_iter_value() is kvdb_lookup() of the current key.
+ */
+
+struct kvdb_iter;
+
+struct kvdb_iter *kvdb_iter_open(struct kvdb *kvdb,
+				 const void *prefix,
+				 uint64_t prefix_len);
+
+void kvdb_iter_close(struct kvdb_iter *iter);
+
+int /* 0|+1 */
+kvdb_iter_seek(struct kvdb_iter *iter, const void *key, uint64_t key_len);
+
+int /* 0|+1 */
+kvdb_iter_next(struct kvdb_iter *iter);
+
+const void *kvdb_iter_key(const struct kvdb_iter *iter, uint64_t *key_len);
+
+int /* -1|0|+1 */
+kvdb_iter_value(struct kvdb_iter *iter,
+		void *val,
+		uint64_t *val_len); /* in/out */
+
 #endif /* _KVDB_H_ */
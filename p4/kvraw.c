@@ -9,48 +9,264 @@
 
 #include "kvraw.h"
 
+#include "crc.h"
 #include "logfs.h"
+#include "lz.h"
+
 #define META_LEN (sizeof(struct meta))
 
 #define KEY_OFF(o) ((o) + META_LEN)
-#define VAL_OFF(o) ((o) + META_LEN + meta.key_len)
+#define VAL_OFF(o) ((o) + META_LEN + meta->key_len)
+
+/* bytes read per record up front, covering small records entirely */
+#define READ_PREFIX 256
+#define READ_PREFIX_MAX 4096
+
+/* the value is LZ compressed, after its 4 byte uncompressed length */
+#define META_LZ 0x01
+#define LZ_HEADER 4
+/* a checkpoint, not a key and value, which has no key */
+#define META_AUX 0x02
 
+/* bytes read at a time by the recovery scan */
+#define RECOVER_CHUNK (1024 * 1024)
+
+/* records a batch stages on the stack, as any single-key write */
+#define BATCH_STACK 8
+
+/**
+ * size and tail are written by a single appender and read concurrently,
+ * they are published with release stores so that a reader that observes
+ * an offset below size also observes the record bytes.
+ */
 struct kvraw {
     uint64_t size;
+    uint64_t tail;
+    uint64_t prefix; /* immutable */
+    uint64_t compress_min; /* immutable, 0 if off */
+    uint32_t epoch; /* of the records appended, see logfs_epoch() */
     struct logfs *logfs;
 };
 
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 #pragma pack(push, 1)
 struct meta {
     char mark[2];
+    uint8_t flags;
     uint64_t off;
     uint16_t key_len;
-    uint32_t val_len;
+    uint32_t val_len; /* as stored */
+    uint32_t epoch;
+    uint32_t crc; /* CRC32C of offset, header, key and stored value, with crc 0 */
 };
 #pragma pack(pop)
 
+/* bytes to read of the record at off to cover n bytes, 0 if it cannot be there */
+
+static uint64_t
+meta_span(uint64_t off, uint64_t n, uint64_t size) {
+    if ((off + META_LEN) > size) {
+        TRACE("corrupt data");
+        return 0;
+    }
+    return MIN(MAX(n, META_LEN), size - off);
+}
+
+/* the reads of a scan, nocache, go past the read cache */
+
 static int
-read_meta(struct kvraw *kvraw, uint64_t off, struct meta *meta) {
-    memset(meta, 0, sizeof(struct meta));
-    if ((off + META_LEN) > kvraw->size) {
+log_read(struct kvraw *kvraw, void *buf, uint64_t off, uint64_t n, bool nocache) {
+    if (nocache) {
+        return logfs_read_nocache(kvraw->logfs, buf, off, n);
+    }
+    return logfs_read(kvraw->logfs, buf, off, n);
+}
+
+/* takes the header of the record at off from buf, where it was read */
+
+static int
+check_meta(uint64_t off, struct meta *meta, const void *buf, uint64_t size) {
+    memcpy(meta, buf, META_LEN);
+    if (('K' != meta->mark[0]) ||
+        ('V' != meta->mark[1]) ||
+        (meta->flags & ~(META_LZ | META_AUX)) ||
+        ((meta->flags & META_LZ) && (LZ_HEADER >= meta->val_len)) ||
+        ((off + META_LEN + meta->key_len + meta->val_len) > size)) {
         TRACE("corrupt data");
         return -1;
     }
-    if (logfs_read(kvraw->logfs, meta, off, META_LEN)) {
+    return 0;
+}
+
+/**
+ * Reads the header of the record at off along with whatever follows it, up to
+ * n bytes, into buf. Returns the number of bytes read, 0 on error.
+ */
+
+static uint64_t
+read_meta(struct kvraw *kvraw,
+          uint64_t off,
+          struct meta *meta,
+          void *buf,
+          uint64_t n,
+          bool nocache) {
+    uint64_t size = LOAD(&kvraw->size);
+
+    memset(meta, 0, sizeof(struct meta));
+    if (!(n = meta_span(off, n, size))) {
+        TRACE(0);
+        return 0;
+    }
+    if (log_read(kvraw, buf, off, n, nocache)) {
+        TRACE(0);
+        return 0;
+    }
+    if (check_meta(off, meta, buf, size)) {
+        TRACE(0);
+        return 0;
+    }
+    return n;
+}
+
+/**
+ * Copies len bytes at log offset at into dst. The part that falls within the
+ * n bytes at off already in buf is copied from there, the rest is read.
+ */
+
+static int
+read_span(struct kvraw *kvraw,
+          const char *buf,
+          uint64_t off,
+          uint64_t n,
+          uint64_t at,
+          void *dst,
+          uint64_t len,
+          bool nocache) {
+    uint64_t have;
+
+    have = ((at - off) < n) ? MIN(n - (at - off), len) : 0;
+    if (have) {
+        memcpy(dst, buf + (at - off), have);
+    }
+    if ((len > have) &&
+        log_read(kvraw, (char *)dst + have, at + have, len - have, nocache)) {
         TRACE(0);
         return -1;
     }
-    if (('K' != meta->mark[0]) ||
-        ('V' != meta->mark[1]) ||
-        ((off + META_LEN + meta->key_len + meta->val_len) > kvraw->size)) {
+    return 0;
+}
+
+/**
+ * Folds len bytes at log offset at into crc, taking those that fall within
+ * the n bytes at off from buf and reading the rest.
+ */
+
+static int
+crc_span(struct kvraw *kvraw,
+         const char *buf,
+         uint64_t off,
+         uint64_t n,
+         uint64_t at,
+         uint64_t len,
+         uint32_t *crc,
+         bool nocache) {
+    char tmp[READ_PREFIX_MAX];
+    uint64_t have;
+
+    have = ((at - off) < n) ? MIN(n - (at - off), len) : 0;
+    (*crc) = crc32c((*crc), buf + (at - off), have);
+    for (at += have, len -= have; len; at += have, len -= have) {
+        have = MIN(len, sizeof(tmp));
+        if (log_read(kvraw, tmp, at, have, nocache)) {
+            TRACE(0);
+            return -1;
+        }
+        (*crc) = crc32c((*crc), tmp, have);
+    }
+    return 0;
+}
+
+/**
+ * The CRC of a record starts from its offset, so that one left over from an
+ * earlier pass of the log over the device does not check out where it lies.
+ */
+
+static uint32_t
+crc_start(uint64_t off, const struct meta *meta) {
+    struct meta meta_;
+
+    meta_ = (*meta);
+    meta_.crc = 0;
+    return crc32c(crc32c(0, &off, sizeof(off)), &meta_, META_LEN);
+}
+
+/* the CRC of the header and key of the record at off, as far as they go */
+
+static int
+crc_head(struct kvraw *kvraw,
+         const char *buf,
+         uint64_t off,
+         uint64_t n,
+         const struct meta *meta,
+         uint32_t *crc,
+         bool nocache) {
+    (*crc) = crc_start(off, meta);
+    if (crc_span(kvraw, buf, off, n, KEY_OFF(off), meta->key_len, crc, nocache)) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks the record at off against its CRC. val holds its stored value if
+ * the caller has it in memory already, otherwise val is NULL.
+ */
+
+static int
+verify(struct kvraw *kvraw,
+       const char *buf,
+       uint64_t off,
+       uint64_t n,
+       const struct meta *meta,
+       const void *val,
+       bool nocache) {
+    uint32_t crc;
+
+    if (crc_head(kvraw, buf, off, n, meta, &crc, nocache)) {
+        TRACE(0);
+        return -1;
+    }
+    if (val) {
+        crc = crc32c(crc, val, meta->val_len);
+    } else if (crc_span(kvraw, buf, off, n, VAL_OFF(off), meta->val_len, &crc, nocache)) {
+        TRACE(0);
+        return -1;
+    }
+    if (crc != meta->crc) {
         TRACE("corrupt data");
         return -1;
     }
     return 0;
 }
 
+/* the header and key of the record about to be appended at off, and its value iov */
+
+static void
+seal(struct meta *meta, uint64_t off, const void *key, const struct iovec *val) {
+    uint32_t crc;
+
+    crc = crc_start(off, meta);
+    crc = crc32c(crc, key, meta->key_len);
+    meta->crc = crc32c(crc, val->iov_base, val->iov_len);
+}
+
 struct kvraw *
-kvraw_open(const char *pathname, bool enable_persistence) {
+kvraw_open(const char *pathname,
+           bool enable_persistence,
+           const struct kvraw_options *options) {
     struct kvraw *kvraw;
     uint64_t off = 0;
 
@@ -61,26 +277,45 @@ kvraw_open(const char *pathname, bool enable_persistence) {
         return NULL;
     }
     memset(kvraw, 0, sizeof(struct kvraw));
-    if (!(kvraw->logfs = logfs_open(pathname, enable_persistence))) {
+    kvraw->prefix = (options && options->read_prefix) ? options->read_prefix : READ_PREFIX;
+    kvraw->prefix = MIN(kvraw->prefix, READ_PREFIX_MAX);
+    if (options && options->compress_min) {
+        kvraw->compress_min = MAX(options->compress_min, LZ_HEADER + 1);
+    }
+    if (!(kvraw->logfs = logfs_open(pathname, enable_persistence, options ? &options->logfs : NULL))) {
         kvraw_close(kvraw);
         TRACE(0);
         return NULL;
     }
+    kvraw->epoch = logfs_epoch(kvraw->logfs, &off);
+
+    /* the log as of the checkpoint, up to where it checks out after that */
+
+    if ((off = logfs_getsize(kvraw->logfs))) {
+        kvraw->tail = logfs_gettail(kvraw->logfs);
+        if (kvraw_recover(kvraw,
+                          &off,
+                          kvraw->tail + logfs_capacity(kvraw->logfs),
+                          NULL,
+                          NULL) ||
+            logfs_resume(kvraw->logfs, off)) {
+            kvraw_close(kvraw);
+            TRACE(0);
+            return NULL;
+        }
+        kvraw->size = off;
+        kvraw->epoch = logfs_epoch(kvraw->logfs, &off);
+        return kvraw;
+    }
     if (kvraw_append(kvraw, "", 1, "", 1, &off)) { /* off = 0 */
         kvraw_close(kvraw);
         TRACE(0);
         return NULL;
     }
-    if (enable_persistence) {
-        kvraw->size = logfs_getsize(kvraw->logfs);
-        printf("[kvraw] set size to %d\n", kvraw->size);
-    }
     return kvraw;
 }
 
 void kvraw_close(struct kvraw *kvraw) {
-    printf("[kvraw] size at close is %d\n", kvraw->size);
-
     if (kvraw) {
         logfs_close(kvraw->logfs);
         memset(kvraw, 0, sizeof(struct kvraw));
@@ -88,6 +323,140 @@ void kvraw_close(struct kvraw *kvraw) {
     FREE(kvraw);
 }
 
+/**
+ * Checks and decompresses the value of the record at off into dst, its first
+ * len bytes if dst is shorter than the raw bytes. The compressed bytes are
+ * taken from the n bytes at off in buf where they fit.
+ */
+
+static int
+inflate(struct kvraw *kvraw,
+        const char *buf,
+        uint64_t off,
+        uint64_t n,
+        const struct meta *meta,
+        void *dst,
+        uint64_t len,
+        uint64_t raw,
+        bool nocache) {
+    const char *src;
+    char *tmp, *out;
+    uint64_t at;
+
+    at = VAL_OFF(off);
+    tmp = NULL;
+    src = buf + (at - off);
+    if ((at - off + meta->val_len) > n) {
+        if (!(tmp = malloc(meta->val_len)) ||
+            read_span(kvraw, buf, off, n, at, tmp, meta->val_len, nocache)) {
+            FREE(tmp);
+            TRACE(0);
+            return -1;
+        }
+        src = tmp;
+    }
+    if (verify(kvraw, buf, off, n, meta, src, nocache)) {
+        FREE(tmp);
+        TRACE(0);
+        return -1;
+    }
+    out = dst;
+    if ((len < raw) && !(out = malloc(raw))) {
+        FREE(tmp);
+        TRACE("out of memory");
+        return -1;
+    }
+    if (lz_decompress(src + LZ_HEADER, meta->val_len - LZ_HEADER, out, raw)) {
+        if (out != dst) {
+            FREE(out);
+        }
+        FREE(tmp);
+        TRACE("corrupt data");
+        return -1;
+    }
+    if (out != dst) {
+        memcpy(dst, out, len);
+        FREE(out);
+    }
+    FREE(tmp);
+    return 0;
+}
+
+/**
+ * The key and value of the record at off, whose header is in meta and whose
+ * first n bytes are in buf, as read_record() hands them out.
+ */
+
+static int
+parse_record(struct kvraw *kvraw,
+             void *key,
+             uint64_t *key_len, /* in/out */
+             void *val,
+             uint64_t *val_len, /* in/out */
+             uint64_t off,
+             const struct meta *meta,
+             const char *buf,
+             uint64_t n,
+             bool nocache) {
+    uint64_t key_len_, val_len_;
+    uint32_t raw;
+
+    key_len_ = MIN(meta->key_len, (*key_len));
+    if (read_span(kvraw, buf, off, n, KEY_OFF(off), key, key_len_, nocache)) {
+        TRACE(0);
+        return -1;
+    }
+    (*key_len) = meta->key_len;
+    if (!(meta->flags & META_LZ)) {
+        val_len_ = MIN(meta->val_len, (*val_len));
+        if (read_span(kvraw, buf, off, n, VAL_OFF(off), val, val_len_, nocache) ||
+            ((*val_len) && verify(kvraw,
+                                buf,
+                                off,
+                                n,
+                                meta,
+                                (val_len_ == meta->val_len) ? val : NULL,
+                                nocache))) {
+            TRACE(0);
+            return -1;
+        }
+        (*val_len) = meta->val_len;
+        return 0;
+    }
+
+    /* straight into val when it has room for all of the value */
+
+    raw = 0;
+    if (read_span(kvraw, buf, off, n, VAL_OFF(off), &raw, LZ_HEADER, nocache) ||
+        ((*val_len) && inflate(kvraw, buf, off, n, meta, val, MIN(raw, (*val_len)), raw, nocache))) {
+        TRACE(0);
+        return -1;
+    }
+    (*val_len) = raw;
+    return 0;
+}
+
+static int
+read_record(struct kvraw *kvraw,
+            void *key,
+            uint64_t *key_len, /* in/out */
+            void *val,
+            uint64_t *val_len, /* in/out */
+            uint64_t off,
+            struct meta *meta,
+            bool nocache) {
+    char buf[READ_PREFIX_MAX];
+    uint64_t n;
+
+    /* one read for the header and, speculatively, the key and value */
+
+    if (!(n = read_meta(kvraw, off, meta, buf, kvraw->prefix, nocache))) {
+        TRACE(0);
+        return -1;
+    }
+    return parse_record(kvraw, key, key_len, val, val_len, off, meta, buf, n, nocache);
+}
+
 int kvraw_lookup(struct kvraw *kvraw,
                  void *key,
                  uint64_t *key_len, /* in/out */
@@ -95,7 +464,6 @@ int kvraw_lookup(struct kvraw *kvraw,
                  uint64_t *val_len, /* in/out */
                  uint64_t *off)     /* in/out */
 {
-    uint64_t key_len_, val_len_;
     struct meta meta;
 
     assert(kvraw);
@@ -103,59 +471,607 @@ int kvraw_lookup(struct kvraw *kvraw,
     assert(val_len && (!(*val_len) || val));
     assert(off && (*off));
 
-    if (read_meta(kvraw, (*off), &meta)) {
+    if (read_record(kvraw, key, key_len, val, val_len, (*off), &meta, false)) {
+        TRACE(0);
+        return -1;
+    }
+    /* records before the tail are reclaimed, the chain ends there */
+    (*off) = (meta.off >= LOAD(&kvraw->tail)) ? meta.off : 0;
+    return 0;
+}
+
+int kvraw_lookup_batch(struct kvraw *kvraw, struct kvraw_get *gets, uint64_t n) {
+    struct logfs_read *reads;
+    uint64_t i, size, len;
+    struct meta meta;
+    char *buf;
+    int r;
+
+    assert(kvraw);
+    assert(!n || gets);
+
+    if (!n) {
+        return 0;
+    }
+
+    /* a read per record, as far as the caller has room for */
+
+    size = LOAD(&kvraw->size);
+    len = 0;
+    for (i = 0; i < n; ++i) {
+        assert(gets[i].off);
+        len += META_LEN + gets[i].key_len + gets[i].val_len;
+    }
+    reads = NULL;
+    buf = NULL;
+    if (!(reads = malloc(n * sizeof(reads[0]))) ||
+        !(buf = malloc(len + n * kvraw->prefix))) {
+        FREE(reads);
+        FREE(buf);
+        TRACE("out of memory");
+        return -1;
+    }
+    len = 0;
+    for (i = 0; i < n; ++i) {
+        reads[i].buf = buf + len;
+        reads[i].off = gets[i].off;
+        reads[i].len = meta_span(gets[i].off,
+                                 MAX(META_LEN + gets[i].key_len + gets[i].val_len, kvraw->prefix),
+                                 size);
+        len += reads[i].len;
+    }
+    if (logfs_read_batch(kvraw->logfs, reads, n)) {
+        FREE(reads);
+        FREE(buf);
         TRACE(0);
         return -1;
     }
-    key_len_ = MIN(meta.key_len, (*key_len));
-    val_len_ = MIN(meta.val_len, (*val_len));
-    if (logfs_read(kvraw->logfs, key, KEY_OFF(*off), key_len_) ||
-        logfs_read(kvraw->logfs, val, VAL_OFF(*off), val_len_)) {
+
+    /* then each on its own, reading whatever did not fit */
+
+    r = 0;
+    for (i = 0; i < n; ++i) {
+        gets[i].result = -1;
+        if (reads[i].len &&
+            !check_meta(gets[i].off, &meta, reads[i].buf, size) &&
+            !parse_record(kvraw,
+                          gets[i].key,
+                          &gets[i].key_len,
+                          gets[i].val,
+                          &gets[i].val_len,
+                          gets[i].off,
+                          &meta,
+                          reads[i].buf,
+                          reads[i].len,
+                          false)) {
+            gets[i].off = (meta.off >= LOAD(&kvraw->tail)) ? meta.off : 0;
+            gets[i].result = 0;
+        }
+        r |= gets[i].result;
+    }
+    FREE(reads);
+    FREE(buf);
+    return r ? -1 : 0;
+}
+
+int kvraw_scan(struct kvraw *kvraw,
+               struct kvraw_window *window,
+               void *key,
+               uint64_t *key_len, /* in/out */
+               void *val,
+               uint64_t *val_len, /* in/out */
+               uint64_t *off)     /* in/out */
+{
+    uint64_t size, n;
+    struct meta meta;
+    const char *p;
+
+    assert(kvraw);
+    assert(window && window->buf && (META_LEN <= window->cap));
+    assert(key_len && (!(*key_len) || key));
+    assert(val_len && (!(*val_len) || val));
+    assert(off && ((*off) < kvraw->size));
+
+    size = LOAD(&kvraw->size);
+    if (!meta_span((*off), META_LEN, size)) {
         TRACE(0);
         return -1;
     }
-    (*key_len) = meta.key_len;
-    (*val_len) = meta.val_len;
-    (*off) = meta.off;
+
+    /* the window moves on once the header no longer fits in it */
+
+    if (((*off) < window->off) || (((*off) + META_LEN) > (window->off + window->len))) {
+        window->off = (*off);
+        window->len = MIN(window->cap, size - (*off));
+        if (logfs_read_nocache(kvraw->logfs, window->buf, window->off, window->len)) {
+            window->len = 0;
+            TRACE(0);
+            return -1;
+        }
+    }
+    p = window->buf + ((*off) - window->off);
+    n = window->off + window->len - (*off);
+    if (check_meta((*off), &meta, p, size) ||
+        parse_record(kvraw, key, key_len, val, val_len, (*off), &meta, p, n, true)) {
+        TRACE(0);
+        return -1;
+    }
+    (*off) += META_LEN + meta.key_len + meta.val_len;
     return 0;
 }
 
+/* values to compress go to a scratch buffer, compressed they are shorter */
+
+static uint64_t
+scratch_len(const struct kvraw *kvraw, uint64_t val_len) {
+    return (kvraw->compress_min && (val_len >= kvraw->compress_min)) ? val_len : 0;
+}
+
+/**
+ * Points iov at the value as it is to be stored, compressed into buf if
+ * there is a buf and that saves space.
+ */
+
+static void
+pack(struct meta *meta, struct iovec *iov, const void *val, uint64_t val_len, char *buf) {
+    uint32_t raw;
+    uint64_t z;
+
+    meta->flags = 0;
+    iov->iov_base = (void *)val;
+    iov->iov_len = val_len;
+    if (buf && (z = lz_compress(val, val_len, buf + LZ_HEADER, val_len - LZ_HEADER - 1))) {
+        raw = (uint32_t)val_len;
+        memcpy(buf, &raw, LZ_HEADER);
+        meta->flags = META_LZ;
+        iov->iov_base = buf;
+        iov->iov_len = LZ_HEADER + z;
+    }
+    meta->val_len = (uint32_t)iov->iov_len;
+}
+
 int kvraw_append(struct kvraw *kvraw,
                  const void *key,
                  uint64_t key_len,
                  const void *val,
                  uint64_t val_len,
                  uint64_t *off) {
+    struct iovec iov[3];
     struct meta meta;
     uint64_t off_;
+    char *buf;
 
     assert(kvraw);
     assert(key && key_len && (0xffff >= key_len));
     assert((!val_len || val) && (0xffffffff >= val_len));
     assert(off);
 
+    buf = NULL;
+    if (scratch_len(kvraw, val_len) && !(buf = malloc(val_len))) {
+        TRACE("out of memory");
+        return -1;
+    }
     off_ = kvraw->size;
     meta.mark[0] = 'K';
     meta.mark[1] = 'V';
     meta.off = (*off);
     meta.key_len = (uint16_t)key_len;
-    meta.val_len = (uint32_t)val_len;
-    if (logfs_append(kvraw->logfs, &meta, META_LEN) ||
-        logfs_append(kvraw->logfs, key, meta.key_len) ||
-        logfs_append(kvraw->logfs, val, meta.val_len)) {
+    iov[0].iov_base = &meta;
+    iov[0].iov_len = META_LEN;
+    iov[1].iov_base = (void *)key;
+    iov[1].iov_len = meta.key_len;
+    pack(&meta, &iov[2], val, val_len, buf);
+    meta.epoch = kvraw->epoch;
+    seal(&meta, off_, key, &iov[2]);
+    if (logfs_appendv(kvraw->logfs, iov, 3)) {
+        FREE(buf);
         TRACE(0);
         return -1;
     }
-    kvraw->size += META_LEN + meta.key_len + meta.val_len;
-    (*off) = off_;
+    FREE(buf);
+    STORE(&kvraw->size, off_ + META_LEN + meta.key_len + meta.val_len);
+    STORE(off, off_);
     return 0;
 }
 
-void kvraw_saveindex(struct kvraw *kvraw, uint8_t *buf, u64 buf_len) {
-    logfs_setmeta(kvraw->logfs, kvraw->size, buf_len);
-    logfs_append(kvraw->logfs, buf, buf_len);
+/* frees what kvraw_append_batch() could not stage on the stack */
+
+static void
+release_batch(struct meta *meta,
+              struct meta *meta_,
+              struct iovec *iov,
+              struct iovec *iov_,
+              char *buf) {
+    if (meta != meta_) {
+        FREE(meta);
+    }
+    if (iov != iov_) {
+        FREE(iov);
+    }
+    FREE(buf);
 }
 
-u8 *kvraw_getindex(struct kvraw *kvraw, /*out*/ u64 *len) {
-    return logfs_readindex(kvraw->logfs, len);
-}
\ No newline at end of file
+int kvraw_append_batch(struct kvraw *kvraw, struct kvraw_rec *recs, uint64_t n) {
+    struct iovec iov_[3 * BATCH_STACK], *iov;
+    struct meta meta_[BATCH_STACK], *meta;
+    uint64_t i, len, off_, z;
+    char *buf, *p;
+
+    assert(kvraw);
+    assert(!n || recs);
+
+    for (i = 0; i < n; ++i) {
+        assert(recs[i].key && recs[i].key_len && (0xffff >= recs[i].key_len));
+        assert((!recs[i].val_len || recs[i].val) && (0xffffffff >= recs[i].val_len));
+        assert((0 > recs[i].prev) || ((uint64_t)recs[i].prev < i));
+    }
+    len = 0;
+    for (i = 0; i < n; ++i) {
+        len += scratch_len(kvraw, recs[i].val_len);
+    }
+    meta = meta_;
+    iov = iov_;
+    buf = NULL;
+    if (BATCH_STACK < n) {
+        meta = malloc(n * sizeof(meta[0]));
+        iov = malloc(3 * n * sizeof(iov[0]));
+    }
+    if (len) {
+        buf = malloc(len);
+    }
+    if (!meta || !iov || (len && !buf)) {
+        release_batch(meta, meta_, iov, iov_, buf);
+        TRACE("out of memory");
+        return -1;
+    }
+
+    /* the records back to back, as a single append */
+
+    off_ = kvraw->size;
+    len = 0;
+    p = buf;
+    for (i = 0; i < n; ++i) {
+        meta[i].mark[0] = 'K';
+        meta[i].mark[1] = 'V';
+        meta[i].off = (0 > recs[i].prev) ? recs[i].off : recs[recs[i].prev].off;
+        meta[i].key_len = (uint16_t)recs[i].key_len;
+        iov[3 * i + 0].iov_base = &meta[i];
+        iov[3 * i + 0].iov_len = META_LEN;
+        iov[3 * i + 1].iov_base = (void *)recs[i].key;
+        iov[3 * i + 1].iov_len = meta[i].key_len;
+        z = scratch_len(kvraw, recs[i].val_len);
+        pack(&meta[i], &iov[3 * i + 2], recs[i].val, recs[i].val_len, z ? p : NULL);
+        meta[i].epoch = kvraw->epoch;
+        seal(&meta[i], off_ + len, recs[i].key, &iov[3 * i + 2]);
+        if (z) {
+            p += z;
+        }
+        recs[i].off = off_ + len;
+        len += META_LEN + meta[i].key_len + meta[i].val_len;
+    }
+    if (logfs_appendv(kvraw->logfs, iov, (int)(3 * n))) {
+        release_batch(meta, meta_, iov, iov_, buf);
+        TRACE(0);
+        return -1;
+    }
+    release_batch(meta, meta_, iov, iov_, buf);
+    STORE(&kvraw->size, off_ + len);
+    return 0;
+}
+
+int kvraw_value_ref(struct kvraw *kvraw,
+                    uint64_t off,
+                    uint64_t key_len,
+                    uint64_t val_len,
+                    struct logfs_ref *ref) {
+    uint64_t key_len_, val_len_, n;
+    char buf[READ_PREFIX_MAX];
+    struct meta meta;
+    uint32_t crc;
+    void *val;
+    int i;
+
+    assert(kvraw);
+    assert(off && ref);
+
+    if (!(n = read_meta(kvraw, off, &meta, buf, kvraw->prefix, false))) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* a compressed value can only be viewed as a decompressed copy */
+
+    if (meta.flags & META_LZ) {
+        key_len_ = 0;
+        val_len_ = val_len;
+        if (!(val = malloc(val_len ? val_len : 1)) ||
+            read_record(kvraw, NULL, &key_len_, val, &val_len_, off, &meta, false) ||
+            (val_len_ != val_len)) {
+            FREE(val);
+            TRACE(0);
+            return -1;
+        }
+        memset(ref, 0, sizeof(struct logfs_ref));
+        ref->iov[0].iov_base = val;
+        ref->iov[0].iov_len = val_len;
+        ref->iovcnt = 1;
+        ref->copy_ = val;
+        return 0;
+    }
+    if ((key_len != meta.key_len) || (val_len != meta.val_len)) {
+        TRACE("corrupt data");
+        return -1;
+    }
+    if (logfs_read_ref(kvraw->logfs, off + META_LEN + key_len, val_len, ref)) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* the value is checked where it lies */
+
+    if (crc_head(kvraw, buf, off, n, &meta, &crc, false)) {
+        logfs_release(kvraw->logfs, ref);
+        TRACE(0);
+        return -1;
+    }
+    for (i = 0; i < ref->iovcnt; ++i) {
+        crc = crc32c(crc, ref->iov[i].iov_base, ref->iov[i].iov_len);
+    }
+    if (crc != meta.crc) {
+        logfs_release(kvraw->logfs, ref);
+        TRACE("corrupt data");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks the record at the start of the n bytes in p, which lies at off, and
+ * fills in its header. Returns the length of the record, 0 if it is torn or
+ * damaged or does not end within the n bytes.
+ */
+
+static uint64_t
+check(const char *p, uint64_t n, uint64_t off, struct meta *meta) {
+    uint64_t len;
+    uint32_t crc;
+
+    if (META_LEN > n) {
+        return 0;
+    }
+    memcpy(meta, p, META_LEN);
+    len = META_LEN + meta->key_len + meta->val_len;
+    if (('K' != meta->mark[0]) ||
+        ('V' != meta->mark[1]) ||
+        (meta->flags & ~(META_LZ | META_AUX)) ||
+        ((meta->flags & META_LZ) && (LZ_HEADER >= meta->val_len)) ||
+        (len > n)) {
+        return 0;
+    }
+    crc = crc_start(off, meta);
+    crc = crc32c(crc, p + META_LEN, meta->key_len + meta->val_len);
+    return (crc == meta->crc) ? len : 0;
+}
+
+int kvraw_recover(struct kvraw *kvraw,
+                  uint64_t *off, /* in/out */
+                  uint64_t end,
+                  kvraw_recover_fn fn,
+                  void *arg) {
+    uint64_t base, have, cap, len, raw, resume;
+    struct meta meta;
+    uint32_t epoch;
+    char *buf, *p;
+
+    assert(kvraw);
+    assert(off && ((*off) <= end));
+
+    cap = RECOVER_CHUNK;
+    if (!(buf = malloc(cap))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    epoch = logfs_epoch(kvraw->logfs, &resume);
+
+    /* big sequential reads, each record is checked in place */
+
+    base = have = 0;
+    while (((*off) + META_LEN) <= end) {
+        if (((*off) < base) || ((*off) + META_LEN > base + have)) {
+            base = (*off);
+            have = MIN(cap, end - base);
+            if (logfs_read_direct(kvraw->logfs, buf, base, have)) {
+                FREE(buf);
+                TRACE(0);
+                return -1;
+            }
+        }
+        memcpy(&meta, buf + ((*off) - base), META_LEN);
+        if (('K' != meta.mark[0]) || ('V' != meta.mark[1])) {
+            break;
+        }
+        len = META_LEN + meta.key_len + meta.val_len;
+        if (((*off) + len <= end) && ((*off) + len > base + have)) {
+            if (len > cap) {
+                if (!(p = realloc(buf, len))) {
+                    FREE(buf);
+                    TRACE("out of memory");
+                    return -1;
+                }
+                buf = p;
+                cap = len;
+            }
+            base = (*off);
+            have = MIN(cap, end - base);
+            if (logfs_read_direct(kvraw->logfs, buf, base, have)) {
+                FREE(buf);
+                TRACE(0);
+                return -1;
+            }
+        }
+        p = buf + ((*off) - base);
+        if (!(len = check(p, base + have - (*off), (*off), &meta)) ||
+            (((*off) >= resume) && (meta.epoch != epoch))) {
+            break;
+        }
+        raw = meta.val_len;
+        if (meta.flags & META_LZ) {
+            raw = 0;
+            memcpy(&raw, p + META_LEN + meta.key_len, LZ_HEADER);
+        }
+        if (fn &&
+            !(meta.flags & META_AUX) &&
+            fn(arg, p + META_LEN, meta.key_len, raw, (*off), meta.off)) {
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+        (*off) += len;
+    }
+    FREE(buf);
+    return 0;
+}
+
+void kvraw_release(struct kvraw *kvraw, struct logfs_ref *ref) {
+    assert(kvraw);
+
+    logfs_release(kvraw->logfs, ref);
+}
+
+void kvraw_trim(struct kvraw *kvraw, uint64_t off) {
+    assert(kvraw);
+    assert((kvraw->tail <= off) && (off <= kvraw->size));
+
+    STORE(&kvraw->tail, off);
+    logfs_trim(kvraw->logfs, off);
+}
+
+int
+kvraw_sync(struct kvraw *kvraw, uint64_t off) {
+    assert(kvraw);
+
+    if (logfs_sync(kvraw->logfs, off)) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t
+kvraw_size(const struct kvraw *kvraw) {
+    assert(kvraw);
+
+    return LOAD(&kvraw->size);
+}
+
+uint64_t
+kvraw_tail(const struct kvraw *kvraw) {
+    assert(kvraw);
+
+    return LOAD(&kvraw->tail);
+}
+
+uint64_t
+kvraw_flushed(const struct kvraw *kvraw) {
+    assert(kvraw);
+
+    return logfs_flushed(kvraw->logfs);
+}
+
+void
+kvraw_stats(struct kvraw *kvraw, struct logfs_stats *stats) {
+    assert(kvraw);
+    assert(stats);
+
+    logfs_stats(kvraw->logfs, stats);
+}
+
+uint64_t
+kvraw_saved_tail(const struct kvraw *kvraw) {
+    assert(kvraw);
+
+    return logfs_gettail(kvraw->logfs);
+}
+
+uint64_t
+kvraw_capacity(const struct kvraw *kvraw) {
+    assert(kvraw);
+
+    return logfs_capacity(kvraw->logfs);
+}
+
+int kvraw_saveindex(struct kvraw *kvraw, const u8 *buf, u64 buf_len) {
+    struct iovec iov[2];
+    struct meta meta;
+    uint64_t off_;
+
+    assert(kvraw);
+    assert(buf && buf_len && (0xffffffff >= buf_len));
+
+    /* a record with no key, which scans pass over */
+
+    off_ = kvraw->size;
+    memset(&meta, 0, sizeof(meta));
+    meta.mark[0] = 'K';
+    meta.mark[1] = 'V';
+    meta.flags = META_AUX;
+    meta.val_len = (uint32_t)buf_len;
+    meta.epoch = kvraw->epoch;
+    iov[0].iov_base = &meta;
+    iov[0].iov_len = META_LEN;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = buf_len;
+    seal(&meta, off_, NULL, &iov[1]);
+    if (logfs_appendv(kvraw->logfs, iov, 2)) {
+        TRACE(0);
+        return -1;
+    }
+    STORE(&kvraw->size, off_ + META_LEN + buf_len);
+    if (logfs_checkpoint(kvraw->logfs, off_, META_LEN + buf_len)) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+int kvraw_getindex(struct kvraw *kvraw, u64 *index_off, u64 *index_len, u64 *off) {
+    uint64_t off_, len;
+    struct meta meta;
+    char buf[META_LEN];
+
+    assert(kvraw);
+    assert(index_off && index_len && off);
+
+    (*index_off) = 0;
+    (*index_len) = 0;
+    (*off) = logfs_getsize(kvraw->logfs);
+    off_ = logfs_getindex(kvraw->logfs, &len);
+    if (!len) {
+        return 0;
+    }
+
+    /* the header alone, the bytes are checked by whoever reads them */
+
+    if ((META_LEN > len) ||
+        !read_meta(kvraw, off_, &meta, buf, META_LEN, false) ||
+        !(meta.flags & META_AUX) ||
+        meta.key_len ||
+        ((META_LEN + meta.val_len) != len)) {
+        TRACE("corrupt checkpoint");
+        return -1;
+    }
+    (*index_off) = off_ + META_LEN;
+    (*index_len) = meta.val_len;
+    return 0;
+}
+
+int kvraw_readindex(struct kvraw *kvraw, void *buf, u64 off, u64 len) {
+    assert(kvraw);
+    assert(buf || !len);
+
+    if (logfs_read_nocache(kvraw->logfs, buf, off, len)) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
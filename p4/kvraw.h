@@ -10,14 +10,29 @@
 #ifndef _KVRAW_H_
 #define _KVRAW_H_
 
+#include "logfs.h"
 #include "system.h"
 
 struct kvraw;
 
-struct kvraw *kvraw_open(const char *pathname, bool enable_persistence);
+struct kvraw_options {
+    struct logfs_options logfs;
+    uint64_t read_prefix; /* bytes read per record up front, 0 for the default */
+    uint64_t compress_min; /* values at least this long are compressed, 0 for none */
+};
+
+struct kvraw *kvraw_open(const char *pathname,
+                         bool enable_persistence,
+                         const struct kvraw_options *options);
 
 void kvraw_close(struct kvraw *kvraw);
 
+/**
+ * val_len is the length of the value as appended, compressed or not. A
+ * record whose value is read is checked against its CRC, one that fails
+ * the check is an error.
+ */
+
 int kvraw_lookup(struct kvraw *kvraw,
                  void *key,
                  uint64_t *key_len, /* in/out */
@@ -25,6 +40,52 @@ int kvraw_lookup(struct kvraw *kvraw,
                  uint64_t *val_len, /* in/out */
                  uint64_t *off);    /* in/out */
 
+struct kvraw_get {
+    void *key;
+    uint64_t key_len; /* in/out */
+    void *val;
+    uint64_t val_len; /* in/out */
+    uint64_t off;     /* in/out */
+    int result;       /* out: 0, or -1 on error */
+};
+
+/**
+ * kvraw_lookup() of n records at once: each is read as far as its key_len and
+ * val_len reach, with logfs_read_batch(), and whatever did not fit is read
+ * after. Returns -1 if any of them failed.
+ */
+
+int kvraw_lookup_batch(struct kvraw *kvraw, struct kvraw_get *gets, uint64_t n);
+
+/**
+ * A window of the log that kvraw_scan() reads ahead into, kept by the caller
+ * across calls. buf has room for cap bytes and starts out empty, len 0.
+ */
+
+struct kvraw_window {
+    char *buf;
+    uint64_t cap;
+    uint64_t off; /* log offset of buf[0] */
+    uint64_t len; /* bytes of the log in buf */
+};
+
+/**
+ * Like kvraw_lookup(), but advances off to the record that follows. A
+ * checkpoint is a record without a key, key_len 0, to be passed over. The
+ * log is read a window at a time, past the read cache, see
+ * logfs_read_nocache(), so a walk over many small records costs few device
+ * reads. Appended records never change, the window stays good while they
+ * are live.
+ */
+
+int kvraw_scan(struct kvraw *kvraw,
+               struct kvraw_window *window,
+               void *key,
+               uint64_t *key_len, /* in/out */
+               void *val,
+               uint64_t *val_len, /* in/out */
+               uint64_t *off);    /* in/out */
+
 int kvraw_append(struct kvraw *kvraw,
                  const void *key,
                  uint64_t key_len,
@@ -32,8 +93,102 @@ int kvraw_append(struct kvraw *kvraw,
                  uint64_t val_len,
                  uint64_t *off);
 
-void kvraw_saveindex(struct kvraw *kvraw, u8 *buf, u64 buf_len);
+struct kvraw_rec {
+    const void *key;
+    uint64_t key_len;
+    const void *val;
+    uint64_t val_len;
+    int64_t prev; /* chain to this earlier record of the batch, or -1 ... */
+    uint64_t off; /* ... to this offset; out: offset of the record */
+};
+
+/* appends all records with one logfs_append(), they become visible at once */
+
+int kvraw_append_batch(struct kvraw *kvraw, struct kvraw_rec *recs, uint64_t n);
+
+/* views the value of the record at off, whose lengths the caller knows */
+
+int kvraw_value_ref(struct kvraw *kvraw,
+                    uint64_t off,
+                    uint64_t key_len,
+                    uint64_t val_len,
+                    struct logfs_ref *ref);
+
+void kvraw_release(struct kvraw *kvraw, struct logfs_ref *ref);
+
+/* called for each intact record of a recovery scan, non-zero stops it */
+
+typedef int (*kvraw_recover_fn)(void *arg,
+                                const void *key,
+                                uint64_t key_len,
+                                uint64_t val_len, /* uncompressed, 0 for none */
+                                uint64_t off,
+                                uint64_t prev); /* the chain link of the record */
+
+/**
+ * Walks the records from off towards end, checking each against its CRC, and
+ * stops at the first one that is torn or damaged, or left over from before
+ * the log was last resumed. Leaves off past the last intact record, the true
+ * end of the log. Reading does not stop at the size of the log, so end may lie
+ * beyond it, but the records must be on the device: read around the write
+ * buffer and the cache, as after kvraw_sync(). Checkpoints are not passed to
+ * fn.
+ */
+
+int kvraw_recover(struct kvraw *kvraw,
+                  uint64_t *off, /* in/out */
+                  uint64_t end,
+                  kvraw_recover_fn fn,
+                  void *arg);
+
+void kvraw_trim(struct kvraw *kvraw, uint64_t off);
+
+/* returns once the log before off is on stable storage */
+
+int kvraw_sync(struct kvraw *kvraw, uint64_t off);
+
+uint64_t kvraw_size(const struct kvraw *kvraw);
+
+uint64_t kvraw_tail(const struct kvraw *kvraw);
+
+uint64_t kvraw_capacity(const struct kvraw *kvraw);
+
+/**
+ * Appends the buf_len bytes in buf as a checkpoint, covering the log up to
+ * here, and makes it the one a persistent kvraw_open() finds once it is on
+ * stable storage. Must not run concurrently with appends.
+ */
+
+int kvraw_saveindex(struct kvraw *kvraw, const u8 *buf, u64 buf_len);
+
+/**
+ * Where the bytes of the checkpoint found at open are in the log, *index_len
+ * 0 if there is none. They are not read, let alone checked; the log it does
+ * not cover starts at off. The persistent kvraw_open() has already found
+ * where that ends, at kvraw_size().
+ */
+
+int kvraw_getindex(struct kvraw *kvraw,
+                   /*out*/ u64 *index_off,
+                   /*out*/ u64 *index_len,
+                   /*out*/ u64 *off);
+
+/**
+ * Reads len bytes of a checkpoint at off, which logfs keeps until the next
+ * checkpoint is on stable storage, however far the tail has moved. It is
+ * read once, past the read cache.
+ */
+
+int kvraw_readindex(struct kvraw *kvraw, void *buf, u64 off, u64 len);
+
+/* the start of the live log as of the checkpoint, the log space before it is reused */
+
+uint64_t kvraw_saved_tail(const struct kvraw *kvraw);
+
+/* records before this are no longer in the write buffer, see logfs_flushed() */
+
+uint64_t kvraw_flushed(const struct kvraw *kvraw);
 
-u8 *kvraw_getindex(struct kvraw *kvraw, /*out*/ u64 *len);
+void kvraw_stats(struct kvraw *kvraw, struct logfs_stats *stats); /* out */
 
 #endif /* _KVRAW_H_ */
@@ -15,11 +15,30 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "counter.h"
 #include "device.h"
 #include "utils.h"
 
 #define WCACHE_BLOCKS 32
-#define RCACHE_BLOCKS 256
+// default LOGFS_SYNC_PERIODIC interval in microseconds
+#define SYNC_INTERVAL 100000
+// default read cache size in bytes
+#define RCACHE_BUDGET (1 << 20)
+// blocks read at a time by logfs_read_direct()
+#define DIRECT_BLOCKS 256
+
+// counters of a logfs, see logfs_stats()
+enum {
+    STAT_READS_CACHE,
+    STAT_READS_WRITE_BUFFER,
+    STAT_READS_BOTH,
+    STAT_APPENDED_BYTES,
+    STAT_APPEND_STALLS,
+    STAT_STALL_US,
+    STAT_FLUSHES,
+    STAT_FLUSH_BLOCKS,
+    STATS = STAT_FLUSH_BLOCKS + COUNTER_HIST
+};
 
 /**
  * Needs:
@@ -61,55 +80,75 @@ static inline u64 region_end(Region r) {
 
 #define RESERVED_BLOCKS 1
 
+/**
+ * The first block of the device describes the log as of the last checkpoint.
+ * A checkpoint is a blob of the client's, appended to the log like any other
+ * data, that covers the log before head. The log after head is found again by
+ * the client, which walks it until the first record that does not check out.
+ *
+ * Records carry the epoch they were written in. Those before resume may be of
+ * any earlier epoch, those from resume on are of the current one, so that what
+ * is left on the device past the end of the log is not taken for new records.
+ */
 typedef struct Metadata {
     char tag[6];
-    // write cursor
-    u64 current_block;
-    u64 current_offset;
-    // where the persisted index is stored
+    uint32_t epoch;
+    u64 resume;
+    // the end of the log the checkpoint covers, and the start of its live part
+    u64 head;
+    u64 tail;
+    // where the checkpoint is stored, size 0 if there is none
     Region index;
 } Metadata;
 
-void meta_init(Metadata *metadata) {
-    // the first block is reserved for metadata.
-    // LOGFS always starts at block 1.
-    metadata->current_block = RESERVED_BLOCKS;
-    metadata->current_offset = 0;
-    metadata->index.address = 0;
-    metadata->index.size = 0;
+/* a log that starts over gets an epoch unlike the ones before it */
+void meta_init(Metadata *metadata, uint32_t epoch) {
+    memset(metadata, 0, sizeof(Metadata));
+    metadata->epoch = epoch;
     strcpy(metadata->tag, "LOGFS");
 }
 
-void meta_save(Metadata *metadata, struct device *block) {
+int meta_save(Metadata *metadata, struct device *block) {
     int blk_size = device_block(block);
-    static u8 *page;
+    u8 *page = aligned_alloc(blk_size, blk_size);
+    int err;
+
     if (page == NULL) {
-        page = malloc(blk_size);
+        TRACE("out of memory");
+        return -1;
     }
     memset(page, 0, blk_size);
     memcpy(page, metadata, sizeof(Metadata));
-    device_write(block, page, blk_size, blk_size);
+    err = device_write(block, page, 0, blk_size) || device_sync(block);
+    free(page);
+    return err ? -1 : 0;
 }
 
-Metadata meta_load(struct device *block) {
+/* returns 0 with the metadata on the device, +1 if there is none */
+int meta_load(Metadata *metadata, struct device *block) {
     int blk_size = device_block(block);
-    static u8 *page;
-    if (page == NULL) {
-        page = malloc(blk_size);
-    }
-    memset(page, 0, blk_size);
-    device_read(block, page, blk_size, blk_size);
-    Metadata metadata;
-    memcpy(&metadata, page, sizeof(Metadata));
+    u8 *page = aligned_alloc(blk_size, blk_size);
 
-    if (strcmp(metadata.tag, "LOGFS") != 0) {
-        printf("Corrupt metadata or block device is not initialized with LogFS\n");
-        meta_init(&metadata);
+    if (page == NULL || device_read(block, page, 0, blk_size)) {
+        free(page);
+        TRACE(0);
+        return -1;
     }
-    // meta_init(&metadata);
-    printf("Loaded metadata: cursor=(%d,%d), index=(%d,%d)\n", metadata.current_block, metadata.current_offset, metadata.index.address, metadata.index.size);
+    memcpy(metadata, page, sizeof(Metadata));
+    free(page);
+    return strncmp(metadata->tag, "LOGFS", sizeof(metadata->tag)) ? +1 : 0;
+}
 
-    return metadata;
+/**
+ * The log is laid out circularly over the data blocks of the device: logical
+ * block numbers grow forever, and the device location wraps around once the
+ * tail of the log has been trimmed.
+ *
+ * Returns the device byte offset of the given logical block.
+ */
+static inline u64 blk_locate(struct device *device, u64 block) {
+    u64 data_blocks = device_size(device) / device_block(device) - RESERVED_BLOCKS;
+    return (RESERVED_BLOCKS + (block - RESERVED_BLOCKS) % data_blocks) * device_block(device);
 }
 
 ///////////////
@@ -119,12 +158,14 @@ Metadata meta_load(struct device *block) {
 typedef struct WriteBuffer {
     struct device *device;
     int block_size;
-    // current page/block number in device
-    int current_block;
+    // current (logical) page/block number in device
+    u64 current_block;
 
     // the main buffer
     u8 *buf;
     int buf_size;
+    // two blocks for wb_flush: a full block wrapped around the buffer, and the partial block
+    u8 *virtual_page;
 
     // indexes into the buffer
     // where we append into the buffer
@@ -132,54 +173,106 @@ typedef struct WriteBuffer {
     // where we read from the buffer to write to disk
     int write_head;
 
+    // total bytes appended, i.e. the logfs offset of the end of the log
+    u64 appended;
+
     // flags
     bool shutdown;
     bool is_full;
+    // a flush is writing blocks without holding access_mutex
+    bool flushing;
+    pthread_cond_t flush_done;
+    // the last flush failed, its blocks are still in the buffer
+    bool flush_failed;
+
+    // durability: the log before durable is on stable storage.
+    // At most one thread syncs at a time, the others wait for it.
+    int sync_policy;
+    u64 sync_interval;
+    u64 durable;
+    bool syncing;
+    pthread_mutex_t sync_mutex;
+    pthread_cond_t sync_done;
 
     // mutex protecting the data in this struct
     pthread_mutex_t access_mutex;
 
+    // both wait with access_mutex held, so no wakeup gets lost
     pthread_t write_thread;
-    pthread_mutex_t write_cond_mutex;
     pthread_cond_t write_waiting_for_data_to_flush;
 
     // append happens in the caller's thread, so no thread for it
-    pthread_mutex_t append_cond_mutex;
     pthread_cond_t append_waiting_for_space;
+
+    // updated without holding any lock
+    struct counter *stats;
 } WriteBuffer;
 
 static void *worker_loop(WriteBuffer *buf);
 
-WriteBuffer *wb_init(struct device *block, Metadata meta) {
-    // TODO add metadata loading
+/**
+ * Point the (empty) buffer at head, the end of the log on the device.
+ * Expects nothing to be appended, or flushed, meanwhile.
+ */
+static int wb_position(WriteBuffer *wb, u64 head) {
+    wb->current_block = RESERVED_BLOCKS + head / wb->block_size;
+    wb->write_head = 0;
+    wb->append_head = head % wb->block_size;
+    wb->appended = head;
+    wb->durable = head;
+    // If the write cursor is in the middle of a block, we can simulate
+    // that by loading the incomplete block into the write buffer.
+    if (wb->append_head > 0 &&
+        device_read(wb->device, wb->buf, blk_locate(wb->device, wb->current_block), wb->block_size)) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+WriteBuffer *wb_init(struct device *block, u64 head, const struct logfs_options *options) {
     WriteBuffer *wb = malloc(sizeof(WriteBuffer));
+    if (!wb) {
+        TRACE("out of memory");
+        return NULL;
+    }
     wb->device = block;
     wb->block_size = device_block(block);
 
-    wb->buf = calloc(device_block(block), WCACHE_BLOCKS);
+    // O_DIRECT needs block aligned buffers
     wb->buf_size = device_block(block) * WCACHE_BLOCKS;
+    wb->buf = aligned_alloc(device_block(block), wb->buf_size);
+    wb->virtual_page = aligned_alloc(device_block(block), 2 * device_block(block));
+    if (!wb->buf || !wb->virtual_page) {
+        free(wb->buf);
+        free(wb->virtual_page);
+        free(wb);
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(wb->buf, 0, wb->buf_size);
 
     wb->shutdown = false;
     wb->is_full = false;
+    wb->flushing = false;
+    wb->flush_failed = false;
+    pthread_cond_init(&wb->flush_done, NULL);
+
+    wb->sync_policy = options ? options->sync : LOGFS_SYNC_NONE;
+    wb->sync_interval = (options && options->sync_interval) ? options->sync_interval : SYNC_INTERVAL;
+    wb->syncing = false;
+    pthread_mutex_init(&wb->sync_mutex, NULL);
+    pthread_cond_init(&wb->sync_done, NULL);
 
     pthread_mutex_init(&wb->access_mutex, NULL);
 
-    pthread_mutex_init(&wb->append_cond_mutex, NULL);
     pthread_cond_init(&wb->append_waiting_for_space, NULL);
 
-    pthread_mutex_init(&wb->write_cond_mutex, NULL);
     pthread_cond_init(&wb->write_waiting_for_data_to_flush, NULL);
 
-    wb->current_block = meta.current_block;
-    // If the write cursor was in the middle of a block, we can simulate
-    // that by loading the incomplete block into the write buffer.
-    if (meta.current_offset > 0) {
-        device_read(block, wb->buf, wb->current_block * wb->block_size, wb->block_size);
-        wb->append_head = meta.current_offset;
-    } else {
-        wb->append_head = 0;
-    }
-    wb->write_head = 0;
+    wb_position(wb, head);
+
+    wb->stats = counter_open(STATS);
 
     pthread_create(&wb->write_thread, NULL, (void *(*)(void *))worker_loop, wb);
 
@@ -315,27 +408,12 @@ bool wb_read(WriteBuffer *wb, u8 *buffer, Region region) {
     return true;
 }
 
-void wb_append(WriteBuffer *wb, const u8 *data, u64 size) {
-    // If the buffer is full, wake up a thread and wait for it to flush.
-    if (wb_freespace(wb) < size) {
-        pthread_mutex_lock(&wb->access_mutex);
-        wb->is_full = true;
-        pthread_mutex_unlock(&wb->access_mutex);
-        while (true) {
-            pthread_cond_signal(&wb->write_waiting_for_data_to_flush);
-            pthread_mutex_lock(&wb->append_cond_mutex);
-            printf("Waiting for space...");
-            pthread_cond_wait(&wb->append_waiting_for_space, &wb->append_cond_mutex);
-            pthread_mutex_unlock(&wb->append_cond_mutex);
-            if (wb_freespace(wb) >= size) {
-                break;
-            }
-        }
-    }
-
-    pthread_mutex_lock(&wb->access_mutex);
-
-    if (wb->append_head + size > wb->buf_size) {
+/**
+ * Copy data in at append_head, wrapping around the end of the buffer.
+ * Assumes that the caller holds the access_mutex and has checked for space.
+ */
+static inline void wb_copyin(WriteBuffer *wb, const u8 *data, u64 size) {
+    if (wb->append_head + size > (u64)wb->buf_size) {
         u64 first_part_size = wb->buf_size - wb->append_head;
         memcpy(wb->buf + wb->append_head, data, first_part_size);
         memcpy(wb->buf, data + first_part_size, size - first_part_size);
@@ -343,55 +421,229 @@ void wb_append(WriteBuffer *wb, const u8 *data, u64 size) {
         memcpy(wb->buf + wb->append_head, data, size);
     }
     wb->append_head = (wb->append_head + size) % wb->buf_size;
+}
+
+/**
+ * Append the segments as one piece of size bytes: the space for all of them is
+ * reserved at once, and they are copied in under a single lock acquisition, so
+ * the flusher never sees part of them.
+ *
+ * Returns 0 on success, -1 if the append had to wait for space and the flush
+ * meant to make it failed. Nothing is appended then.
+ */
+int wb_appendv(WriteBuffer *wb, const struct iovec *iov, int iovcnt, u64 size) {
+    pthread_mutex_lock(&wb->access_mutex);
+
+    // If the buffer is full, wake up the flusher and wait for it.
+    // Note: the buffer can never be filled completely, since append_head == write_head means empty.
+    if (wb_freespace(wb) <= size) {
+        u64 start = ref_time();
+        while (wb_freespace(wb) <= size) {
+            wb->is_full = true;
+            pthread_cond_signal(&wb->write_waiting_for_data_to_flush);
+            pthread_cond_wait(&wb->append_waiting_for_space, &wb->access_mutex);
+            if (wb->flush_failed && wb_freespace(wb) <= size) {
+                pthread_mutex_unlock(&wb->access_mutex);
+                TRACE("flush failed");
+                return -1;
+            }
+        }
+        counter_add(wb->stats, STAT_APPEND_STALLS, 1);
+        counter_add(wb->stats, STAT_STALL_US, ref_time() - start);
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len) {
+            wb_copyin(wb, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    wb->appended += size;
+    counter_add(wb->stats, STAT_APPENDED_BYTES, size);
 
     if (wb_usedspace(wb) >= (u64)wb->block_size) {
         pthread_cond_signal(&wb->write_waiting_for_data_to_flush);
     }
     pthread_mutex_unlock(&wb->access_mutex);
+    return 0;
+}
+
+static inline void wb_queue(WriteBuffer *wb, struct device_io *io, u8 *buf, u64 block) {
+    io->buf = buf;
+    io->off = blk_locate(wb->device, block);
+    io->len = wb->block_size;
+    io->write = 1;
 }
 
 /**
- * This buffer belongs to wb_flush.
- * It _should_ just be a static stack variable, but then we wouldn't be able to free it.
+ * Write every full block in the write buffer to the device. With flush_partial
+ * the trailing partial block is written too, zero padded, but stays in the
+ * buffer until it fills up. All the blocks go to the device as one batch.
+ *
+ * The lock is only held to snapshot the blocks and, once they are written, to
+ * advance write_head past them. Until then the blocks still count as used, so
+ * appends fill the free space behind them and reads keep finding them in the
+ * buffer. One flush runs at a time.
+ *
+ * If any device write fails the blocks stay in the buffer, write_head where it
+ * was, for the next flush to write again, and appends waiting for space give up.
+ *
+ * Returns 0 on success, -1 if any device write failed.
  */
-static u8 *virtual_page = NULL;
-
-void wb_flush(WriteBuffer *wb, bool flush_partial) {
-    if (virtual_page == NULL) {
-        virtual_page = malloc(wb->block_size);
-    }
-    memset(virtual_page, 0, wb->block_size);
+int wb_flush(WriteBuffer *wb, bool flush_partial) {
+    struct device_io ios[WCACHE_BLOCKS + 1];
+    int n = 0;
+    int err = 0;
 
     pthread_mutex_lock(&wb->access_mutex);
+    while (wb->flushing) {
+        pthread_cond_wait(&wb->flush_done, &wb->access_mutex);
+    }
+    wb->flushing = true;
 
-    int blocks_written = 0;
-    int target_blocks = wb_usedspace(wb) / wb->block_size;
-    UNUSED(target_blocks);
-
-    while (wb_usedspace(wb) >= (u64)wb->block_size) {
-        if ((wb->write_head + wb->block_size) >= wb->buf_size) {
+    int write_head = wb->write_head;
+    u64 block = wb->current_block;
+    u64 used = wb_usedspace(wb);
+    while (used >= (u64)wb->block_size) {
+        if ((write_head + wb->block_size) >= wb->buf_size) {
             // the page we want to write is wrapped around the circular buffer.
             // The device needs a continuous region of memory, so we need to recombine them.
-            int end_fragment_size = wb->buf_size - wb->write_head;
-            memcpy(virtual_page, wb->buf + wb->write_head, end_fragment_size);
-            memcpy(virtual_page + end_fragment_size, wb->buf, wb->block_size - end_fragment_size);
-            device_write(wb->device, virtual_page, wb->current_block * wb->block_size, wb->block_size);
-            blocks_written++;
+            int end_fragment_size = wb->buf_size - write_head;
+            memcpy(wb->virtual_page, wb->buf + write_head, end_fragment_size);
+            memcpy(wb->virtual_page + end_fragment_size, wb->buf, wb->block_size - end_fragment_size);
+            wb_queue(wb, &ios[n++], wb->virtual_page, block);
         } else {
-            device_write(wb->device, wb->buf + wb->write_head, wb->current_block * wb->block_size, wb->block_size);
-            blocks_written++;
+            wb_queue(wb, &ios[n++], wb->buf + write_head, block);
         }
-        wb->current_block++;
-        wb->write_head = (wb->write_head + wb->block_size) % wb->buf_size;
+        block++;
+        write_head = (write_head + wb->block_size) % wb->buf_size;
+        used -= wb->block_size;
     }
-    if (flush_partial && wb->write_head < wb->append_head) {
-        memcpy(virtual_page, wb->buf + wb->write_head, wb->append_head - wb->write_head);
-        device_write(wb->device, virtual_page, wb->current_block * wb->block_size, wb->block_size);
+    if (flush_partial && used) {
+        // the partial block may wrap around the end of the buffer too
+        u8 *page = wb->virtual_page + wb->block_size;
+        u64 first_part_size = MIN(used, (u64)(wb->buf_size - write_head));
+        memset(page, 0, wb->block_size);
+        memcpy(page, wb->buf + write_head, first_part_size);
+        memcpy(page + first_part_size, wb->buf, used - first_part_size);
+        wb_queue(wb, &ios[n++], page, block);
     }
+    pthread_mutex_unlock(&wb->access_mutex);
 
-    wb->is_full = false;
+    err = device_submit(wb->device, ios, n);
+    if (n) {
+        counter_add(wb->stats, STAT_FLUSHES, 1);
+        counter_hist(wb->stats, STAT_FLUSH_BLOCKS, n);
+    }
+
+    pthread_mutex_lock(&wb->access_mutex);
+    if (!err) {
+        wb->current_block = block;
+        wb->write_head = write_head;
+        wb->is_full = false;
+    }
+    wb->flush_failed = err;
+    wb->flushing = false;
+    pthread_cond_broadcast(&wb->flush_done);
+    if (err) {
+        // every waiting append gives up
+        pthread_cond_broadcast(&wb->append_waiting_for_space);
+    } else {
+        pthread_cond_signal(&wb->append_waiting_for_space);
+    }
+    pthread_mutex_unlock(&wb->access_mutex);
+    if (err) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait until the log before off is on stable storage.
+ *
+ * Concurrent callers share one fdatasync(): a caller that finds no sync in
+ * progress flushes the write buffer, partial block included, syncs everything
+ * appended so far, and wakes up the others. Those whose offset was covered
+ * return, the rest go around for the next sync.
+ */
+int wb_sync(WriteBuffer *wb, u64 off) {
+    int err = 0;
+
+    pthread_mutex_lock(&wb->sync_mutex);
+    while (wb->durable < off && !err) {
+        if (wb->syncing) {
+            pthread_cond_wait(&wb->sync_done, &wb->sync_mutex);
+            continue;
+        }
+        wb->syncing = true;
+        pthread_mutex_unlock(&wb->sync_mutex);
+
+        pthread_mutex_lock(&wb->access_mutex);
+        u64 target = wb->appended;
+        pthread_mutex_unlock(&wb->access_mutex);
+        err = wb_flush(wb, true) || device_sync(wb->device);
+
+        pthread_mutex_lock(&wb->sync_mutex);
+        if (!err) {
+            wb->durable = MAX(wb->durable, target);
+        }
+        wb->syncing = false;
+        pthread_cond_broadcast(&wb->sync_done);
+    }
+    pthread_mutex_unlock(&wb->sync_mutex);
+    return err ? -1 : 0;
+}
+
+static u64 wb_appended(WriteBuffer *wb) {
+    pthread_mutex_lock(&wb->access_mutex);
+    u64 appended = wb->appended;
+    pthread_mutex_unlock(&wb->access_mutex);
+    return appended;
+}
+
+/**
+ * Drop everything appended from off on, which a failed append left behind.
+ * Blocks past off that already reached the device stay there until the next
+ * appends overwrite them. Syncs and flushes wait meanwhile.
+ *
+ * Returns 0 on success, -1 if the block off is in could not be read back.
+ */
+static int wb_rewind(WriteBuffer *wb, u64 off) {
+    int err = 0;
+
+    pthread_mutex_lock(&wb->sync_mutex);
+    while (wb->syncing) {
+        pthread_cond_wait(&wb->sync_done, &wb->sync_mutex);
+    }
+    wb->syncing = true;
+    pthread_mutex_unlock(&wb->sync_mutex);
+
+    pthread_mutex_lock(&wb->access_mutex);
+    while (wb->flushing) {
+        pthread_cond_wait(&wb->flush_done, &wb->access_mutex);
+    }
+    assert(off <= wb->appended);
+    if (RESERVED_BLOCKS + off / wb->block_size >= wb->current_block) {
+        // off is still in the buffer, cut it short there
+        wb->append_head = wb_locate(wb, off + RESERVED_BLOCKS * wb->block_size);
+        wb->appended = off;
+    } else {
+        // the block off is in was written, all the buffer holds is past off
+        err = wb_position(wb, off);
+    }
+    pthread_cond_broadcast(&wb->append_waiting_for_space);
     pthread_mutex_unlock(&wb->access_mutex);
-    pthread_cond_signal(&wb->append_waiting_for_space);
+
+    pthread_mutex_lock(&wb->sync_mutex);
+    wb->durable = MIN(wb->durable, off);
+    wb->syncing = false;
+    pthread_cond_broadcast(&wb->sync_done);
+    pthread_mutex_unlock(&wb->sync_mutex);
+    if (err) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
 }
 
 void wb_shutdown(WriteBuffer *buf) {
@@ -403,23 +655,37 @@ void wb_shutdown(WriteBuffer *buf) {
 }
 
 static void *worker_loop(WriteBuffer *buf) {
+    u64 last_sync = ref_time();
+
     while (true) {
+        int err;
+
         if (buf->shutdown) {
             return NULL;
         }
 
-        wb_flush(buf, false);
+        if (buf->sync_policy == LOGFS_SYNC_PERIODIC && ref_time() - last_sync >= buf->sync_interval) {
+            err = wb_sync(buf, wb_appended(buf));
+            last_sync = ref_time();
+        } else {
+            err = wb_flush(buf, false);
+        }
 
+        // wake up at least once per second, or once per sync interval
+        u64 wait = buf->sync_policy == LOGFS_SYNC_PERIODIC ? MIN(buf->sync_interval, 1000000) : 1000000;
         struct timespec timeToWait;
         struct timeval now;
-        int rt;
         gettimeofday(&now, NULL);
-        timeToWait.tv_sec = now.tv_sec + 1;
-        timeToWait.tv_nsec = (now.tv_usec) * 1000UL;
-
-        pthread_mutex_lock(&buf->write_cond_mutex);
-        pthread_cond_timedwait(&buf->write_waiting_for_data_to_flush, &buf->write_cond_mutex, &timeToWait);
-        pthread_mutex_unlock(&buf->write_cond_mutex);
+        u64 usec = now.tv_usec + wait;
+        timeToWait.tv_sec = now.tv_sec + usec / 1000000;
+        timeToWait.tv_nsec = (usec % 1000000) * 1000UL;
+
+        pthread_mutex_lock(&buf->access_mutex);
+        // after a failed write, wait before trying again
+        if (!buf->shutdown && (err || wb_usedspace(buf) < (u64)buf->block_size)) {
+            pthread_cond_timedwait(&buf->write_waiting_for_data_to_flush, &buf->access_mutex, &timeToWait);
+        }
+        pthread_mutex_unlock(&buf->access_mutex);
     }
 }
 
@@ -427,104 +693,787 @@ static void *worker_loop(WriteBuffer *buf) {
 /// Read Cache
 ///////////////
 
+// the cache is split into shards by page number, each with its own lock
+#define RCACHE_SHARDS 16
+
+typedef enum SlotState {
+    SLOT_FREE = 0,
+    // a thread is reading the page from the device, without holding the lock
+    SLOT_LOADING,
+    SLOT_VALID
+} SlotState;
+
+typedef struct CacheShard {
+    u8 *read_cache;
+    int nslots;
+    // the page held by each slot, or NO_PAGE if the slot is free.
+    u64 *pages;
+    u8 *state;
+    // a slot that was invalidated while loading is dropped once loaded
+    u8 *stale;
+    // pinned slots are neither evicted nor reused, an invalidated one is
+    // only taken out of the hash map until the last pin is released
+    int *pins;
+    int pinned;
+    // hash map from page number to slot: a bucket holds the first slot of a
+    // chain, linked through next. Both use -1 as the end of chain.
+    int *buckets;
+    int *next;
+    u64 bucket_mask;
+    // CLOCK eviction: a slot is referenced on every hit, and the hand only
+    // evicts slots that were not referenced since it last passed them.
+    u8 *referenced;
+    int hand;
+    // slots [used, nslots) have never been filled
+    int used;
+    // TinyLFU admission, a count-min sketch of how often each page was asked
+    // for lately: SKETCH_ROWS rows of sketch_mask + 1 counters
+    u8 *sketch;
+    u64 sketch_mask;
+    u64 sketch_adds;
+    bool admit_all;
+    // statistics
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    // misses not cached because the page lost to the victim, or was read past
+    // the cache on purpose
+    u64 rejections;
+    u64 bypasses;
+    pthread_mutex_t access_mutex;
+    // signalled whenever a load completes
+    pthread_cond_t loaded;
+} CacheShard;
+
 typedef struct ReadCache {
     struct device *block;
     int block_size;
-    u8 *read_cache;
-    // the pages contained in the read_cache.
-    // -1 means the page is not free.
-    int pages[RCACHE_BLOCKS];
-    // simple round-robin eviction policy.
-    // TODO second-chance/LRU
-    int eviction_index;
-    pthread_mutex_t access_mutex;
+    int nslots;
+    int nshards;
+    CacheShard *shards;
 } ReadCache;
 
-static ReadCache *rc_init(struct device *block) {
+#define NO_PAGE UINT64_MAX
+
+static inline u64 page_hash(u64 page_no) {
+    // Fibonacci hashing, the high bits of the product are the well mixed ones
+    return (page_no * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static inline CacheShard *rc_shard(ReadCache *rc, u64 page_no) {
+    // consecutive pages land in different shards
+    return &rc->shards[page_no & (rc->nshards - 1)];
+}
+
+static inline u64 rc_bucket(CacheShard *shard, u64 page_no) {
+    return page_hash(page_no) & shard->bucket_mask;
+}
+
+// TinyLFU: the sketch has room for a sample of SKETCH_SAMPLE accesses per slot,
+// and its counts are halved after each sample so that old popularity fades
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE 10
+
+static inline u64 sketch_hash(u64 page_no) {
+    // splitmix64's finalizer, the pages of a shard share their low bits
+    page_no = (page_no ^ (page_no >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    page_no = (page_no ^ (page_no >> 27)) * 0x94d049bb133111ebULL;
+    return page_no ^ (page_no >> 31);
+}
+
+static inline u8 *sketch_counter(CacheShard *shard, u64 hash, int row) {
+    // double hashing, the step is odd so rows differ
+    u64 step = (hash >> 32) | 1;
+    return &shard->sketch[row * (shard->sketch_mask + 1) + ((hash + row * step) & shard->sketch_mask)];
+}
+
+/**
+ * How often page_no was asked for, give or take the counters it shares.
+ *
+ * Assumes caller holds the shard's access_mutex.
+ */
+static int sketch_estimate(CacheShard *shard, u64 page_no) {
+    u64 hash = sketch_hash(page_no);
+    int count = SKETCH_MAX;
+
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        count = MIN(count, *sketch_counter(shard, hash, row));
+    }
+    return count;
+}
+
+/**
+ * Count an access to page_no. Only the counters at the estimate are raised,
+ * the others already overcount it.
+ *
+ * Assumes caller holds the shard's access_mutex.
+ */
+static void sketch_add(CacheShard *shard, u64 page_no) {
+    u64 hash = sketch_hash(page_no);
+    int count = sketch_estimate(shard, page_no);
+
+    for (int row = 0; count < SKETCH_MAX && row < SKETCH_ROWS; row++) {
+        u8 *counter = sketch_counter(shard, hash, row);
+        *counter += (*counter == count);
+    }
+    if (++shard->sketch_adds == SKETCH_SAMPLE * (u64)shard->nslots) {
+        for (u64 i = 0; i < SKETCH_ROWS * (shard->sketch_mask + 1); i++) {
+            shard->sketch[i] >>= 1;
+        }
+        shard->sketch_adds /= 2;
+    }
+}
+
+static void shard_init(CacheShard *shard, int nslots, int block_size, bool admit_all) {
+    u64 buckets, width;
+
+    shard->nslots = nslots;
+    shard->read_cache = aligned_alloc(block_size, (u64)block_size * nslots);
+    shard->pages = malloc(nslots * sizeof(shard->pages[0]));
+    shard->next = malloc(nslots * sizeof(shard->next[0]));
+    shard->state = calloc(nslots, sizeof(shard->state[0]));
+    shard->stale = calloc(nslots, sizeof(shard->stale[0]));
+    shard->referenced = calloc(nslots, sizeof(shard->referenced[0]));
+    shard->pins = calloc(nslots, sizeof(shard->pins[0]));
+    shard->pinned = 0;
+    for (buckets = 1; buckets < (u64)nslots; buckets <<= 1) {
+    }
+    shard->buckets = malloc(buckets * sizeof(shard->buckets[0]));
+    shard->bucket_mask = buckets - 1;
+    for (int i = 0; i < nslots; i++) {
+        shard->pages[i] = NO_PAGE;
+        shard->next[i] = -1;
+    }
+    memset(shard->buckets, -1, buckets * sizeof(shard->buckets[0]));
+    shard->hand = 0;
+    shard->used = 0;
+    for (width = 64; width < SKETCH_SAMPLE * (u64)nslots; width <<= 1) {
+    }
+    shard->sketch = calloc(SKETCH_ROWS * width, sizeof(shard->sketch[0]));
+    shard->sketch_mask = width - 1;
+    shard->sketch_adds = 0;
+    shard->admit_all = admit_all;
+    shard->hits = shard->misses = shard->evictions = 0;
+    shard->rejections = shard->bypasses = 0;
+    pthread_mutex_init(&shard->access_mutex, NULL);
+    pthread_cond_init(&shard->loaded, NULL);
+}
+
+static void shard_free(CacheShard *shard) {
+    pthread_cond_destroy(&shard->loaded);
+    pthread_mutex_destroy(&shard->access_mutex);
+    free(shard->read_cache);
+    free(shard->pages);
+    free(shard->next);
+    free(shard->state);
+    free(shard->stale);
+    free(shard->referenced);
+    free(shard->pins);
+    free(shard->buckets);
+    free(shard->sketch);
+}
+
+static ReadCache *rc_init(struct device *block, u64 budget, bool admit_all) {
     ReadCache *rc = malloc(sizeof(ReadCache));
+
     rc->block = block;
     rc->block_size = device_block(block);
-    rc->read_cache = malloc(device_block(block) * RCACHE_BLOCKS);
-    memset(rc->pages, -1, RCACHE_BLOCKS * sizeof(int));
-    rc->eviction_index = 0;
-    pthread_mutex_init(&rc->access_mutex, NULL);
+    rc->nslots = MAX(budget / rc->block_size, 1);
+    // a power of two number of shards, none of them empty
+    rc->nshards = 1;
+    while (rc->nshards < RCACHE_SHARDS && rc->nshards * 2 <= rc->nslots) {
+        rc->nshards *= 2;
+    }
+    rc->shards = malloc(rc->nshards * sizeof(CacheShard));
+    for (int i = 0; i < rc->nshards; i++) {
+        int nslots = rc->nslots / rc->nshards + (i < rc->nslots % rc->nshards);
+        shard_init(&rc->shards[i], nslots, rc->block_size, admit_all);
+    }
     return rc;
 }
 
+static void rc_free(ReadCache *rc) {
+    for (int i = 0; i < rc->nshards; i++) {
+        shard_free(&rc->shards[i]);
+    }
+    free(rc->shards);
+    free(rc);
+}
+
+/**
+ * Returns the slot holding page_no, or -1.
+ *
+ * Assumes caller holds the shard's access_mutex.
+ */
+static int rc_find(CacheShard *shard, u64 page_no) {
+    int slot = shard->buckets[rc_bucket(shard, page_no)];
+    while (slot != -1 && shard->pages[slot] != page_no) {
+        slot = shard->next[slot];
+    }
+    return slot;
+}
+
+static void rc_link(CacheShard *shard, int slot, u64 page_no) {
+    u64 bucket = rc_bucket(shard, page_no);
+    shard->pages[slot] = page_no;
+    shard->next[slot] = shard->buckets[bucket];
+    shard->buckets[bucket] = slot;
+}
+
 /**
- * Return the first free page. If no free page, evict the page identified by eviction_index.
+ * Removes a slot from the hash map, leaving its state alone.
  *
- * Assumes caller holds access_mutex.
+ * Assumes caller holds the shard's access_mutex.
  */
-static int get_free_page(ReadCache *rc) {
-    for (int i = 0; i < RCACHE_BLOCKS; i++) {
-        if (rc->pages[i] == -1) {
-            return i;
+static void rc_unchain(CacheShard *shard, int slot) {
+    int *link = &shard->buckets[rc_bucket(shard, shard->pages[slot])];
+    while (*link != slot) {
+        link = &shard->next[*link];
+    }
+    *link = shard->next[slot];
+    shard->next[slot] = -1;
+    shard->pages[slot] = NO_PAGE;
+}
+
+/**
+ * Removes a slot from the hash map and marks it free.
+ *
+ * Assumes caller holds the shard's access_mutex.
+ */
+static void rc_unlink(CacheShard *shard, int slot) {
+    rc_unchain(shard, slot);
+    shard->state[slot] = SLOT_FREE;
+    shard->stale[slot] = 0;
+    shard->referenced[slot] = 0;
+}
+
+// get_free_page() kept the victim over the page to be cached
+#define RC_REJECT -2
+
+/**
+ * Return a never used slot if there is one. Otherwise advance the CLOCK hand,
+ * giving referenced slots a second chance, and evict the first one that is not.
+ * Free slots left behind by rc_invalidate() are taken as the hand reaches them,
+ * slots being loaded are skipped. Returns -1 if every slot is being loaded.
+ *
+ * Unless every page is admitted, the victim is only evicted for a page_no that
+ * the sketch says is asked for more often. Otherwise it stays, the hand left
+ * on it, and RC_REJECT is returned: a scan of pages read once can't push out
+ * the pages that are read again and again.
+ *
+ * Assumes caller holds the shard's access_mutex.
+ */
+static int get_free_page(CacheShard *shard, u64 page_no) {
+    if (shard->used < shard->nslots) {
+        return shard->used++;
+    }
+    // two sweeps: the first may only be clearing reference bits
+    for (int i = 0; i < 2 * shard->nslots; i++) {
+        int slot = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->nslots;
+        if (shard->state[slot] == SLOT_FREE) {
+            return slot;
+        }
+        if (shard->state[slot] == SLOT_LOADING || shard->pins[slot]) {
+            continue;
+        }
+        if (shard->referenced[slot]) {
+            shard->referenced[slot] = 0;
+            continue;
+        }
+        if (!shard->admit_all && sketch_estimate(shard, page_no) <= sketch_estimate(shard, shard->pages[slot])) {
+            shard->hand = slot;
+            shard->rejections++;
+            return RC_REJECT;
+        }
+        rc_unlink(shard, slot);
+        shard->evictions++;
+        return slot;
+    }
+    return -1;
+}
+
+static void rc_invalidate(ReadCache *rc, u64 page_no) {
+    CacheShard *shard = rc_shard(rc, page_no);
+
+    pthread_mutex_lock(&shard->access_mutex);
+    int slot = rc_find(shard, page_no);
+    if (slot != -1) {
+        if (shard->state[slot] == SLOT_LOADING) {
+            shard->stale[slot] = 1;
+        } else if (shard->pins[slot]) {
+            rc_unchain(shard, slot);
+        } else {
+            rc_unlink(shard, slot);
+        }
+    }
+    pthread_mutex_unlock(&shard->access_mutex);
+}
+
+// a page rc_read() claimed for loading, or had to put off
+typedef struct Miss {
+    u64 page_no;
+    int slot;
+    u8 *buf;
+    int offset;
+    int len;
+    // pin the slot instead of (or besides) copying out of it
+    bool pin;
+    // a page that isn't cached is read past the cache, and not counted
+    bool nocache;
+} Miss;
+
+/**
+ * Pin a valid slot. Fails once half the shard is pinned, so that pins held by
+ * callers can never starve the cache of slots.
+ *
+ * Assumes caller holds the shard's access_mutex.
+ */
+static bool rc_pinslot(CacheShard *shard, int slot) {
+    if (!shard->pins[slot]) {
+        if (2 * (shard->pinned + 1) > shard->nslots) {
+            return false;
+        }
+        shard->pinned++;
+    }
+    shard->pins[slot]++;
+    return true;
+}
+
+static void rc_unpin(ReadCache *rc, u64 page_no, int slot) {
+    CacheShard *shard = rc_shard(rc, page_no);
+
+    pthread_mutex_lock(&shard->access_mutex);
+    assert(shard->pins[slot] > 0);
+    if (!--shard->pins[slot]) {
+        shard->pinned--;
+        if (shard->pages[slot] == NO_PAGE) {
+            // invalidated while pinned
+            shard->state[slot] = SLOT_FREE;
+            shard->stale[slot] = 0;
+            shard->referenced[slot] = 0;
         }
+        pthread_cond_broadcast(&shard->loaded);
     }
-    int page_to_return = rc->eviction_index;
-    rc->eviction_index = (rc->eviction_index + 1) % RCACHE_BLOCKS;
-    return page_to_return;
+    pthread_mutex_unlock(&shard->access_mutex);
 }
 
-static void rc_invalidate(ReadCache *rc, int page_no) {
-    for (int i = 0; i < RCACHE_BLOCKS; i++) {
-        if (rc->pages[i] == page_no) {
-            rc->pages[i] = -1;
+/**
+ * Copy the loaded page out of the slot, and publish the slot to other readers.
+ * A requested pin that can't be had leaves miss->slot at -1.
+ *
+ * If the device read failed the slot is freed instead, miss->slot left at -1,
+ * and the readers waiting for the page go read it themselves. Returns -1 then.
+ */
+static int rc_complete(ReadCache *rc, Miss *miss, bool failed) {
+    CacheShard *shard = rc_shard(rc, miss->page_no);
+    u8 *page_ptr = shard->read_cache + (u64)miss->slot * rc->block_size;
+
+    pthread_mutex_lock(&shard->access_mutex);
+    if (failed) {
+        rc_unlink(shard, miss->slot);
+        miss->slot = -1;
+        pthread_cond_broadcast(&shard->loaded);
+        pthread_mutex_unlock(&shard->access_mutex);
+        TRACE("page read failed");
+        return -1;
+    }
+    if (miss->buf) {
+        memcpy(miss->buf, page_ptr + miss->offset, miss->len);
+    }
+    if (shard->stale[miss->slot]) {
+        rc_unlink(shard, miss->slot);
+        miss->slot = miss->pin ? -1 : miss->slot;
+    } else {
+        shard->state[miss->slot] = SLOT_VALID;
+        if (miss->pin && !rc_pinslot(shard, miss->slot)) {
+            miss->slot = -1;
         }
     }
+    pthread_cond_broadcast(&shard->loaded);
+    pthread_mutex_unlock(&shard->access_mutex);
+    return 0;
+}
+
+/**
+ * Read the page of a miss that is not to be cached straight from the device,
+ * and copy its part out. Returns 0 on success, -1 on error.
+ */
+static int rc_bypass(ReadCache *rc, Miss *miss) {
+    u8 *page = aligned_alloc(rc->block_size, rc->block_size);
+
+    if (!page) {
+        TRACE("out of memory");
+        return -1;
+    }
+    if (device_read(rc->block, page, blk_locate(rc->block, miss->page_no), rc->block_size)) {
+        free(page);
+        TRACE(0);
+        return -1;
+    }
+    memcpy(miss->buf, page + miss->offset, miss->len);
+    free(page);
+    return 0;
+}
+
+/**
+ * The non-blocking half of rc_copypage(). Returns 1 on a hit, with the data
+ * copied to miss->buf. Returns 0 on a miss: either the page was claimed for
+ * loading by the caller, who must read it into miss->slot and call
+ * rc_complete(), or it is not to be cached, miss->slot is -1, and the caller
+ * reads it past the cache. Returns -1 if the page is being loaded by another
+ * thread or no slot is available.
+ */
+static int rc_probe(ReadCache *rc, Miss *miss) {
+    CacheShard *shard = rc_shard(rc, miss->page_no);
+    int slot;
+
+    pthread_mutex_lock(&shard->access_mutex);
+    if (!miss->nocache) {
+        sketch_add(shard, miss->page_no);
+    }
+    slot = rc_find(shard, miss->page_no);
+    if (slot != -1 && shard->state[slot] == SLOT_VALID) {
+        shard->hits++;
+        shard->referenced[slot] |= !miss->nocache;
+        memcpy(miss->buf, shard->read_cache + (u64)slot * rc->block_size + miss->offset, miss->len);
+        pthread_mutex_unlock(&shard->access_mutex);
+        return 1;
+    }
+    if (slot != -1 || (!miss->nocache && (slot = get_free_page(shard, miss->page_no)) == -1)) {
+        pthread_mutex_unlock(&shard->access_mutex);
+        return -1;
+    }
+    shard->misses++;
+    if (miss->nocache || slot == RC_REJECT) {
+        shard->bypasses += miss->nocache;
+        miss->slot = -1;
+        pthread_mutex_unlock(&shard->access_mutex);
+        return 0;
+    }
+    rc_link(shard, slot, miss->page_no);
+    shard->state[slot] = SLOT_LOADING;
+    miss->slot = slot;
+    pthread_mutex_unlock(&shard->access_mutex);
+    return 0;
 }
 
 /**
- * Get the page at the given page number.
- * If it doesn't exist in the cache, read it from the device and store in the cache first.
+ * Copy miss->len bytes at miss->offset within page miss->page_no into miss->buf,
+ * if there is a buffer, and pin the page if asked to. If the page isn't cached,
+ * read it from the device and store it in the cache first, unless it is not to
+ * be cached. On return miss->slot is the slot that held the page, -1 if it
+ * couldn't be pinned or wasn't cached.
  *
- * Will return a pointer to the page in the cache. This memory is not thread-safe, and must be copied elsewhere before releasing the lock.
+ * The device read happens without holding the shard lock. The slot is marked as
+ * loading in the meantime, so concurrent misses on the same page wait for that
+ * single read instead of issuing their own.
  *
- * Assumes that the caller holds access_mutex.
+ * Returns 0 on success, -1 if the device read failed.
  */
-static u8 *rc_getpage(ReadCache *rc, int page_no) {
-    for (int i = 0; i < RCACHE_BLOCKS; i++) {
-        if (rc->pages[i] == page_no) {
-            return rc->read_cache + i * rc->block_size;
+static int rc_copypage(ReadCache *rc, Miss *miss) {
+    u64 page_no = miss->page_no;
+    CacheShard *shard = rc_shard(rc, page_no);
+    u8 *page_ptr;
+    int slot;
+
+    pthread_mutex_lock(&shard->access_mutex);
+    if (!miss->nocache) {
+        sketch_add(shard, page_no);
+    }
+    while (true) {
+        slot = rc_find(shard, page_no);
+        if (slot != -1 && shard->state[slot] == SLOT_VALID) {
+            shard->hits++;
+            shard->referenced[slot] |= !miss->nocache;
+            page_ptr = shard->read_cache + (u64)slot * rc->block_size;
+            if (miss->buf) {
+                memcpy(miss->buf, page_ptr + miss->offset, miss->len);
+            }
+            miss->slot = (!miss->pin || rc_pinslot(shard, slot)) ? slot : -1;
+            pthread_mutex_unlock(&shard->access_mutex);
+            return 0;
+        }
+        if (slot != -1) {
+            // someone else is reading it, wait for them
+            pthread_cond_wait(&shard->loaded, &shard->access_mutex);
+            continue;
         }
+        if (miss->nocache) {
+            slot = RC_REJECT;
+            break;
+        }
+        if ((slot = get_free_page(shard, page_no)) == -1) {
+            // every slot is in flight
+            pthread_cond_wait(&shard->loaded, &shard->access_mutex);
+            continue;
+        }
+        break;
     }
+
     // page not in cache
-    int page_to_replace = get_free_page(rc);
-    rc->pages[page_to_replace] = page_no;
-    u8 *page_ptr = rc->read_cache + (page_to_replace * rc->block_size);
-    device_read(rc->block, page_ptr, page_no * rc->block_size, rc->block_size);
-    return rc->read_cache + page_to_replace * rc->block_size;
+    shard->misses++;
+    if (slot == RC_REJECT) {
+        shard->bypasses += miss->nocache;
+        pthread_mutex_unlock(&shard->access_mutex);
+        miss->slot = -1;
+        if (miss->buf && rc_bypass(rc, miss)) {
+            TRACE(0);
+            return -1;
+        }
+        return 0;
+    }
+    rc_link(shard, slot, page_no);
+    shard->state[slot] = SLOT_LOADING;
+    page_ptr = shard->read_cache + (u64)slot * rc->block_size;
+    pthread_mutex_unlock(&shard->access_mutex);
+
+    int err = device_read(rc->block, page_ptr, blk_locate(rc->block, page_no), rc->block_size);
+
+    miss->slot = slot;
+    return rc_complete(rc, miss, err);
+}
+
+// misses of one rc_read() that are sent to the device together
+#define RCACHE_BATCH 32
+
+static inline u8 *rc_slot(ReadCache *rc, Miss *miss) {
+    return rc_shard(rc, miss->page_no)->read_cache + (u64)miss->slot * rc->block_size;
+}
+
+/**
+ * Read the missed pages with one device batch and complete them, then serve
+ * the pages that were put off, which may block.
+ *
+ * Missed pages that follow each other on the device are read with a single
+ * request, into a bounce buffer that is then copied to their slots. Pages not
+ * to be cached have no slot and are always read into the bounce buffer. Without
+ * memory for it every page is read on its own.
+ *
+ * A page whose request failed is not cached. Every page is completed or served
+ * regardless, and -1 returned if any of them failed.
+ */
+static int rc_load(ReadCache *rc, Miss *misses, int *nmisses, Miss *deferred, int *ndeferred) {
+    struct device_io ios[RCACHE_BATCH];
+    int first[RCACHE_BATCH];   // ios[i] reads misses first[i] on
+    bool bounced[RCACHE_BATCH] = {false};
+    bool failed[RCACHE_BATCH] = {false};
+    bool uncached = false;
+    u8 *bounce = NULL;
+    int n = 0;
+    int err = 0;
+
+    for (int i = 0; i < *nmisses; i++) {
+        uncached |= misses[i].slot == -1;
+        u64 off = blk_locate(rc->block, misses[i].page_no);
+        if (n && ios[n - 1].off + ios[n - 1].len == off) {
+            ios[n - 1].len += rc->block_size;
+            continue;
+        }
+        first[n] = i;
+        ios[n].off = off;
+        ios[n].len = rc->block_size;
+        ios[n].write = 0;
+        n++;
+    }
+    if ((n < *nmisses || uncached) &&
+        !(bounce = aligned_alloc(rc->block_size, (u64)*nmisses * rc->block_size))) {
+        // one request per cached page after all, the others read on their own
+        n = 0;
+        for (int i = 0; i < *nmisses; i++) {
+            if (misses[i].slot == -1) {
+                if (rc_bypass(rc, &misses[i])) {
+                    err = -1;
+                }
+                continue;
+            }
+            first[n] = i;
+            ios[n].off = blk_locate(rc->block, misses[i].page_no);
+            ios[n].len = rc->block_size;
+            ios[n].write = 0;
+            n++;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        int pages = ios[i].len / rc->block_size;
+        if (pages > 1 || misses[first[i]].slot == -1) {
+            ios[i].buf = bounce + (u64)first[i] * rc->block_size;
+            for (int j = first[i]; j < first[i] + pages; j++) {
+                bounced[j] = true;
+            }
+        } else {
+            ios[i].buf = rc_slot(rc, &misses[first[i]]);
+        }
+    }
+    if (device_submit(rc->block, ios, n)) {
+        for (int i = 0; i < n; i++) {
+            int pages = ios[i].len / rc->block_size;
+            for (int j = first[i]; ios[i].result && j < first[i] + pages; j++) {
+                failed[j] = true;
+            }
+        }
+    }
+    for (int i = 0; i < *nmisses; i++) {
+        u8 *page = bounce + (u64)i * rc->block_size;
+        if (failed[i]) {
+            err = -1;
+            continue;
+        }
+        if (!bounced[i]) {
+            continue;
+        }
+        if (misses[i].slot == -1) {
+            memcpy(misses[i].buf, page + misses[i].offset, misses[i].len);
+        } else {
+            memcpy(rc_slot(rc, &misses[i]), page, rc->block_size);
+        }
+    }
+    free(bounce);
+    for (int i = 0; i < *nmisses; i++) {
+        if (misses[i].slot != -1 && rc_complete(rc, &misses[i], failed[i])) {
+            err = -1;
+        }
+    }
+    for (int i = 0; i < *ndeferred; i++) {
+        if (rc_copypage(rc, &deferred[i])) {
+            err = -1;
+        }
+    }
+    *nmisses = *ndeferred = 0;
+    if (err) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * Read data from the cache into the given buffer.
  *
  * Will query the cache for the page containing the given address. Can handle data spanning mulitple pages.
- * Guaranteed to succeed, assuming that the address is valid and buffer is large enough.
+ * Returns 0 on success, -1 if a page could not be read from the device.
+ *
+ * The pages missing from the cache are claimed first and then read from the device
+ * together. Pages that another thread is loading are waited for only after that, so
+ * a reader never blocks while holding claimed slots.
+ *
+ * With nocache the pages missing from the cache are read past it, and the read
+ * counts neither towards the admission of pages nor as a reference to them.
  *
  * Threadsafe & reentrant.
  */
-void rc_read(ReadCache *rc, u8 *buf, Region region) {
-    pthread_mutex_lock(&rc->access_mutex);
-    int current_page = region.address / rc->block_size;
+int rc_read(ReadCache *rc, u8 *buf, Region region, bool nocache) {
+    Miss misses[RCACHE_BATCH], deferred[RCACHE_BATCH];
+    int nmisses = 0, ndeferred = 0;
+    int err = 0;
+    u64 current_page = region.address / rc->block_size;
     int page_offset = region.address % rc->block_size;
 
     u64 copied_bytes = 0;
     while (copied_bytes < region.size) {
-        u8 *page_data = rc_getpage(rc, current_page);
-        u8 *data_to_copy = page_data + page_offset;
         int length_to_copy = MIN(region.size - copied_bytes, rc->block_size - page_offset);
 
-        log("[rc] %d[%d..%d]<%d>\n", current_page, page_offset, page_offset + length_to_copy, length_to_copy);
-        memcpy(buf + copied_bytes, data_to_copy, length_to_copy);
+        log("[rc] %ld[%d..%d]<%d>\n", current_page, page_offset, page_offset + length_to_copy, length_to_copy);
+        Miss miss = {.page_no = current_page,
+                     .slot = -1,
+                     .buf = buf + copied_bytes,
+                     .offset = page_offset,
+                     .len = length_to_copy,
+                     .pin = false,
+                     .nocache = nocache};
+        int r = rc_probe(rc, &miss);
+        if (r == 0) {
+            misses[nmisses++] = miss;
+        } else if (r < 0) {
+            deferred[ndeferred++] = miss;
+        }
+        if ((nmisses == RCACHE_BATCH || ndeferred == RCACHE_BATCH) &&
+            rc_load(rc, misses, &nmisses, deferred, &ndeferred)) {
+            err = -1;
+        }
 
         page_offset = 0;
         copied_bytes += length_to_copy;
         current_page++;
     }
+    if (rc_load(rc, misses, &nmisses, deferred, &ndeferred)) {
+        err = -1;
+    }
     assert(copied_bytes == region.size);
-    pthread_mutex_unlock(&rc->access_mutex);
+    if (err) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+static int miss_compare(const void *a, const void *b) {
+    u64 x = ((const Miss *)a)->page_no;
+    u64 y = ((const Miss *)b)->page_no;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Splits region into one Miss per page, to be copied to buf. Returns the number
+ * of pages.
+ */
+static u64 rc_pages(ReadCache *rc, u8 *buf, Region region, Miss *misses) {
+    u64 page_no = region.address / rc->block_size;
+    int page_offset = region.address % rc->block_size;
+    u64 n = 0;
+
+    for (u64 copied = 0; copied < region.size; copied += misses[n++].len) {
+        int len = MIN(region.size - copied, (u64)(rc->block_size - page_offset));
+        // multi-gets are point reads, cached as any other
+        Miss miss = {.page_no = page_no++,
+                     .slot = -1,
+                     .buf = buf + copied,
+                     .offset = page_offset,
+                     .len = len,
+                     .pin = false,
+                     .nocache = false};
+        misses[n] = miss;
+        page_offset = 0;
+    }
+    return n;
+}
+
+/**
+ * rc_read() of the n pieces of pages in misses, from any number of regions.
+ * They are served in page order, so that the misses of neighbouring pages are
+ * claimed together and share a device request, and a page several pieces need
+ * is read once. Returns -1 if any page could not be read.
+ */
+static int rc_read_batch(ReadCache *rc, Miss *pieces, u64 n) {
+    Miss misses[RCACHE_BATCH], deferred[RCACHE_BATCH];
+    int nmisses = 0, ndeferred = 0;
+    int err = 0;
+
+    if (!n) {
+        return 0;
+    }
+    qsort(pieces, n, sizeof(Miss), miss_compare);
+    for (u64 i = 0; i < n; i++) {
+        int r = rc_probe(rc, &pieces[i]);
+        if (r == 0) {
+            misses[nmisses++] = pieces[i];
+        } else if (r < 0) {
+            deferred[ndeferred++] = pieces[i];
+        }
+        if ((nmisses == RCACHE_BATCH || ndeferred == RCACHE_BATCH) &&
+            rc_load(rc, misses, &nmisses, deferred, &ndeferred)) {
+            err = -1;
+        }
+    }
+    if (rc_load(rc, misses, &nmisses, deferred, &ndeferred)) {
+        err = -1;
+    }
+    if (err) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
 }
 
 //////////////
@@ -535,9 +1484,25 @@ typedef struct logfs {
     WriteBuffer *wb;
     ReadCache *cache;
     Metadata meta;
+    // logical end of the log, and the start of the live part of it.
+    // Everything before the tail may be overwritten once the log wraps.
+    u64 head;
+    u64 tail;
+    // number of device blocks available to the log
+    u64 data_blocks;
+    // the log on the device outlives the logfs: blocks are only reused once
+    // a checkpoint has recorded the tail past them
+    bool persistent;
+    // a failed append could not be taken back, the log takes no more
+    bool broken;
 } LogFS;
 
-int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len) {
+/* the start of the log space that may not be overwritten */
+static inline u64 logfs_keep(LogFS *logfs) {
+    return logfs->persistent ? logfs->meta.tail : logfs->tail;
+}
+
+static int read_log(struct logfs *logfs, void *buf, uint64_t off, size_t len, bool nocache) {
     // offset to account for the "hidden" first page
     Region region = new_region(off + logfs->wb->block_size, len);
 
@@ -548,6 +1513,11 @@ int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len) {
         // we no longer need this lock
         pthread_mutex_unlock(&logfs->wb->access_mutex);
     }
+    counter_add(logfs->wb->stats,
+                plan.strategy == CACHE          ? STAT_READS_CACHE
+                : plan.strategy == WRITE_BUFFER ? STAT_READS_WRITE_BUFFER
+                                                : STAT_READS_BOTH,
+                1);
 
 #ifdef DEBUG
     if (plan.strategy == BOTH) {
@@ -555,70 +1525,430 @@ int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len) {
     }
 #endif
 
+    int err = 0;
     if (plan.strategy == CACHE || plan.strategy == BOTH) {
-        rc_read(logfs->cache, (u8 *)buf, plan.disk_region);
+        err = rc_read(logfs->cache, (u8 *)buf, plan.disk_region, nocache);
     }
     if (plan.strategy == WRITE_BUFFER || plan.strategy == BOTH) {
         wb_read(logfs->wb, (u8 *)buf + plan.disk_region.size, plan.wb_region);
         pthread_mutex_unlock(&logfs->wb->access_mutex);
     }
+    if (err) {
+        TRACE(0);
+        return -1;
+    }
+    return 0;
+}
+
+int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len) {
+    return read_log(logfs, buf, off, len, false);
+}
+
+int logfs_read_nocache(struct logfs *logfs, void *buf, uint64_t off, size_t len) {
+    return read_log(logfs, buf, off, len, true);
+}
+
+int logfs_read_batch(struct logfs *logfs, const struct logfs_read *reads, uint64_t n) {
+    ReadCache *rc = logfs->cache;
+    u64 block_size = logfs->wb->block_size;
+    u64 npieces = 0;
+    bool *cached;
+    Miss *pieces = NULL;
+
+    // the reads past the write buffer, and the pages they span
+    if ((cached = calloc(n, sizeof(bool)))) {
+        pthread_mutex_lock(&logfs->wb->access_mutex);
+        for (u64 i = 0; i < n; i++) {
+            Region region = new_region(reads[i].off + block_size, reads[i].len);
+            cached[i] = reads[i].len && wb_analyze(logfs->wb, region).strategy == CACHE;
+            if (cached[i]) {
+                npieces += (region_end(region) - 1) / block_size - region.address / block_size + 1;
+            }
+        }
+        pthread_mutex_unlock(&logfs->wb->access_mutex);
+        if (npieces && !(pieces = malloc(npieces * sizeof(Miss)))) {
+            // read them one at a time after all
+            memset(cached, 0, n * sizeof(bool));
+        }
+    }
+
+    npieces = 0;
+    for (u64 i = 0; i < n; i++) {
+        if (cached && cached[i]) {
+            counter_add(logfs->wb->stats, STAT_READS_CACHE, 1);
+            npieces += rc_pages(rc, reads[i].buf, new_region(reads[i].off + block_size, reads[i].len), pieces + npieces);
+        } else if (reads[i].len && logfs_read(logfs, reads[i].buf, reads[i].off, reads[i].len)) {
+            FREE(pieces);
+            FREE(cached);
+            TRACE(0);
+            return -1;
+        }
+    }
+    if (rc_read_batch(rc, pieces, npieces)) {
+        FREE(pieces);
+        FREE(cached);
+        TRACE(0);
+        return -1;
+    }
+    FREE(pieces);
+    FREE(cached);
+    return 0;
+}
+
+void logfs_release(struct logfs *logfs, struct logfs_ref *ref) {
+    for (int i = 0; i < ref->npinned_; i++) {
+        rc_unpin(logfs->cache, ref->pages_[i], ref->slots_[i]);
+    }
+    FREE(ref->copy_);
+    memset(ref, 0, sizeof(struct logfs_ref));
+}
+
+int logfs_read_ref(struct logfs *logfs, uint64_t off, size_t len, struct logfs_ref *ref) {
+    ReadCache *rc = logfs->cache;
+    Region region = new_region(off + logfs->wb->block_size, len);
+    u64 first = region.address / rc->block_size;
+    u64 last = (region_end(region) - 1) / rc->block_size;
+
+    memset(ref, 0, sizeof(struct logfs_ref));
+    if (!len) {
+        return 0;
+    }
+
+    // only data that has left the write buffer sits in cache pages
+    pthread_mutex_lock(&logfs->wb->access_mutex);
+    FetchPlan plan = wb_analyze(logfs->wb, region);
+    pthread_mutex_unlock(&logfs->wb->access_mutex);
+
+    if (plan.strategy == CACHE && last - first < LOGFS_REF_PAGES) {
+        int page_offset = region.address % rc->block_size;
+        u64 left = len;
+        for (u64 page_no = first; page_no <= last; page_no++) {
+            int length = MIN(left, (u64)(rc->block_size - page_offset));
+            // a pinned page has to be in the cache
+            Miss miss = {.page_no = page_no, .slot = -1, .buf = NULL, .offset = 0, .len = 0, .pin = true, .nocache = false};
+            if (rc_copypage(rc, &miss)) {
+                logfs_release(logfs, ref);
+                TRACE(0);
+                return -1;
+            }
+            if (miss.slot == -1) {
+                break;
+            }
+            CacheShard *shard = rc_shard(rc, page_no);
+            ref->pages_[ref->npinned_] = page_no;
+            ref->slots_[ref->npinned_] = miss.slot;
+            ref->npinned_++;
+            ref->iov[ref->iovcnt].iov_base = shard->read_cache + (u64)miss.slot * rc->block_size + page_offset;
+            ref->iov[ref->iovcnt].iov_len = length;
+            ref->iovcnt++;
+            page_offset = 0;
+            left -= length;
+        }
+        if (!left) {
+            counter_add(logfs->wb->stats, STAT_READS_CACHE, 1);
+            return 0;
+        }
+        logfs_release(logfs, ref);
+    }
 
+    // in the write buffer, too many pages, or the cache is short on slots: copy
+    if (!(ref->copy_ = malloc(len))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    if (logfs_read(logfs, ref->copy_, off, len)) {
+        FREE(ref->copy_);
+        TRACE(0);
+        return -1;
+    }
+    ref->iov[0].iov_base = ref->copy_;
+    ref->iov[0].iov_len = len;
+    ref->iovcnt = 1;
     return 0;
 }
 
 int logfs_append(struct logfs *logfs, const void *buf, uint64_t len) {
-    rc_invalidate(logfs->cache, logfs->wb->current_block);
-    wb_append(logfs->wb, (const u8 *)buf, len);
+    struct iovec iov = {(void *)buf, len};
+
+    return logfs_appendv(logfs, &iov, 1);
+}
+
+/**
+ * Take back what a failed append put in the log since head, so that the next
+ * append lands where its caller expects it.
+ */
+static int logfs_unwind(struct logfs *logfs, u64 head) {
+    if (wb_rewind(logfs->wb, head)) {
+        logfs->broken = true;
+    }
+    logfs->head = head;
+    TRACE(0);
+    return -1;
+}
+
+int logfs_appendv(struct logfs *logfs, const struct iovec *iov, int iovcnt) {
+    u64 block_size = logfs->wb->block_size;
+    u64 max_chunk = logfs->wb->buf_size / 2;
+    u64 head = logfs->head;
+    u64 len = 0;
+
+    if (logfs->broken) {
+        TRACE("log broken");
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    // the blocks spanned from the tail to the new head must fit on the device
+    if ((logfs->head + len + block_size - 1) / block_size - logfs_keep(logfs) / block_size > logfs->data_blocks) {
+        TRACE("log full");
+        return -1;
+    }
+    if (len <= max_chunk) {
+        rc_invalidate(logfs->cache, logfs->wb->current_block);
+        if (wb_appendv(logfs->wb, iov, iovcnt, len)) {
+            TRACE(0);
+            return -1;
+        }
+        logfs->head += len;
+    } else {
+        // large appends are fed through the write buffer in pieces it can hold
+        for (int i = 0; i < iovcnt; i++) {
+            const u8 *data = iov[i].iov_base;
+            u64 left = iov[i].iov_len;
+            while (left) {
+                struct iovec chunk = {(void *)data, MIN(left, max_chunk)};
+                rc_invalidate(logfs->cache, logfs->wb->current_block);
+                if (wb_appendv(logfs->wb, &chunk, 1, chunk.iov_len)) {
+                    return logfs_unwind(logfs, head);
+                }
+                logfs->head += chunk.iov_len;
+                data += chunk.iov_len;
+                left -= chunk.iov_len;
+            }
+        }
+    }
+    if (logfs->wb->sync_policy == LOGFS_SYNC_OP && wb_sync(logfs->wb, logfs->head)) {
+        return logfs_unwind(logfs, head);
+    }
     return 0;
 }
 
-struct logfs *logfs_open(const char *pathname, bool enable_persistence) {
-    struct device *block = device_open(pathname);
+int logfs_sync(struct logfs *logfs, uint64_t off) {
+    assert(off <= logfs->head);
+
+    return wb_sync(logfs->wb, off);
+}
+
+void logfs_trim(struct logfs *logfs, uint64_t off) {
+    assert(off <= logfs->head);
+    logfs->tail = MAX(logfs->tail, off);
+}
+
+u64 logfs_capacity(struct logfs *logfs) {
+    // one block of slack for the partially written block at either end
+    return (logfs->data_blocks - 1) * logfs->wb->block_size;
+}
+
+u64 logfs_flushed(struct logfs *logfs) {
+    pthread_mutex_lock(&logfs->wb->access_mutex);
+    u64 current_block = logfs->wb->current_block;
+    pthread_mutex_unlock(&logfs->wb->access_mutex);
+    // less the reserved blocks at the start of the device
+    return (current_block - RESERVED_BLOCKS) * logfs->wb->block_size;
+}
+
+struct logfs *logfs_open(const char *pathname, bool enable_persistence, const struct logfs_options *options) {
+    struct device *block = device_open_queue(pathname, (options && options->queue_depth) ? options->queue_depth : DEVICE_QUEUE_DEPTH);
+    if (!block) {
+        TRACE(0);
+        return NULL;
+    }
     LogFS *logfs = malloc(sizeof(LogFS));
-    // if (enable_persistence) {
-    //     logfs->meta = meta_load(block);
-    // } else {
-    // }
-    meta_init(&logfs->meta);
-
-    logfs->wb = wb_init(block, logfs->meta);
-    logfs->cache = rc_init(block);
+    if (!logfs) {
+        device_close(block);
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(logfs, 0, sizeof(LogFS));
+    int r = meta_load(&logfs->meta, block);
+    if (r < 0) {
+        device_close(block);
+        free(logfs);
+        TRACE(0);
+        return NULL;
+    }
+    if (!enable_persistence || r > 0 || !logfs->meta.index.size) {
+        // start over, and make sure a later open does not find the old log
+        meta_init(&logfs->meta, r ? (uint32_t)ref_time() : logfs->meta.epoch + 1);
+        if (meta_save(&logfs->meta, block)) {
+            device_close(block);
+            free(logfs);
+            TRACE(0);
+            return NULL;
+        }
+    }
+    logfs->head = logfs->meta.head;
+    logfs->tail = logfs->meta.tail;
+    logfs->data_blocks = device_size(block) / device_block(block) - RESERVED_BLOCKS;
+    logfs->persistent = enable_persistence;
+
+    if (!(logfs->wb = wb_init(block, logfs->head, options))) {
+        device_close(block);
+        free(logfs);
+        TRACE(0);
+        return NULL;
+    }
+    logfs->cache = rc_init(block,
+                           (options && options->cache_budget) ? options->cache_budget : RCACHE_BUDGET,
+                           options && options->admit_all);
     return logfs;
 }
 
 void logfs_close(struct logfs *logfs) {
+    // a clean shutdown leaves everything on stable storage
+    wb_sync(logfs->wb, wb_appended(logfs->wb));
     wb_shutdown(logfs->wb);
-    //logfs->meta.current_block = logfs->wb->current_block;
-    //logfs->meta.current_offset = logfs->wb->append_head % logfs->wb->block_size;
-    //meta_save(&logfs->meta, logfs->wb->device);
 
     // free write buffer
-    free(logfs->wb->device);
+    device_close(logfs->wb->device);
     free(logfs->wb->buf);
-    free(logfs->wb);
+    free(logfs->wb->virtual_page);
     // free read cache
-    free(logfs->cache->read_cache);
-    free(logfs->cache);
+    rc_free(logfs->cache);
 
+    counter_close(logfs->wb->stats);
+    free(logfs->wb);
     free(logfs);
+}
+
+void logfs_stats(struct logfs *logfs, struct logfs_stats *stats) {
+    ReadCache *rc = logfs->cache;
+
+    memset(stats, 0, sizeof(struct logfs_stats));
+    stats->cache_pages = rc->nslots;
+    for (int i = 0; i < rc->nshards; i++) {
+        CacheShard *shard = &rc->shards[i];
+        pthread_mutex_lock(&shard->access_mutex);
+        stats->cache_hits += shard->hits;
+        stats->cache_misses += shard->misses;
+        stats->cache_evictions += shard->evictions;
+        stats->cache_rejections += shard->rejections;
+        stats->cache_bypasses += shard->bypasses;
+        pthread_mutex_unlock(&shard->access_mutex);
+    }
 
-    FREE(virtual_page);
+    struct counter *c = logfs->wb->stats;
+    stats->reads_cache = counter_get(c, STAT_READS_CACHE);
+    stats->reads_write_buffer = counter_get(c, STAT_READS_WRITE_BUFFER);
+    stats->reads_both = counter_get(c, STAT_READS_BOTH);
+    stats->appended_bytes = counter_get(c, STAT_APPENDED_BYTES);
+    stats->append_stalls = counter_get(c, STAT_APPEND_STALLS);
+    stats->stall_us = counter_get(c, STAT_STALL_US);
+    stats->flushes = counter_get(c, STAT_FLUSHES);
+    counter_read(c, STAT_FLUSH_BLOCKS, LOGFS_HIST, stats->flush_blocks);
+    device_stats(logfs->wb->device, &stats->device);
+}
+
+int logfs_read_direct(struct logfs *logfs, void *buf, uint64_t off, size_t len) {
+    struct device *device = logfs->wb->device;
+    u64 block_size = logfs->wb->block_size;
+    u64 first, blocks, n;
+    u8 *bounce;
+
+    if (!len) {
+        return 0;
+    }
+    if (!(bounce = aligned_alloc(block_size, DIRECT_BLOCKS * block_size))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    // whole blocks at a time, up to where the log wraps around the device
+    while (len) {
+        first = off / block_size;
+        blocks = (off % block_size + len + block_size - 1) / block_size;
+        blocks = MIN(blocks, DIRECT_BLOCKS);
+        blocks = MIN(blocks, logfs->data_blocks - first % logfs->data_blocks);
+        if (device_read(device, bounce, blk_locate(device, RESERVED_BLOCKS + first), blocks * block_size)) {
+            free(bounce);
+            TRACE(0);
+            return -1;
+        }
+        n = MIN(len, blocks * block_size - off % block_size);
+        memcpy(buf, bounce + off % block_size, n);
+        buf = (u8 *)buf + n;
+        off += n;
+        len -= n;
+    }
+    free(bounce);
+    return 0;
+}
+
+int logfs_checkpoint(struct logfs *logfs, u64 index_off, u64 index_len) {
+    Metadata meta = logfs->meta;
+
+    assert(logfs->persistent);
+    assert(index_len && index_off + index_len <= logfs->head);
+
+    // the checkpoint and the log it covers first, then the record of it
+    if (wb_sync(logfs->wb, logfs->head)) {
+        TRACE(0);
+        return -1;
+    }
+    meta.resume = logfs->head;
+    meta.head = logfs->head;
+    meta.tail = logfs->tail;
+    meta.index = new_region(index_off, index_len);
+    if (meta_save(&meta, logfs->wb->device)) {
+        TRACE(0);
+        return -1;
+    }
+    logfs->meta = meta;
+    return 0;
+}
+
+int logfs_resume(struct logfs *logfs, u64 off) {
+    WriteBuffer *wb = logfs->wb;
+    Metadata meta = logfs->meta;
+    int err;
+
+    assert(logfs->head <= off);
+
+    // a new epoch for the records from off on, so the old ones there don't count
+    meta.epoch++;
+    meta.resume = off;
+    if (meta_save(&meta, wb->device)) {
+        TRACE(0);
+        return -1;
+    }
+    logfs->meta = meta;
+
+    pthread_mutex_lock(&wb->access_mutex);
+    assert(wb->appended == logfs->head && !wb->flushing);
+    err = wb_position(wb, off);
+    pthread_mutex_unlock(&wb->access_mutex);
+    if (err) {
+        TRACE(0);
+        return -1;
+    }
+    logfs->head = off;
+    return 0;
+}
+
+uint32_t logfs_epoch(struct logfs *logfs, u64 *resume) {
+    *resume = logfs->meta.resume;
+    return logfs->meta.epoch;
 }
 
 u64 logfs_getsize(struct logfs *logfs) {
-    return (logfs->meta.current_block - RESERVED_BLOCKS) * logfs->wb->block_size + logfs->meta.current_offset;
+    return logfs->meta.head;
 }
 
-void logfs_setmeta(struct logfs *logfs, u64 index_offset, u64 index_len) {
-    printf("Setting meta range to %d, %d\n", index_offset, index_len);
-    logfs->meta.index.address = index_offset;
-    logfs->meta.index.size = index_len;
+u64 logfs_gettail(struct logfs *logfs) {
+    return logfs->meta.tail;
 }
 
-u8 *logfs_readindex(struct logfs *logfs, /*out*/ u64 *len) {
-    u8 *buf = malloc(logfs->meta.index.size);
-    printf("Reading index %ld..%d from logfs into buf (size %ld)\n", logfs->meta.index.address, logfs->meta.index.address + logfs->meta.index.size, logfs->meta.index.size);
-    logfs_read(logfs, buf, logfs->meta.index.address, logfs->meta.index.size);
+u64 logfs_getindex(struct logfs *logfs, /*out*/ u64 *len) {
     *len = logfs->meta.index.size;
-    return buf;
-}
\ No newline at end of file
+    return logfs->meta.index.address;
+}
@@ -10,20 +10,60 @@
 #ifndef _LOGFS_H_
 #define _LOGFS_H_
 
+#include <sys/uio.h>
+
+#include "device.h"
 #include "system.h"
 
 struct logfs;
 
+enum logfs_sync {
+    LOGFS_SYNC_NONE = 0, /* blocks reach the device as they fill, and at close */
+    LOGFS_SYNC_PERIODIC, /* the flusher syncs every sync_interval microseconds */
+    LOGFS_SYNC_BATCH,    /* the caller syncs at its commit points with logfs_sync() */
+    LOGFS_SYNC_OP        /* logfs_append() returns once the data is durable */
+};
+
+struct logfs_options {
+    u64 cache_budget;  /* bytes of memory for the read cache, 0 for the default */
+    int sync;          /* enum logfs_sync */
+    u64 sync_interval; /* LOGFS_SYNC_PERIODIC, 0 for the default */
+    u64 queue_depth;   /* device I/Os in flight, 0 for the default */
+    int admit_all;     /* cache every page read, not only those read more often than the one evicted */
+};
+
+// buckets of flush_blocks, like those of the device_stats histograms
+#define LOGFS_HIST DEVICE_HIST
+
+struct logfs_stats {
+    u64 cache_pages;
+    u64 cache_hits;
+    u64 cache_misses;
+    u64 cache_evictions;
+    u64 cache_rejections;   /* misses not cached, the page evicted for them is read more often */
+    u64 cache_bypasses;     /* misses of logfs_read_nocache() */
+    u64 reads_cache;        /* logfs_read() served by the read cache only */
+    u64 reads_write_buffer; /* ... by the write buffer only */
+    u64 reads_both;         /* ... split between the two */
+    u64 appended_bytes;
+    u64 append_stalls;      /* appends that waited for the flusher to make space */
+    u64 stall_us;
+    u64 flushes;            /* batches of blocks written by the flusher */
+    u64 flush_blocks[LOGFS_HIST]; /* flushes by blocks per batch, log2 buckets */
+    struct device_stats device;
+};
+
 /**
  * Opens the block device specified in pathname for buffered I/O using an
  * append only log structure.
  *
  * pathname: the pathname of the block device
+ * options : tuning knobs, may be NULL for the defaults
  *
  * return: an opaque handle or NULL on error
  */
 
-struct logfs *logfs_open(const char *pathname, bool enable_persistence);
+struct logfs *logfs_open(const char *pathname, bool enable_persistence, const struct logfs_options *options);
 
 /**
  * Closes a previously opened logfs handle.
@@ -48,6 +88,64 @@ void logfs_close(struct logfs *logfs);
 
 int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len);
 
+/**
+ * Like logfs_read(), for a read such as a scan of the log that is not to be
+ * repeated any time soon: what it misses in the read cache is read past it,
+ * and is neither cached nor counted towards being cached later.
+ */
+
+int logfs_read_nocache(struct logfs *logfs, void *buf, uint64_t off, size_t len);
+
+/**
+ * A read-only view of len bytes of the log, as iovcnt fragments in order. The
+ * fragments point into pinned read cache pages, or into a private copy when
+ * the data can't be pinned.
+ */
+
+#define LOGFS_REF_PAGES 16
+
+struct logfs_ref {
+    struct iovec iov[LOGFS_REF_PAGES];
+    int iovcnt;
+    /* private */
+    int npinned_;
+    u64 pages_[LOGFS_REF_PAGES];
+    int slots_[LOGFS_REF_PAGES];
+    void *copy_;
+};
+
+/**
+ * Like logfs_read() but without copying: ref views the data in place until
+ * it is released with logfs_release().
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ * off  : the starting byte offset
+ * len  : the number of bytes to view
+ * ref  : receives the view
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int logfs_read_ref(struct logfs *logfs, uint64_t off, size_t len, struct logfs_ref *ref);
+
+void logfs_release(struct logfs *logfs, struct logfs_ref *ref);
+
+struct logfs_read {
+    void *buf;
+    uint64_t off;
+    size_t len;
+};
+
+/**
+ * Like logfs_read() for each of n reads. The pages the reads need from the
+ * device are read in page order, neighbouring pages as one request, and
+ * sent to the device together rather than one read after the other.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int logfs_read_batch(struct logfs *logfs, const struct logfs_read *reads, uint64_t n);
+
 /**
  * Append len bytes to the logfs.
  *
@@ -60,10 +158,127 @@ int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len);
 
 int logfs_append(struct logfs *logfs, const void *buf, uint64_t len);
 
-void logfs_setmeta(struct logfs *logfs, u64 index_offset, u64 index_len);
+/**
+ * Append the iovcnt segments of iov back to back, as logfs_append() would
+ * their concatenation. Space for all of them is reserved at once and they are
+ * copied in under one lock acquisition, unless together they exceed half the
+ * write buffer, in which case they go in pieces.
+ *
+ * logfs : an opaque handle previously obtained by calling logfs_open()
+ * iov   : the segments to write
+ * iovcnt: the number of segments
+ *
+ * return: 0 on success, otherwise error, and then none of the segments is
+ *         in the log
+ */
+
+int logfs_appendv(struct logfs *logfs, const struct iovec *iov, int iovcnt);
+
+/**
+ * Waits until the log before off is on stable storage. Concurrent callers are
+ * served by a single fdatasync() of the device.
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ * off  : the end of the range that must be durable, at most the end of the log
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int logfs_sync(struct logfs *logfs, uint64_t off);
+
+/**
+ * Releases the log space before off. Data before off must no longer be read,
+ * as the device blocks holding it are reused once the log wraps around.
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ * off  : the new start of the live log, must not be past the end of the log
+ */
+
+void logfs_trim(struct logfs *logfs, uint64_t off);
+
+/**
+ * Returns the number of bytes the log can hold between its tail and its head.
+ * logfs_append() fails once this is exceeded.
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ */
+
+u64 logfs_capacity(struct logfs *logfs);
+
+/**
+ * The end of the part of the log that has left the write buffer for the
+ * device, not necessarily stable storage. Reads before it go to the cache.
+ */
+
+u64 logfs_flushed(struct logfs *logfs);
+
+/**
+ * Takes a snapshot of the logfs counters.
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ * stats: receives the counters
+ */
+
+void logfs_stats(struct logfs *logfs, struct logfs_stats *stats);
+
+/**
+ * Like logfs_read() but straight from the device, around the write buffer and
+ * the read cache, in large sequential reads. The data must be on the device,
+ * as it is at open or after logfs_sync(). Unlike logfs_read() it may go past
+ * the end of the log, to whatever the device holds there.
+ */
+
+int logfs_read_direct(struct logfs *logfs, void *buf, uint64_t off, size_t len);
+
+/**
+ * Persistence. With enable_persistence, logfs_open() picks up the log as of
+ * its last checkpoint, otherwise it starts an empty log and drops whatever
+ * checkpoint the device held.
+ *
+ * A checkpoint is the client's state, appended to the log like any other
+ * data. The client finds the log that followed it by scanning from
+ * logfs_getsize() until the first record that does not check out, and then
+ * continues the log there with logfs_resume(). Appends must not run
+ * concurrently with logfs_checkpoint().
+ */
+
+/**
+ * Makes the index_len bytes at index_off the checkpoint, covering the log up
+ * to its current end, once all of it is on stable storage. Log space before
+ * the current tail is only reused from here on.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int logfs_checkpoint(struct logfs *logfs, u64 index_off, u64 index_len);
+
+/**
+ * Moves the end of the log to off, at or past the end the checkpoint covers,
+ * before anything is appended. Records appended from here on are of a new
+ * epoch, see logfs_epoch().
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int logfs_resume(struct logfs *logfs, u64 off);
+
+/**
+ * The epoch records appended now belong to. Those from *resume on are of this
+ * one, those before it of earlier ones.
+ */
+
+uint32_t logfs_epoch(struct logfs *logfs, /*out*/ u64 *resume);
+
+/* the end of the log the checkpoint covers, 0 without one */
 
 u64 logfs_getsize(struct logfs *logfs);
 
-u8 *logfs_readindex(struct logfs *logfs, /*out*/ u64* len);
+/* the start of the live log as the checkpoint recorded it */
+
+u64 logfs_gettail(struct logfs *logfs);
+
+/* the offset of the checkpoint, *len is 0 without one */
+
+u64 logfs_getindex(struct logfs *logfs, /*out*/ u64 *len);
 
 #endif /* _LOGFS_H_ */
@@ -0,0 +1,222 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * lz.c
+ */
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+/* the tail of the input is always literals */
+#define LAST_LITERALS 5
+#define HASH_BITS 12
+/* after this many misses in a row the search steps faster */
+#define SKIP_TRIGGER 6
+
+/**
+ * The LZ4 block format. The output is a run of sequences:
+ *
+ *   token   : literal length in the high nibble, match length - 4 in the low
+ *   [255..] : more literal length while the nibble or last byte is full
+ *   literals
+ *   offset  : 2 bytes, little endian, back from the current output position
+ *   [255..] : more match length, likewise
+ *
+ * and the last sequence stops after its literals. Matches are found through
+ * a table of the last position of every hashed 4 bytes.
+ */
+
+static inline uint32_t
+load32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+slot(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* writes a length continued in 255 steps, NULL if it does not fit */
+
+static uint8_t *
+put_length(uint8_t *op, const uint8_t *end, uint64_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *
+put_sequence(uint8_t *op,
+             const uint8_t *end,
+             const uint8_t *lit,
+             uint64_t lit_len,
+             uint64_t offset,
+             uint64_t match_len) {
+    uint8_t *token;
+
+    if (op >= end) {
+        return NULL;
+    }
+    token = op++;
+    *token = (uint8_t)(MIN(lit_len, 15) << 4);
+    if ((15 <= lit_len) && !(op = put_length(op, end, lit_len - 15))) {
+        return NULL;
+    }
+    if ((uint64_t)(end - op) < lit_len) {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) {
+        return op;
+    }
+    if ((end - op) < 2) {
+        return NULL;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_len -= MIN_MATCH;
+    *token |= (uint8_t)MIN(match_len, 15);
+    if ((15 <= match_len) && !(op = put_length(op, end, match_len - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+uint64_t
+lz_bound(uint64_t n) {
+    return n + (n / 255) + 16;
+}
+
+uint64_t
+lz_compress(const void *src, uint64_t n, void *dst, uint64_t cap) {
+    const uint8_t *ip, *anchor, *ref, *limit, *in;
+    uint32_t table[1 << HASH_BITS];
+    uint64_t len, misses;
+    uint8_t *op, *end;
+    uint32_t h;
+
+    assert(!n || src);
+    assert(dst);
+
+    in = (const uint8_t *)src;
+    op = (uint8_t *)dst;
+    end = op + cap;
+    ip = anchor = in;
+    memset(table, 0, sizeof(table));
+    if (n > (LAST_LITERALS + MIN_MATCH)) {
+        limit = in + n - LAST_LITERALS;
+        misses = 0;
+        while ((ip + MIN_MATCH) <= limit) {
+            h = slot(load32(ip));
+            ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if ((ref >= ip) ||
+                ((uint64_t)(ip - ref) > MAX_OFFSET) ||
+                (load32(ref) != load32(ip))) {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+            for (len = MIN_MATCH; ((ip + len) < limit) && (ip[len] == ref[len]); ++len) {
+            }
+            if (!(op = put_sequence(op, end, anchor, (uint64_t)(ip - anchor), (uint64_t)(ip - ref), len))) {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+        }
+    }
+    if (!(op = put_sequence(op, end, anchor, (uint64_t)(in + n - anchor), 0, 0))) {
+        return 0;
+    }
+    return (uint64_t)(op - (uint8_t *)dst);
+}
+
+/* reads a length continued in 255 steps, -1 past the end of the input */
+
+static int
+get_length(const uint8_t **ip, const uint8_t *end, uint64_t *len) {
+    uint8_t b;
+
+    do {
+        if ((*ip) >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        (*len) += b;
+    } while (255 == b);
+    return 0;
+}
+
+int
+lz_decompress(const void *src, uint64_t n, void *dst, uint64_t len) {
+    const uint8_t *ip, *end, *ref;
+    uint64_t lit_len, match_len, offset, i;
+    uint8_t *op, *out, token;
+
+    assert(!n || src);
+    assert(!len || dst);
+
+    ip = (const uint8_t *)src;
+    end = ip + n;
+    out = op = (uint8_t *)dst;
+    while (ip < end) {
+        token = *ip++;
+        lit_len = token >> 4;
+        if ((15 == lit_len) && get_length(&ip, end, &lit_len)) {
+            return -1;
+        }
+        if (((uint64_t)(end - ip) < lit_len) || ((uint64_t)(out + len - op) < lit_len)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == end) {
+            break;
+        }
+        if ((end - ip) < 2) {
+            return -1;
+        }
+        offset = (uint64_t)ip[0] | ((uint64_t)ip[1] << 8);
+        ip += 2;
+        match_len = token & 15;
+        if ((15 == match_len) && get_length(&ip, end, &match_len)) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (!offset ||
+            (offset > (uint64_t)(op - out)) ||
+            (match_len > (uint64_t)(out + len - op))) {
+            return -1;
+        }
+        ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+        }
+        else {
+            /* overlapping: a run of the last offset bytes */
+            for (i = 0; i < match_len; ++i) {
+                op[i] = ref[i];
+            }
+        }
+        op += match_len;
+    }
+    return ((uint64_t)(op - out) == len) ? 0 : -1;
+}
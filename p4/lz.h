@@ -0,0 +1,27 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * lz.h
+ */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include "system.h"
+
+/* the compressed size n bytes can take in the worst case */
+
+uint64_t lz_bound(uint64_t n);
+
+/* returns the compressed size, or 0 if it would be more than cap bytes */
+
+uint64_t lz_compress(const void *src, uint64_t n, void *dst, uint64_t cap);
+
+/* -1 unless src decompresses to exactly len bytes */
+
+int lz_decompress(const void *src, uint64_t n, void *dst, uint64_t len);
+
+#endif /* _LZ_H_ */
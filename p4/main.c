@@ -7,7 +7,21 @@
  * main.c
  */
 
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "device.h"
+#include "hash.h"
+#include "index.h"
 #include "kvdb.h"
+#include "kvraw.h"
+#include "logfs.h"
+#include "lz.h"
 #include "term.h"
 #include "utils.h"
 
@@ -228,14 +242,14 @@ basic_logic(void) {
 
     val_len = sizeof(val);
     int insert_code = kvdb_insert(kvdb, KEY, SLEN(KEY), VAL1, SLEN(VAL1));
-    if (!insert_code) {
+    if (insert_code) {
         TRACE("insert failed");
         kvdb_close(kvdb);
         return -1;
     }
     int lookup_code = kvdb_lookup(kvdb, KEY, SLEN(KEY), val, &val_len);
 
-    if (!lookup_code) {
+    if (lookup_code) {
         TRACE("lookup failed");
         kvdb_close(kvdb);
         return -1;
@@ -320,16 +334,3024 @@ basic_logic(void) {
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (2 != argc) {
-        printf("usage: %s block-device\n", argv[0]);
+/* the value viewed by ref is len bytes of c */
+
+static int
+check_ref(const struct kvdb_ref *ref, uint64_t len, char c) {
+    uint64_t i, j, n;
+
+    if (ref->val_len != len) {
         return -1;
     }
+    n = 0;
+    for (i = 0; i < (uint64_t)ref->view.iovcnt; ++i) {
+        for (j = 0; j < ref->view.iov[i].iov_len; ++j) {
+            if (c != ((const char *)ref->view.iov[i].iov_base)[j]) {
+                return -1;
+            }
+        }
+        n += ref->view.iov[i].iov_len;
+    }
+    return (n == len) ? 0 : -1;
+}
 
-    /* initialize */
+static int
+lookup_ref(void) {
+    const uint64_t LENS[] = {10, 3000, 9000, 70000};
+    struct kvdb_ref refs[ARRAY_SIZE(LENS)], ref;
+    char key[32], *val;
+    struct kvdb *kvdb;
+    uint64_t i, pass;
 
-    PATHNAME = argv[1];
-    term_init(0);
+    if (!(val = malloc(70000))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    if (!(kvdb = kvdb_open(PATHNAME))) {
+        FREE(val);
+        TRACE(0);
+        return -1;
+    }
+
+    /* first still in the write buffer, then pushed out to the cache */
+
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < ARRAY_SIZE(LENS); ++i) {
+            safe_sprintf(key, sizeof(key), "ref%lu", (unsigned long)i);
+            memset(val, 'a' + (int)(pass + i), LENS[i]);
+            if (kvdb_update(kvdb, key, SLEN(key), val, LENS[i])) {
+                EXIT("update");
+            }
+        }
+        memset(val, 'f', 1000);
+        for (i = 0; pass && (i < 300); ++i) {
+            safe_sprintf(key, sizeof(key), "filler%lu", (unsigned long)i);
+            if (kvdb_update(kvdb, key, SLEN(key), val, 1000)) {
+                EXIT("update");
+            }
+        }
+        for (i = 0; i < ARRAY_SIZE(LENS); ++i) {
+            safe_sprintf(key, sizeof(key), "ref%lu", (unsigned long)i);
+            if (kvdb_lookup_ref(kvdb, key, SLEN(key), &refs[i]) ||
+                check_ref(&refs[i], LENS[i], (char)('a' + pass + i))) {
+                kvdb_close(kvdb);
+                FREE(val);
+                TRACE("lookup_ref");
+                return -1;
+            }
+        }
+
+        /* a view outlives updates to its key */
+
+        memset(val, 'z', LENS[1]);
+        if (kvdb_update(kvdb, "ref1", SLEN("ref1"), val, LENS[1]) ||
+            check_ref(&refs[1], LENS[1], (char)('a' + pass + 1))) {
+            kvdb_close(kvdb);
+            FREE(val);
+            TRACE("lookup_ref");
+            return -1;
+        }
+        for (i = 0; i < ARRAY_SIZE(LENS); ++i) {
+            kvdb_release(kvdb, &refs[i]);
+        }
+    }
+    if (+1 != kvdb_lookup_ref(kvdb, "missing", SLEN("missing"), &ref)) {
+        kvdb_close(kvdb);
+        FREE(val);
+        TRACE("lookup_ref");
+        return -1;
+    }
+    kvdb_close(kvdb);
+    FREE(val);
+    return 0;
+}
+
+static int
+compaction(void) {
+    const uint64_t N = 1000;
+    uint64_t i, j, val_len;
+    char key[32], val[32], val_[32];
+    struct kvdb *kvdb;
+
+    if (!(kvdb = kvdb_open(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* insert, then overwrite every key a few times */
+
+    for (j = 0; j < 4; ++j) {
+        for (i = 0; i < N; ++i) {
+            safe_sprintf(key, sizeof(key), "k%lu", (unsigned long)i);
+            safe_sprintf(val, sizeof(val), "v%lu.%lu", (unsigned long)i, (unsigned long)j);
+            if (kvdb_update(kvdb, key, SLEN(key), val, SLEN(val))) {
+                kvdb_close(kvdb);
+                TRACE("update");
+                return -1;
+            }
+        }
+    }
+    if ((N != kvdb_size(kvdb)) || ((3 * N) != kvdb_waste(kvdb))) {
+        kvdb_close(kvdb);
+        TRACE("software");
+        return -1;
+    }
+
+    /* compact, remove the odd keys, compact again */
+
+    if (kvdb_compact(kvdb) ||
+        (N != kvdb_size(kvdb)) ||
+        (0 != kvdb_waste(kvdb))) {
+        kvdb_close(kvdb);
+        TRACE("compact");
+        return -1;
+    }
+    for (i = 1; i < N; i += 2) {
+        safe_sprintf(key, sizeof(key), "k%lu", (unsigned long)i);
+        if (kvdb_remove(kvdb, key, SLEN(key), 0, 0)) {
+            kvdb_close(kvdb);
+            TRACE("remove");
+            return -1;
+        }
+    }
+    if (kvdb_compact(kvdb) ||
+        ((N / 2) != kvdb_size(kvdb)) ||
+        (0 != kvdb_waste(kvdb))) {
+        kvdb_close(kvdb);
+        TRACE("compact");
+        return -1;
+    }
+
+    /* survivors hold their latest value, removed keys stay removed */
+
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "k%lu", (unsigned long)i);
+        safe_sprintf(val, sizeof(val), "v%lu.%lu", (unsigned long)i, 3ul);
+        val_len = sizeof(val_);
+        if (i % 2) {
+            if (+1 != kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len)) {
+                kvdb_close(kvdb);
+                TRACE("removed key found");
+                return -1;
+            }
+        } else if (kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len) ||
+                   (SLEN(val) != val_len) ||
+                   memcmp(val, val_, val_len)) {
+            kvdb_close(kvdb);
+            TRACE("lookup");
+            return -1;
+        }
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+static int
+compaction_wrap(void) {
+    const uint64_t N = 256, V = 4000;
+    struct kvdb_stats stats;
+    uint64_t i, j, val_len, total;
+    char key[32], *val, *val_;
+    struct kvdb *kvdb;
+
+    if (!(kvdb = kvdb_open(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+    if (!(val = malloc(V)) || !(val_ = malloc(V))) {
+        kvdb_close(kvdb);
+        FREE(val);
+        TRACE("out of memory");
+        return -1;
+    }
+
+    /* write twice what the log holds through a small live set */
+
+    kvdb_stats(kvdb, &stats);
+    total = 2 * stats.log_capacity;
+    for (j = 0; j < (total / (N * V)); ++j) {
+        for (i = 0; i < N; ++i) {
+            safe_sprintf(key, sizeof(key), "k%lu", (unsigned long)i);
+            memset(val, (int)(i + j), V);
+            if (kvdb_update(kvdb, key, SLEN(key), val, V)) {
+                kvdb_close(kvdb);
+                FREE(val);
+                FREE(val_);
+                TRACE("update");
+                return -1;
+            }
+        }
+    }
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "k%lu", (unsigned long)i);
+        memset(val, (int)(i + j - 1), V);
+        val_len = V;
+        if (kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len) ||
+            (V != val_len) ||
+            memcmp(val, val_, V) ||
+            (N != kvdb_size(kvdb))) {
+            kvdb_close(kvdb);
+            FREE(val);
+            FREE(val_);
+            TRACE("lookup");
+            return -1;
+        }
+    }
+    FREE(val);
+    FREE(val_);
+    kvdb_stats(kvdb, &stats);
+    kvdb_close(kvdb);
+    if (stats.logfs.appended_bytes <= stats.log_capacity) {
+        TRACE("the log did not wrap");
+        return -1;
+    }
+    return 0;
+}
+
+/* a saved index in memory, counting what is read of it */
+
+struct image {
+    const u8 *buf;
+    u64 fetched;
+};
+
+static int
+fetch_image(void *arg, void *buf, u64 pos, u64 len) {
+    struct image *image = (struct image *)arg;
+
+    memcpy(buf, image->buf + pos, len);
+    image->fetched += len;
+    return 0;
+}
+
+static int
+index_resize(void) {
+    const uint64_t N = 100000;
+    struct image image;
+    struct index *index;
+    uint64_t i, k, *off;
+    u64 len;
+    u8 *buf;
+
+    if (!(index = index_open())) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* every insert steps a migration, keys on both sides must stay visible */
+
+    for (i = 0; i < N; ++i) {
+        k = i + 1;
+        if (!(off = index_update(index, &k, sizeof(k)))) {
+            index_close(index);
+            TRACE(0);
+            return -1;
+        }
+        (*off) = k;
+        k = (i / 2) + 1;
+        if (!(off = index_update(index, &k, sizeof(k)))) {
+            index_close(index);
+            TRACE(0);
+            return -1;
+        }
+        (*off) = 2 * k;
+        if (index_find(index, (const char *)&k, sizeof(k)) != (2 * k)) {
+            index_close(index);
+            TRACE("software");
+            return -1;
+        }
+    }
+    if (!(buf = index_serialize(index, &len))) {
+        index_close(index);
+        TRACE(0);
+        return -1;
+    }
+    index_close(index);
+
+    /* an attached table answers from the start, paging in what it probes */
+
+    memset(&image, 0, sizeof(image));
+    image.buf = buf;
+    if (!(index = index_attach(len, fetch_image, &image))) {
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    k = 1;
+    if ((index_find(index, (const char *)&k, sizeof(k)) != 2) ||
+        ((len / 100) < image.fetched) ||
+        (0 != index_warm(index, 1))) {
+        EXIT("lazy lookup");
+    }
+    for (i = 0; i < N; ++i) {
+        k = i + 1;
+        if (index_find(index, (const char *)&k, sizeof(k)) != ((k <= (N + 1) / 2) ? (2 * k) : k)) {
+            index_close(index);
+            FREE(buf);
+            TRACE("software");
+            return -1;
+        }
+    }
+    k = N + 1;
+    if (!(off = index_update(index, &k, sizeof(k))) ||
+        ((*off) = k, +1 != index_warm(index, UINT64_MAX)) ||
+        (index_find(index, (const char *)&k, sizeof(k)) != k) ||
+        ((N + 1) != index_size(index))) {
+        EXIT("index_warm");
+    }
+    index_close(index);
+
+    /* a damaged chunk fails the lookups that reach it, not the others */
+
+    buf[len - 1] ^= 0x01;
+    if (!(index = index_attach(len, fetch_image, &image))) {
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    for (i = 0; (i < N) && !index_failed(index); ++i) {
+        k = i + 1;
+        index_find(index, (const char *)&k, sizeof(k));
+    }
+    if (!index_failed(index) || (0 <= index_warm(index, UINT64_MAX))) {
+        EXIT("damaged index");
+    }
+    index_close(index);
+    FREE(buf);
+    return 0;
+}
+
+static int
+hash_quality(void) {
+    const uint64_t N = 65536, B = 256, T = 200, F = 32;
+    const uint64_t LENS[] = {8, 100, 1024};
+    uint64_t i, j, l, h, d, bit, buckets[256], flips[64];
+    u8 buf[2048];
+    double chi;
+
+    for (i = 0; i < sizeof(buf); ++i) {
+        buf[i] = (u8)rand();
+    }
+
+    /* both paths agree at every length, off an unaligned start too */
+
+    for (l = 0; l <= 1100; ++l) {
+        if ((hash(buf, l) != hash_portable(buf, l)) ||
+            (hash(buf + 1, l) != hash_portable(buf + 1, l))) {
+            TRACE("software");
+            return -1;
+        }
+    }
+
+    /**
+     * Sequential integers spread evenly over the low bits of the hash the
+     * index uses and over the top bits. With 255 degrees of freedom the
+     * chi-square statistic is 255 give or take 23, 400 is far in the tail.
+     */
+
+    for (j = 16; j <= 56; j += 40) {
+        memset(buckets, 0, sizeof(buckets));
+        for (i = 0; i < N; ++i) {
+            ++buckets[(hash(&i, sizeof(i)) >> j) % B];
+        }
+        chi = 0.0;
+        for (i = 0; i < B; ++i) {
+            chi += ((double)buckets[i] - (double)(N / B)) * ((double)buckets[i] - (double)(N / B)) / (double)(N / B);
+        }
+        if (400.0 < chi) {
+            TRACE("software");
+            return -1;
+        }
+    }
+
+    /* a flipped input bit flips every output bit about half the time */
+
+    for (l = 0; l < (sizeof(LENS) / sizeof(LENS[0])); ++l) {
+        memset(flips, 0, sizeof(flips));
+        for (i = 0; i < T; ++i) {
+            for (j = 0; j < LENS[l]; ++j) {
+                buf[j] = (u8)rand();
+            }
+            h = hash(buf, LENS[l]);
+            for (j = 0; j < F; ++j) {
+                bit = (uint64_t)rand() % (8 * LENS[l]);
+                buf[bit / 8] ^= (u8)(1 << (bit % 8));
+                d = h ^ hash(buf, LENS[l]);
+                buf[bit / 8] ^= (u8)(1 << (bit % 8));
+                for (bit = 0; bit < 64; ++bit) {
+                    flips[bit] += (d >> bit) & 1;
+                }
+            }
+        }
+        for (bit = 0; bit < 64; ++bit) {
+            if ((flips[bit] < (T * F * 45 / 100)) || ((T * F * 55 / 100) < flips[bit])) {
+                TRACE("software");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+ordered_scan(void) {
+    const uint64_t N = 1000;
+    struct kvdb_options options;
+    char key[32], val[32], last[32];
+    struct kvdb_iter *iter;
+    uint64_t i, n, key_len, val_len;
+    const char *key_;
+    struct kvdb *kvdb;
+
+    memset(&options, 0, sizeof(options));
+    options.ordered = 1;
+    if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* scattered inserts, every third key removed again, other keys around */
+
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "key%05lu", (unsigned long)(i * 7919 % N));
+        if (kvdb_insert(kvdb, key, SLEN(key), key, SLEN(key))) {
+            EXIT("insert");
+        }
+    }
+    for (i = 0; i < N; i += 3) {
+        safe_sprintf(key, sizeof(key), "key%05lu", (unsigned long)i);
+        if (kvdb_remove(kvdb, key, SLEN(key), NULL, NULL)) {
+            EXIT("remove");
+        }
+    }
+    for (i = 0; i < 10; ++i) {
+        safe_sprintf(key, sizeof(key), "%s%lu", i % 2 ? "a" : "z", (unsigned long)i);
+        if (kvdb_insert(kvdb, key, SLEN(key), key, SLEN(key))) {
+            EXIT("insert");
+        }
+    }
+
+    /* the whole prefix, in order, with the values */
+
+    if (!(iter = kvdb_iter_open(kvdb, "key", 3))) {
+        EXIT("kvdb_iter_open");
+    }
+    if (kvdb_iter_seek(iter, NULL, 0)) {
+        EXIT("ordered scan");
+    }
+    n = 0;
+    last[0] = '\0';
+    do {
+        key_ = kvdb_iter_key(iter, &key_len);
+        val_len = sizeof(val);
+        if (!key_ || (0 <= strcmp(last, key_)) ||
+            kvdb_iter_value(iter, val, &val_len) ||
+            (val_len != key_len) || memcmp(key_, val, val_len) ||
+            !(atoi(key_ + 3) % 3)) {
+            EXIT("ordered scan");
+        }
+        memcpy(last, key_, key_len);
+        ++n;
+    } while (!kvdb_iter_next(iter));
+    if ((n != (N - (N + 2) / 3)) || kvdb_iter_key(iter, &key_len)) {
+        EXIT("ordered scan");
+    }
+
+    /* seek inside a narrower prefix, then remove the next key on the way */
+
+    kvdb_iter_close(iter);
+    if (!(iter = kvdb_iter_open(kvdb, "key005", 6))) {
+        EXIT("kvdb_iter_open");
+    }
+    if (kvdb_iter_seek(iter, "key0055", 7) ||
+        strcmp(kvdb_iter_key(iter, &key_len), "key00550") ||
+        kvdb_remove(kvdb, "key00551", SLEN("key00551"), NULL, NULL) ||
+        kvdb_iter_next(iter) ||
+        strcmp(kvdb_iter_key(iter, &key_len), "key00553")) {
+        EXIT("ordered seek");
+    }
+    n = 1;
+    while (!kvdb_iter_next(iter)) {
+        ++n;
+    }
+    if ((n != 32) || !kvdb_iter_seek(iter, "key006", 6)) {
+        EXIT("ordered prefix");
+    }
+    kvdb_iter_close(iter);
+    kvdb_close(kvdb);
+    return 0;
+}
+
+static int
+bloom_filter(void) {
+    const uint64_t N = 20000;
+    struct kvdb_options options;
+    struct kvdb_stats stats;
+    struct kvdb *kvdb;
+    uint64_t i, bits;
+    char key[32];
+
+    memset(&options, 0, sizeof(options));
+    options.bloom_bits = 10;
+    if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        TRACE(0);
+        return -1;
+    }
+    kvdb_stats(kvdb, &stats);
+    bits = stats.bloom_bits;
+
+    /* the filter grows with the keys and never hides one */
+
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "bloom%lu", (unsigned long)i);
+        if (kvdb_insert(kvdb, key, SLEN(key), key, SLEN(key))) {
+            EXIT("insert");
+        }
+    }
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "bloom%lu", (unsigned long)i);
+        if (kvdb_lookup(kvdb, key, SLEN(key), NULL, NULL)) {
+            EXIT("lookup");
+        }
+        safe_sprintf(key, sizeof(key), "missing%lu", (unsigned long)i);
+        if (+1 != kvdb_lookup(kvdb, key, SLEN(key), NULL, NULL)) {
+            EXIT("lookup");
+        }
+    }
+
+    /* 10 bits per key is about 1% false positives, blocking adds a little */
+
+    kvdb_stats(kvdb, &stats);
+    if ((stats.absent != N) ||
+        (stats.bloom_bits <= bits) ||
+        ((stats.bloom_false_positives + stats.bloom_negatives) != N) ||
+        (0.03 < stats.bloom_fp_rate)) {
+        EXIT("bloom stats");
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+/* JSON-ish text, which compresses a few times over like real values */
+
+static void
+mk_json(char *buf, uint64_t len, uint64_t seed) {
+    uint64_t n, i;
+    char rec[128];
+
+    for (n = 0, i = seed; n < len; n += safe_strlen(rec), ++i) {
+        safe_sprintf(rec,
+                     sizeof(rec),
+                     "{\"id\":%lu,\"name\":\"user%lu\",\"tags\":[\"a\",\"b\"],\"score\":%lu},",
+                     (unsigned long)i,
+                     (unsigned long)(i * 7),
+                     (unsigned long)(i % 100));
+        memcpy(buf + n, rec, MIN(safe_strlen(rec), len - n));
+    }
+}
+
+static int
+compression(void) {
+    const uint64_t LENS[] = {10, 63, 64, 100, 1000, 5000, 70000};
+    struct kvdb_options options;
+    struct kvdb_stats stats;
+    uint64_t i, j, z, val_len, raw;
+    char key[32], *val, *val_, *buf;
+    struct kvdb_ref ref;
+    struct kvdb *kvdb;
+
+    if (!(val = malloc(70000)) || !(val_ = malloc(70000)) || !(buf = malloc(lz_bound(70000)))) {
+        EXIT("out of memory");
+    }
+
+    /* the codec on its own: text, runs and noise of every small length */
+
+    for (i = 0; i < 600; ++i) {
+        for (j = 0; j < 3; ++j) {
+            if (0 == j) {
+                mk_json(val, i, i);
+            } else if (1 == j) {
+                memset(val, 'r', i);
+            } else {
+                for (z = 0; z < i; ++z) {
+                    val[z] = (char)rand();
+                }
+            }
+            if (!(z = lz_compress(val, i, buf, lz_bound(i))) ||
+                lz_decompress(buf, z, val_, i) ||
+                memcmp(val, val_, i) ||
+                (i && !lz_decompress(buf, z, val_, i - 1))) {
+                EXIT("lz");
+            }
+        }
+    }
+
+    /* through kvdb: below and above the threshold, then incompressible */
+
+    memset(&options, 0, sizeof(options));
+    options.compress_min = 64;
+    if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        EXIT("kvdb_open_options");
+    }
+    raw = 0;
+    for (j = 0; j < 2; ++j) {
+        for (i = 0; i < ARRAY_SIZE(LENS); ++i) {
+            safe_sprintf(key, sizeof(key), "lz%lu", (unsigned long)i);
+            mk_json(val, LENS[i], i + j);
+            if (kvdb_update(kvdb, key, SLEN(key), val, LENS[i])) {
+                EXIT("update");
+            }
+            raw += LENS[i];
+        }
+    }
+    for (i = 0; i < 1000; ++i) {
+        val[i] = (char)rand();
+    }
+    if (kvdb_update(kvdb, "noise", SLEN("noise"), val, 1000)) {
+        EXIT("update");
+    }
+
+    /* whole, truncated and by reference, before and after compaction */
+
+    for (j = 0; j < 2; ++j) {
+        for (i = 0; i < ARRAY_SIZE(LENS); ++i) {
+            safe_sprintf(key, sizeof(key), "lz%lu", (unsigned long)i);
+            mk_json(val, LENS[i], i + 1);
+            val_len = 70000;
+            if (kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len) ||
+                (val_len != LENS[i]) || memcmp(val, val_, val_len)) {
+                EXIT("lookup");
+            }
+            val_len = 7;
+            if (kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len) ||
+                (val_len != LENS[i]) || memcmp(val, val_, MIN(7, LENS[i]))) {
+                EXIT("truncated lookup");
+            }
+            if (kvdb_lookup_ref(kvdb, key, SLEN(key), &ref) ||
+                (ref.val_len != LENS[i]) ||
+                ((1 != ref.view.iovcnt) && (LENS[i] >= 64)) ||
+                memcmp(val, ref.view.iov[0].iov_base, MIN(ref.view.iov[0].iov_len, LENS[i]))) {
+                EXIT("lookup_ref");
+            }
+            kvdb_release(kvdb, &ref);
+        }
+        if (!j && kvdb_compact(kvdb)) {
+            EXIT("compact");
+        }
+    }
+    kvdb_stats(kvdb, &stats);
+    if (stats.log_bytes >= raw / 2) {
+        EXIT("not compressed");
+    }
+    kvdb_close(kvdb);
+    FREE(val);
+    FREE(val_);
+    FREE(buf);
+    return 0;
+}
+
+static int
+count_record(void *arg, const void *key, uint64_t key_len, uint64_t val_len, uint64_t off, uint64_t prev) {
+    (void)key;
+    (void)key_len;
+    (void)val_len;
+    (void)off;
+    (void)prev;
+    ++(*(uint64_t *)arg);
+    return 0;
+}
+
+static int
+checksums(void) {
+    const uint64_t N = 2000, K = N / 4, LEN = 200;
+    uint64_t i, n, off, block, key_len, val_len, *offs;
+    char key[32], val[LEN];
+    struct device *device;
+    struct kvraw *kvraw;
+    char *page;
+
+    /* the check value of the Castagnoli CRC, and both paths agree */
+
+    if (0xe3069283 != crc32c(0, "123456789", 9)) {
+        EXIT("crc32c");
+    }
+    for (i = 0; i < sizeof(val); ++i) {
+        val[i] = (char)rand();
+        if (crc32c(crc32c(0, val, i / 2), val + i / 2, i - i / 2) != crc32c_portable(0, val, i)) {
+            EXIT("crc32c_portable");
+        }
+    }
+
+    if (!(offs = malloc(N * sizeof(offs[0]))) ||
+        !(kvraw = kvraw_open(PATHNAME, false, NULL))) {
+        EXIT(0);
+    }
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "crc%lu", (unsigned long)i);
+        memset(val, (int)i, sizeof(val));
+        offs[i] = 0;
+        if (kvraw_append(kvraw, key, SLEN(key), val, sizeof(val), &offs[i])) {
+            EXIT("kvraw_append");
+        }
+    }
+    if (kvraw_sync(kvraw, kvraw_size(kvraw))) {
+        EXIT("kvraw_sync");
+    }
+
+    /* flip a bit of a value on the device, past the first (reserved) block */
+
+    if (!(device = device_open(PATHNAME))) {
+        EXIT("device_open");
+    }
+    block = device_block(device);
+    off = block + offs[K] + sizeof(val) / 2;
+    if (!(page = aligned_alloc(block, block)) ||
+        device_read(device, page, off / block * block, block)) {
+        EXIT("device_read");
+    }
+    page[off % block] ^= 0x10;
+    if (device_write(device, page, off / block * block, block)) {
+        EXIT("device_write");
+    }
+    device_close(device);
+    FREE(page);
+
+    /* reading the value fails, the key alone and the neighbours do not */
+
+    key_len = sizeof(key);
+    val_len = sizeof(val);
+    off = offs[K];
+    if (!kvraw_lookup(kvraw, key, &key_len, val, &val_len, &off)) {
+        EXIT("damaged record read");
+    }
+    key_len = sizeof(key);
+    val_len = 0;
+    off = offs[K];
+    if (kvraw_lookup(kvraw, key, &key_len, NULL, &val_len, &off)) {
+        EXIT("key read");
+    }
+    key_len = sizeof(key);
+    val_len = sizeof(val);
+    off = offs[K - 1];
+    if (kvraw_lookup(kvraw, key, &key_len, val, &val_len, &off) ||
+        (sizeof(val) != val_len) || ((char)(K - 1) != val[0])) {
+        EXIT("intact record read");
+    }
+
+    /* recovery runs past intact records and ends the log at the damaged one */
+
+    n = 0;
+    off = offs[K + 1];
+    if (kvraw_recover(kvraw, &off, kvraw_size(kvraw), count_record, &n) ||
+        (off != kvraw_size(kvraw)) || ((N - K - 1) != n)) {
+        EXIT("recover");
+    }
+    n = off = 0;
+    if (kvraw_recover(kvraw, &off, kvraw_size(kvraw), count_record, &n) ||
+        (off != offs[K]) || ((K + 1) != n)) {
+        EXIT("recover");
+    }
+    kvraw_close(kvraw);
+    FREE(offs);
+    return 0;
+}
+
+/**
+ * A child caps the size of the files it writes, so that the device writes of
+ * a large append start failing part way through it. The append fails as a
+ * whole, and the record appended next is where kvraw says it is.
+ */
+
+static int
+append_failure(void) {
+    const uint64_t LEN = 8 << 20;
+    uint64_t off[2], key_len, val_len, n, end, block;
+    struct rlimit limit, cap;
+    struct device *device;
+    struct kvraw *kvraw;
+    char key[32], val[64];
+    int status;
+    char *big;
+    pid_t pid;
+
+    if (!(device = device_open(PATHNAME))) {
+        EXIT("device_open");
+    }
+    block = device_block(device);
+    device_close(device);
+    if (0 > (pid = fork())) {
+        EXIT("fork");
+    }
+    if (!pid) {
+        signal(SIGXFSZ, SIG_IGN);
+        if (!(big = malloc(LEN)) ||
+            getrlimit(RLIMIT_FSIZE, &limit) ||
+            !(kvraw = kvraw_open(PATHNAME, false, NULL))) {
+            _exit(1);
+        }
+        memset(big, 'b', LEN);
+        memset(val, 'v', sizeof(val));
+        off[0] = 0;
+        if (kvraw_append(kvraw, "before", SLEN("before"), val, sizeof(val), &off[0]) ||
+            kvraw_sync(kvraw, kvraw_size(kvraw))) {
+            _exit(2);
+        }
+
+        /* past a quarter of the value, on a device past the first (reserved) block */
+
+        end = kvraw_size(kvraw);
+        cap = limit;
+        cap.rlim_cur = block + end + LEN / 4;
+        off[1] = 0;
+        if (setrlimit(RLIMIT_FSIZE, &cap) ||
+            !kvraw_append(kvraw, "big", SLEN("big"), big, LEN, &off[1]) ||
+            setrlimit(RLIMIT_FSIZE, &limit) ||
+            (end != kvraw_size(kvraw))) {
+            _exit(3);
+        }
+        off[1] = 0;
+        if (kvraw_append(kvraw, "after", SLEN("after"), val, sizeof(val), &off[1]) ||
+            (end != off[1]) ||
+            kvraw_sync(kvraw, kvraw_size(kvraw))) {
+            _exit(4);
+        }
+        for (n = 0; n < 2; ++n) {
+            key_len = sizeof(key);
+            val_len = sizeof(val);
+            memset(val, 0, sizeof(val));
+            end = off[n];
+            if (kvraw_lookup(kvraw, key, &key_len, val, &val_len, &end) ||
+                strcmp(key, n ? "after" : "before") ||
+                (sizeof(val) != val_len) || ('v' != val[0]) || ('v' != val[sizeof(val) - 1])) {
+                _exit(5);
+            }
+        }
+        n = 0;
+        end = off[0];
+        if (kvraw_recover(kvraw, &end, kvraw_size(kvraw), count_record, &n) ||
+            (end != kvraw_size(kvraw)) || (2 != n)) {
+            _exit(6);
+        }
+        kvraw_close(kvraw);
+        free(big);
+        _exit(0);
+    }
+    if ((pid != waitpid(pid, &status, 0)) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        EXIT("child");
+    }
+    return 0;
+}
+
+/* the value of key i as of round r, which a reopen must bring back */
+
+static void
+mk_round(char *val, uint64_t len, uint64_t i, uint64_t r) {
+    safe_sprintf(val, len, "%lu.%lu", (unsigned long)i, (unsigned long)r);
+    memset(val + safe_strlen(val), (int)('a' + (i + r) % 26), len - safe_strlen(val));
+}
+
+static int
+check_rounds(struct kvdb *kvdb, uint64_t N, uint64_t R, uint64_t len) {
+    char key[32], val[1000], exp[1000];
+    uint64_t i, val_len;
+
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "persist%lu", (unsigned long)i);
+        mk_round(exp, len, i, (i % 7) ? R - 1 : 0);
+        val_len = sizeof(val);
+        if (i % 11) {
+            if (kvdb_lookup(kvdb, key, SLEN(key), val, &val_len) ||
+                (len != val_len) || memcmp(val, exp, len)) {
+                TRACE("lost value");
+                return -1;
+            }
+        } else if (+1 != kvdb_lookup(kvdb, key, SLEN(key), val, &val_len)) {
+            TRACE("removed key is back");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+persistence(void) {
+    const uint64_t N = 4000, R = 6, LEN = 1000, CHECKPOINT = 1 << 20;
+    struct kvdb_options options;
+    struct kvdb_stats stats;
+    struct kvdb *kvdb;
+    uint64_t i, r, size;
+    char key[32], val[LEN];
+    int status;
+    pid_t pid;
+
+    /* a clean close, then a reopen from the checkpoint alone */
+
+    if (!(kvdb = kvdb_open_persistent(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "persist%lu", (unsigned long)i);
+        mk_round(val, LEN, i, R - 1);
+        if (kvdb_insert(kvdb, key, SLEN(key), val, LEN)) {
+            EXIT("insert");
+        }
+    }
+    size = kvdb_size(kvdb);
+    kvdb_close(kvdb);
+    if (!(kvdb = kvdb_open_persistent(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+    kvdb_stats(kvdb, &stats);
+    if ((size != kvdb_size(kvdb)) || stats.replay_bytes) {
+        EXIT("reopen");
+    }
+    kvdb_close(kvdb);
+
+    /**
+     * A child rewrites everything a few times over, enough for compaction
+     * and for several checkpoints, removes some keys, and dies without
+     * kvdb_close(). Each write is on the device once the call returns.
+     */
+
+    if (0 > (pid = fork())) {
+        EXIT("fork");
+    }
+    if (!pid) {
+        memset(&options, 0, sizeof(options));
+        options.persistent = 1;
+        options.sync = KVDB_SYNC_BATCH;
+        options.checkpoint_bytes = CHECKPOINT;
+        if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+            _exit(1);
+        }
+        for (r = 0; r < R; ++r) {
+            for (i = 0; i < N; ++i) {
+                safe_sprintf(key, sizeof(key), "persist%lu", (unsigned long)i);
+                mk_round(val, LEN, i, r);
+                if ((!r || (i % 7)) && kvdb_replace(kvdb, key, SLEN(key), val, LEN)) {
+                    _exit(1);
+                }
+            }
+        }
+        for (i = 0; i < N; i += 11) {
+            safe_sprintf(key, sizeof(key), "persist%lu", (unsigned long)i);
+            if (kvdb_remove(kvdb, key, SLEN(key), NULL, NULL)) {
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    if ((pid != waitpid(pid, &status, 0)) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        EXIT("child");
+    }
+
+    /* replay only covers what was appended since the last checkpoint, whatever the device size */
+
+    if (!(kvdb = kvdb_open_persistent(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+    kvdb_stats(kvdb, &stats);
+    if (check_rounds(kvdb, N, R, LEN) ||
+        ((N - (N + 10) / 11) != kvdb_size(kvdb)) ||
+        (!stats.replay_bytes || ((2 * CHECKPOINT) < stats.replay_bytes))) {
+        EXIT("recovered state");
+    }
+    kvdb_close(kvdb);
+
+    /* a plain open starts over */
+
+    if (!(kvdb = kvdb_open(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+    if (kvdb_size(kvdb)) {
+        EXIT("fresh open");
+    }
+    kvdb_close(kvdb);
+    if (!(kvdb = kvdb_open_persistent(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+    if (kvdb_size(kvdb)) {
+        EXIT("fresh open");
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+static int
+write_batch(void) {
+    const char *const K1 = "k1", *const K2 = "k2";
+    const char *const V1 = "v1", *const V2 = "val2";
+    struct kvdb_op ops[7];
+    struct kvdb *kvdb;
+    uint64_t val_len;
+    char val[32];
+    int i;
+
+    if (!(kvdb = kvdb_open(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* later operations see the effect of earlier ones in the same batch */
+
+    memset(ops, 0, sizeof(ops));
+    for (i = 0; i < (int)ARRAY_SIZE(ops); ++i) {
+        ops[i].key = (i < 3) ? K1 : K2;
+        ops[i].key_len = SLEN(ops[i].key);
+        ops[i].val = (i % 2) ? V2 : V1;
+        ops[i].val_len = SLEN(ops[i].val);
+    }
+    ops[0].type = KVDB_OP_INSERT;  /* k1=v1 */
+    ops[1].type = KVDB_OP_UPDATE;  /* k1=val2 */
+    ops[2].type = KVDB_OP_INSERT;  /* exists */
+    ops[3].type = KVDB_OP_REPLACE; /* no k2 */
+    ops[4].type = KVDB_OP_INSERT;  /* k2=v1 */
+    ops[5].type = KVDB_OP_REMOVE;  /* k2 gone */
+    ops[6].type = KVDB_OP_UPDATE;  /* k2=v1 */
+    if (kvdb_write_batch(kvdb, ops, ARRAY_SIZE(ops)) ||
+        ops[0].result || ops[1].result || (+1 != ops[2].result) ||
+        (+1 != ops[3].result) || ops[4].result || ops[5].result ||
+        ops[6].result ||
+        (2 != kvdb_size(kvdb)) ||
+        (2 != kvdb_waste(kvdb))) {
+        kvdb_close(kvdb);
+        TRACE("batch results");
+        return -1;
+    }
+    val_len = sizeof(val);
+    if (kvdb_lookup(kvdb, K1, SLEN(K1), val, &val_len) ||
+        (SLEN(V2) != val_len) ||
+        memcmp(V2, val, val_len)) {
+        kvdb_close(kvdb);
+        TRACE("lookup k1");
+        return -1;
+    }
+    val_len = sizeof(val);
+    if (kvdb_remove(kvdb, K2, SLEN(K2), val, &val_len) ||
+        (SLEN(V1) != val_len) ||
+        memcmp(V1, val, val_len) ||
+        (+1 != kvdb_lookup(kvdb, K2, SLEN(K2), 0, 0))) {
+        kvdb_close(kvdb);
+        TRACE("remove k2");
+        return -1;
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+struct writer_arg {
+    struct kvdb *kvdb;
+    uint64_t id;
+    uint64_t n;
+    int err;
+};
+
+static void *
+writer_thread(void *arg_) {
+    struct writer_arg *arg = (struct writer_arg *)arg_;
+    char key[32], val[32];
+    uint64_t i;
+
+    for (i = 0; i < arg->n; ++i) {
+        safe_sprintf(key, sizeof(key), "t%lu.%lu", (unsigned long)arg->id, (unsigned long)i);
+        safe_sprintf(val, sizeof(val), "v%lu", (unsigned long)i);
+        if (kvdb_update(arg->kvdb, key, SLEN(key), val, SLEN(val))) {
+            arg->err = -1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int
+run_writers(const struct kvdb_options *options, uint64_t N) {
+    struct writer_arg args[8];
+    pthread_t threads[8];
+    char key[32], val[32], val_[32];
+    struct kvdb *kvdb;
+    uint64_t i, j, val_len;
+
+    if (!(kvdb = kvdb_open_options(PATHNAME, options))) {
+        TRACE(0);
+        return -1;
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+        args[i].kvdb = kvdb;
+        args[i].id = i;
+        args[i].n = N;
+        args[i].err = 0;
+        if (pthread_create(&threads[i], NULL, writer_thread, &args[i])) {
+            EXIT("pthread_create()");
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+        pthread_join(threads[i], NULL);
+        if (args[i].err) {
+            kvdb_close(kvdb);
+            TRACE("update");
+            return -1;
+        }
+    }
+    if ((ARRAY_SIZE(threads) * N) != kvdb_size(kvdb)) {
+        kvdb_close(kvdb);
+        TRACE("software");
+        return -1;
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+        for (j = 0; j < N; ++j) {
+            safe_sprintf(key, sizeof(key), "t%lu.%lu", (unsigned long)i, (unsigned long)j);
+            safe_sprintf(val, sizeof(val), "v%lu", (unsigned long)j);
+            val_len = sizeof(val_);
+            if (kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len) ||
+                (SLEN(val) != val_len) ||
+                memcmp(val, val_, val_len)) {
+                kvdb_close(kvdb);
+                TRACE("lookup");
+                return -1;
+            }
+        }
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+static int concurrent_writers(void) { return run_writers(NULL, 2000); }
+
+static int
+sync_writers(void) {
+    const int policies[] = {KVDB_SYNC_PERIODIC, KVDB_SYNC_BATCH, KVDB_SYNC_OP};
+    struct kvdb_options options;
+    uint64_t i;
+
+    for (i = 0; i < ARRAY_SIZE(policies); ++i) {
+        memset(&options, 0, sizeof(options));
+        options.sync = policies[i];
+        options.sync_interval = 1000;
+        if (run_writers(&options, 100)) {
+            TRACE(0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+memtable(void) {
+    const uint64_t N = 20000, BUDGET = 64 * 1024;
+    struct kvdb_options options;
+    struct kvdb_stats stats;
+    char key[32], val[64], val_[64];
+    uint64_t i, hits, val_len;
+    struct kvdb *kvdb;
+
+    memset(&options, 0, sizeof(options));
+    options.memtable_budget = BUDGET;
+    if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        TRACE(0);
+        return -1;
+    }
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "mt%lu", (unsigned long)i);
+        safe_sprintf(val, sizeof(val), "value of %lu, padded to forty bytes", (unsigned long)i);
+        if (kvdb_insert(kvdb, key, SLEN(key), val, SLEN(val))) {
+            EXIT("insert");
+        }
+    }
+
+    /* bounded, less what the write buffer still holds */
+
+    kvdb_stats(kvdb, &stats);
+    if (!stats.memtable_bytes || (stats.memtable_bytes > 4 * BUDGET)) {
+        EXIT("memtable size");
+    }
+
+    /* the latest keys come from memory, the earliest from the log */
+
+    hits = stats.memtable_hits;
+    for (i = 0; i < N; i = (99 == i) ? N - 100 : i + 1) {
+        safe_sprintf(key, sizeof(key), "mt%lu", (unsigned long)i);
+        safe_sprintf(val, sizeof(val), "value of %lu, padded to forty bytes", (unsigned long)i);
+        val_len = sizeof(val_);
+        if (kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len) ||
+            (SLEN(val) != val_len) ||
+            memcmp(val, val_, val_len)) {
+            EXIT("lookup");
+        }
+    }
+    kvdb_stats(kvdb, &stats);
+    if ((stats.memtable_hits - hits < 100) || (stats.memtable_hits - hits >= stats.lookups)) {
+        EXIT("memtable hits");
+    }
+
+    /* writes see the keys there too, removals shadow the log */
+
+    if ((+1 != kvdb_insert(kvdb, "mt19999", SLEN("mt19999"), "x", 2)) ||
+        kvdb_update(kvdb, "mt0", SLEN("mt0"), "new", SLEN("new")) ||
+        kvdb_remove(kvdb, "mt1", SLEN("mt1"), NULL, NULL)) {
+        EXIT("mutate");
+    }
+    val_len = sizeof(val_);
+    if (kvdb_remove(kvdb, "mt0", SLEN("mt0"), val_, &val_len) ||
+        (SLEN("new") != val_len) ||
+        memcmp(val_, "new", val_len) ||
+        (+1 != kvdb_lookup(kvdb, "mt0", SLEN("mt0"), NULL, NULL)) ||
+        (+1 != kvdb_lookup(kvdb, "mt1", SLEN("mt1"), NULL, NULL)) ||
+        (+1 != kvdb_remove(kvdb, "mt1", SLEN("mt1"), NULL, NULL)) ||
+        (N - 2 != kvdb_size(kvdb))) {
+        EXIT("mutate");
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+static int
+multi_lookup(void) {
+    const uint64_t N = 3000, FANOUT = 500;
+    struct kvdb_get gets[500];
+    struct kvdb_options options;
+    char *keys, *vals, *val;
+    uint64_t i, j, k, val_len;
+    struct kvdb *kvdb;
+    int r;
+
+    memset(&options, 0, sizeof(options));
+    options.memtable_budget = 16 * 1024;
+    keys = malloc(FANOUT * 32);
+    vals = malloc(FANOUT * 1024);
+    val = malloc(1024);
+    if (!keys || !vals || !val || !(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        FREE(keys);
+        FREE(vals);
+        FREE(val);
+        TRACE(0);
+        return -1;
+    }
+
+    /* values up to 1000 bytes, past the read prefix, some removed */
+
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(keys, 32, "multi%lu", (unsigned long)i);
+        memset(val, 'a' + (int)(i % 26), 1 + i % 1000);
+        if (kvdb_insert(kvdb, keys, SLEN(keys), val, 1 + i % 1000) ||
+            ((0 == i % 7) && kvdb_remove(kvdb, keys, SLEN(keys), NULL, NULL))) {
+            EXIT("mutate");
+        }
+    }
+
+    /* as kvdb_lookup() would have it, missing keys and short buffers too */
+
+    for (k = 0; k < 8; ++k) {
+        for (j = 0; j < FANOUT; ++j) {
+            i = (j * 7 + k * 131) % (N + N / 10);
+            safe_sprintf(keys + j * 32, 32, "multi%lu", (unsigned long)i);
+            gets[j].key = keys + j * 32;
+            gets[j].key_len = SLEN(keys + j * 32);
+            gets[j].val = (3 == j % 4) ? NULL : vals + j * 1024;
+            gets[j].val_len = (3 == j % 4) ? 0 : (2 == j % 4) ? 10 : 1024;
+        }
+        if (kvdb_multi_lookup(kvdb, gets, FANOUT)) {
+            EXIT("multi_lookup");
+        }
+        for (j = 0; j < FANOUT; ++j) {
+            val_len = 1024;
+            r = kvdb_lookup(kvdb, gets[j].key, gets[j].key_len, val, &val_len);
+            if ((r != gets[j].result) ||
+                (!r && ((val_len != gets[j].val_len) ||
+                        (gets[j].val && memcmp(val, gets[j].val, MIN(val_len, (2 == j % 4) ? 10 : 1024)))))) {
+                EXIT("multi_lookup");
+            }
+        }
+    }
+    kvdb_close(kvdb);
+    FREE(keys);
+    FREE(vals);
+    FREE(val);
+    return 0;
+}
+
+static void *
+reader_thread(void *arg_) {
+    struct writer_arg *arg = (struct writer_arg *)arg_;
+    char key[32];
+    uint64_t i;
+
+    for (i = 0; i < arg->n; ++i) {
+        safe_sprintf(key, sizeof(key), "t%lu.%lu", (unsigned long)arg->id, (unsigned long)i);
+        if (kvdb_lookup(arg->kvdb, key, SLEN(key), NULL, NULL)) {
+            arg->err = -1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t
+sum(const uint64_t *buf, uint64_t n) {
+    uint64_t i, s;
+
+    for (i = 0, s = 0; i < n; ++i) {
+        s += buf[i];
+    }
+    return s;
+}
+
+static int
+statistics(void) {
+    const uint64_t N = 4000;
+    struct writer_arg args[8];
+    pthread_t threads[8];
+    struct kvdb_stats stats;
+    struct kvdb *kvdb;
+    uint64_t i, j, bytes;
+    char key[32], val[32];
+
+    if (!(kvdb = kvdb_open(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+
+    /* writers, then as many readers, each thread adding to its own stripe */
+
+    for (j = 0; j < 2; ++j) {
+        for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+            args[i].kvdb = kvdb;
+            args[i].id = i;
+            args[i].n = N;
+            args[i].err = 0;
+            if (pthread_create(&threads[i], NULL, j ? reader_thread : writer_thread, &args[i])) {
+                EXIT("pthread_create()");
+            }
+        }
+        for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+            pthread_join(threads[i], NULL);
+            if (args[i].err) {
+                kvdb_close(kvdb);
+                TRACE(j ? "lookup" : "update");
+                return -1;
+            }
+        }
+    }
+    bytes = 0;
+    for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+        for (j = 0; j < N; ++j) {
+            safe_sprintf(key, sizeof(key), "t%lu.%lu", (unsigned long)i, (unsigned long)j);
+            safe_sprintf(val, sizeof(val), "v%lu", (unsigned long)j);
+            bytes += SLEN(key) + SLEN(val);
+        }
+    }
+
+    /* counts are exact, histograms add up to their counts */
+
+    kvdb_stats(kvdb, &stats);
+    if ((stats.lookups != ARRAY_SIZE(threads) * N) ||
+        stats.absent ||
+        (stats.user_bytes != bytes) ||
+        (stats.chain_hops < stats.lookups - stats.memtable_hits) ||
+        (sum(stats.hops, KVDB_HIST) != stats.chain_walks) ||
+        (stats.logfs.appended_bytes < bytes) ||
+        (stats.logfs.reads_cache + stats.logfs.reads_write_buffer + stats.logfs.reads_both < stats.lookups - stats.memtable_hits) ||
+        !stats.logfs.flushes ||
+        (sum(stats.logfs.flush_blocks, LOGFS_HIST) != stats.logfs.flushes) ||
+        (sum(stats.logfs.device.write_us, DEVICE_HIST) != stats.logfs.device.writes) ||
+        (sum(stats.logfs.device.read_us, DEVICE_HIST) != stats.logfs.device.reads) ||
+        !stats.logfs.device.write_bytes ||
+        (stats.write_amp <= 0.0)) {
+        kvdb_close(kvdb);
+        TRACE("stats");
+        return -1;
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+static int
+cache_read(struct logfs *logfs, char *buf, uint64_t unit, uint64_t i) {
+    uint64_t j;
+
+    if (logfs_read(logfs, buf, i * unit, unit)) {
+        TRACE(0);
+        return -1;
+    }
+    for (j = 0; j < unit; ++j) {
+        if (buf[j] != (char)(i + 1)) {
+            TRACE("bad page data");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+read_cache(void) {
+    const uint64_t UNIT = 4096, SLOTS = 16;
+    struct logfs_options options;
+    struct logfs_stats stats;
+    struct logfs *logfs;
+    uint64_t i, k;
+    char *buf;
+
+    memset(&options, 0, sizeof(options));
+    options.cache_budget = SLOTS * UNIT;
+    options.admit_all = 1; /* plain CLOCK */
+    if (!(logfs = logfs_open(PATHNAME, false, &options))) {
+        TRACE(0);
+        return -1;
+    }
+    if (!(buf = malloc(UNIT))) {
+        logfs_close(logfs);
+        TRACE("out of memory");
+        return -1;
+    }
+
+    /* fill well past the write buffer so the first units are on the device */
+
+    for (i = 0; i < 8 * SLOTS; ++i) {
+        memset(buf, (int)(i + 1), UNIT);
+        if (logfs_append(logfs, buf, UNIT)) {
+            logfs_close(logfs);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+
+    /* cold pass, warm pass, then enough new units to evict half the cache */
+
+    for (i = 0; i < 2 * SLOTS + SLOTS / 2; ++i) {
+        if (cache_read(logfs, buf, UNIT, (i < 2 * SLOTS) ? (i % SLOTS) : i - SLOTS)) {
+            logfs_close(logfs);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+
+    /* the CLOCK hand evicted the oldest half, the newest half survives */
+
+    for (i = SLOTS / 2; i < SLOTS; ++i) {
+        if (cache_read(logfs, buf, UNIT, i)) {
+            logfs_close(logfs);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+    logfs_stats(logfs, &stats);
+    k = stats.cache_pages / SLOTS; /* device blocks per unit */
+    logfs_close(logfs);
+    FREE(buf);
+    if (!k ||
+        ((SLOTS + SLOTS / 2) * k != stats.cache_hits) ||
+        ((SLOTS + SLOTS / 2) * k != stats.cache_misses) ||
+        ((SLOTS / 2) * k != stats.cache_evictions)) {
+        TRACE("unexpected cache statistics");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+admission(void) {
+    const uint64_t UNIT = 4096, SLOTS = 64, UNITS = 1024, HOT = SLOTS / 4;
+    struct logfs_options options;
+    struct logfs_stats stats, stats_;
+    struct logfs *logfs;
+    uint64_t i, j, k;
+    char *buf;
+
+    memset(&options, 0, sizeof(options));
+    options.cache_budget = SLOTS * UNIT;
+    if (!(logfs = logfs_open(PATHNAME, false, &options))) {
+        TRACE(0);
+        return -1;
+    }
+    if (!(buf = malloc(UNIT))) {
+        logfs_close(logfs);
+        TRACE("out of memory");
+        return -1;
+    }
+    for (i = 0; i < UNITS; ++i) {
+        memset(buf, (int)(i + 1), UNIT);
+        if (logfs_append(logfs, buf, UNIT)) {
+            logfs_close(logfs);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+
+    /* a hot set, still read now and then during a scan of the rest of the log */
+
+    for (i = 0; i < 4 * HOT; ++i) {
+        if (cache_read(logfs, buf, UNIT, i % HOT)) {
+            logfs_close(logfs);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+    for (i = HOT; i < UNITS; ++i) {
+        for (k = 0; k <= ((i % HOT) ? 0 : HOT); ++k) {
+            if (cache_read(logfs, buf, UNIT, k ? k - 1 : i)) {
+                logfs_close(logfs);
+                FREE(buf);
+                TRACE(0);
+                return -1;
+            }
+        }
+    }
+
+    /* the scan went past the hot set, and so does one that is not cached */
+
+    for (j = 0; j < 2; ++j) {
+        logfs_stats(logfs, &stats_);
+        for (i = HOT; j && (i < UNITS); ++i) {
+            if (logfs_read_nocache(logfs, buf, i * UNIT, UNIT)) {
+                logfs_close(logfs);
+                FREE(buf);
+                TRACE(0);
+                return -1;
+            }
+            for (k = 0; k < UNIT; ++k) {
+                if (buf[k] != (char)(i + 1)) {
+                    logfs_close(logfs);
+                    FREE(buf);
+                    TRACE("bad page data");
+                    return -1;
+                }
+            }
+        }
+        for (i = 0; i < HOT; ++i) {
+            if (cache_read(logfs, buf, UNIT, i)) {
+                logfs_close(logfs);
+                FREE(buf);
+                TRACE(0);
+                return -1;
+            }
+        }
+        logfs_stats(logfs, &stats);
+        if (!stats.cache_rejections ||
+            (stats.cache_misses - stats_.cache_misses != stats.cache_bypasses - stats_.cache_bypasses) ||
+            (stats.cache_evictions != stats_.cache_evictions) ||
+            (j && (stats.cache_bypasses == stats_.cache_bypasses))) {
+            logfs_close(logfs);
+            FREE(buf);
+            TRACE("hot set evicted");
+            return -1;
+        }
+    }
+    logfs_close(logfs);
+    FREE(buf);
+    return 0;
+}
+
+struct read_bench_arg {
+    struct logfs *logfs;
+    uint64_t unit;
+    uint64_t units;
+    uint64_t reads;
+    unsigned seed;
+    int err;
+};
+
+static void *
+read_bench_thread(void *arg_) {
+    struct read_bench_arg *arg = (struct read_bench_arg *)arg_;
+    char buf[256];
+    uint64_t i, off;
+
+    for (i = 0; i < arg->reads; ++i) {
+        off = (rand_r(&arg->seed) % arg->units) * arg->unit;
+        off += rand_r(&arg->seed) % (arg->unit - sizeof(buf));
+        if (logfs_read(arg->logfs, buf, off, sizeof(buf))) {
+            arg->err = -1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int
+read_bench(void) {
+    const uint64_t UNIT = 4096, UNITS = 4096;
+    const struct {
+        const char *name;
+        uint64_t units;
+        uint64_t reads;
+    } RANGES[] = {{"hot", 64, 400000}, {"cold", UNITS, 20000}};
+    struct read_bench_arg args[8];
+    pthread_t threads[8];
+    struct logfs_stats stats, stats_;
+    struct logfs *logfs;
+    uint64_t i, r, t, n;
+    char *buf;
+
+    if (!(logfs = logfs_open(PATHNAME, false, NULL))) {
+        TRACE(0);
+        return -1;
+    }
+    if (!(buf = malloc(UNIT))) {
+        logfs_close(logfs);
+        TRACE("out of memory");
+        return -1;
+    }
+    for (i = 0; i < UNITS; ++i) {
+        memset(buf, (int)i, UNIT);
+        if (logfs_append(logfs, buf, UNIT)) {
+            logfs_close(logfs);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+    FREE(buf);
+
+    /* random 256 byte reads, all threads share one logfs */
+
+    for (r = 0; r < ARRAY_SIZE(RANGES); ++r) {
+        for (n = 1; n <= ARRAY_SIZE(threads); n *= 2) {
+            logfs_stats(logfs, &stats_);
+            t = ref_time();
+            for (i = 0; i < n; ++i) {
+                args[i].logfs = logfs;
+                args[i].unit = UNIT;
+                args[i].units = RANGES[r].units;
+                args[i].reads = RANGES[r].reads / n;
+                args[i].seed = (unsigned)(i + 1);
+                args[i].err = 0;
+                if (pthread_create(&threads[i], NULL, read_bench_thread, &args[i])) {
+                    EXIT("pthread_create()");
+                }
+            }
+            for (i = 0; i < n; ++i) {
+                pthread_join(threads[i], NULL);
+                if (args[i].err) {
+                    logfs_close(logfs);
+                    TRACE(0);
+                    return -1;
+                }
+            }
+            t = ref_time() - t;
+            logfs_stats(logfs, &stats);
+            printf("\t %-5s threads=%lu %10.0f reads/s  hit=%5.1f%%\n",
+                   RANGES[r].name,
+                   (unsigned long)n,
+                   1e6 * (double)(RANGES[r].reads / n * n) / MAX(t, 1),
+                   100.0 * (stats.cache_hits - stats_.cache_hits) /
+                       MAX(1, stats.cache_hits - stats_.cache_hits +
+                                  stats.cache_misses - stats_.cache_misses));
+        }
+    }
+    logfs_close(logfs);
+    return 0;
+}
+
+struct admission_bench_arg {
+    struct logfs *logfs;
+    const double *cdf; /* of the zipfian popularity of the units, NULL to scan */
+    uint64_t unit;
+    uint64_t units;
+    uint64_t reads;
+    uint64_t seed;
+    int nocache;
+    volatile int *stop;
+    int err;
+};
+
+/**
+ * Zipfian reads of 256 bytes, each within one block, of the first units. Or,
+ * without a cdf, sequential 64 KB reads of as many units after them until
+ * stopped.
+ */
+
+static void *
+admission_bench_thread(void *arg_) {
+    struct admission_bench_arg *arg = (struct admission_bench_arg *)arg_;
+    uint64_t i, lo, hi, off;
+    char buf[256], *chunk;
+    double u;
+
+    if (!arg->cdf) {
+        if (!(chunk = malloc(16 * arg->unit))) {
+            arg->err = -1;
+            return NULL;
+        }
+        for (off = 0; !(*arg->stop); off = (off + 16 * arg->unit) % (arg->units * arg->unit)) {
+            /* past the units of the readers */
+            if (arg->nocache ? logfs_read_nocache(arg->logfs, chunk, arg->units * arg->unit + off, 16 * arg->unit)
+                             : logfs_read(arg->logfs, chunk, arg->units * arg->unit + off, 16 * arg->unit)) {
+                arg->err = -1;
+                break;
+            }
+        }
+        FREE(chunk);
+        return NULL;
+    }
+    for (i = 0; i < arg->reads; ++i) {
+        arg->seed = arg->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        u = (double)(arg->seed >> 11) / (double)(1ULL << 53);
+        for (lo = 0, hi = arg->units - 1; lo < hi;) {
+            if (arg->cdf[(lo + hi) / 2] < u) {
+                lo = (lo + hi) / 2 + 1;
+            } else {
+                hi = (lo + hi) / 2;
+            }
+        }
+        /* the popular units are scattered over the log */
+        off = (lo * 0x9e3779b97f4a7c15ULL) % arg->units * arg->unit;
+        off += (arg->seed >> 40) % (arg->unit / sizeof(buf)) * sizeof(buf);
+        if (logfs_read(arg->logfs, buf, off, sizeof(buf))) {
+            arg->err = -1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int
+admission_bench(void) {
+    const uint64_t UNIT = 4096, UNITS = 8192, READS = 400000;
+    const struct {
+        const char *name;
+        int admit_all;
+        int scan; /* 0 none, 1 cached, 2 past the cache */
+    } MODES[] = {{"clock", 1, 0},
+                 {"tinylfu", 0, 0},
+                 {"clock scan", 1, 1},
+                 {"tinylfu scan", 0, 1},
+                 {"tinylfu nocache scan", 0, 2}};
+    struct admission_bench_arg args[5];
+    struct logfs_stats stats, stats_;
+    struct logfs_options options;
+    pthread_t threads[5];
+    struct logfs *logfs;
+    uint64_t i, m, p, t, n;
+    volatile int stop;
+    double *cdf;
+    char *buf;
+
+    if (!(cdf = malloc(UNITS * sizeof(cdf[0]))) || !(buf = malloc(UNIT))) {
+        FREE(cdf);
+        TRACE("out of memory");
+        return -1;
+    }
+    for (i = 0; i < UNITS / 2; ++i) {
+        cdf[i] = (i ? cdf[i - 1] : 0.0) + 1.0 / pow((double)(i + 1), 0.99);
+    }
+    for (i = 0; i < UNITS / 2; ++i) {
+        cdf[i] /= cdf[UNITS / 2 - 1];
+    }
+
+    /* 4 zipfian readers over 16 times the cache, beside a scan of as much more log or not */
+    /* a scan never reads a page again before it is evicted, the hits are the readers' */
+
+    for (m = 0; m < ARRAY_SIZE(MODES); ++m) {
+        memset(&options, 0, sizeof(options));
+        options.admit_all = MODES[m].admit_all;
+        if (!(logfs = logfs_open(PATHNAME, false, &options))) {
+            FREE(cdf);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+        for (i = 0; i < UNITS; ++i) {
+            memset(buf, (int)i, UNIT);
+            if (logfs_append(logfs, buf, UNIT)) {
+                EXIT("logfs_append");
+            }
+        }
+        t = 0;
+        for (p = 0; p < 2; ++p) {
+            /* warm up, then measure */
+            logfs_stats(logfs, &stats_);
+            stop = 0;
+            n = (1 == p) && MODES[m].scan ? 5 : 4;
+            t -= (1 == p) ? ref_time() : 0;
+            for (i = 0; i < n; ++i) {
+                memset(&args[i], 0, sizeof(args[i]));
+                args[i].logfs = logfs;
+                args[i].cdf = (i < 4) ? cdf : NULL;
+                args[i].unit = UNIT;
+                args[i].units = UNITS / 2;
+                args[i].reads = READS / 4;
+                args[i].seed = i + 1 + p * 4;
+                args[i].nocache = 2 == MODES[m].scan;
+                args[i].stop = &stop;
+                if (pthread_create(&threads[i], NULL, admission_bench_thread, &args[i])) {
+                    EXIT("pthread_create()");
+                }
+            }
+            for (i = 0; i < n; ++i) {
+                if (4 == i) {
+                    stop = 1;
+                }
+                pthread_join(threads[i], NULL);
+                if (args[i].err) {
+                    EXIT("logfs_read");
+                }
+            }
+            t += (1 == p) ? ref_time() : 0;
+        }
+        logfs_stats(logfs, &stats);
+        printf("\t %-20s %9.0f reads/s  hit=%5.1f%%\n",
+               MODES[m].name,
+               1e6 * (double)READS / MAX(t, 1),
+               100.0 * (stats.cache_hits - stats_.cache_hits) / READS);
+        logfs_close(logfs);
+    }
+    FREE(cdf);
+    FREE(buf);
+    return 0;
+}
+
+struct rww_bench_arg {
+    struct kvdb *kvdb;
+    uint64_t keys;
+    uint64_t ops;
+    unsigned seed;
+    volatile int *stop;
+    int err;
+};
+
+static void *
+rww_reader(void *arg_) {
+    struct rww_bench_arg *arg = (struct rww_bench_arg *)arg_;
+    uint64_t val_len;
+    char key[32], val[128];
+
+    while (!(*arg->stop)) {
+        safe_sprintf(key, sizeof(key), "k%08lu",
+                     (unsigned long)(rand_r(&arg->seed) % arg->keys));
+        val_len = sizeof(val);
+        if (kvdb_lookup(arg->kvdb, key, SLEN(key), val, &val_len)) {
+            arg->err = -1;
+            break;
+        }
+        ++arg->ops;
+    }
+    return NULL;
+}
+
+static void *
+rww_writer(void *arg_) {
+    struct rww_bench_arg *arg = (struct rww_bench_arg *)arg_;
+    char key[32], val[100];
+
+    memset(val, 'w', sizeof(val));
+    while (!(*arg->stop)) {
+        safe_sprintf(key, sizeof(key), "k%08lu",
+                     (unsigned long)(rand_r(&arg->seed) % arg->keys));
+        if (kvdb_update(arg->kvdb, key, SLEN(key), val, sizeof(val))) {
+            arg->err = -1;
+            break;
+        }
+        ++arg->ops;
+    }
+    return NULL;
+}
+
+static int
+readrandom(uint64_t cache_budget) {
+    const uint64_t N = 100000;
+    struct rww_bench_arg args[8];
+    struct kvdb_options options;
+    pthread_t threads[8];
+    volatile int stop;
+    struct kvdb *kvdb;
+    uint64_t i, n, t, reads;
+    char key[32], val[100];
+
+    memset(&options, 0, sizeof(options));
+    options.cache_budget = cache_budget;
+    if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        TRACE(0);
+        return -1;
+    }
+    memset(val, 'v', sizeof(val));
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "k%08lu", (unsigned long)i);
+        if (kvdb_insert(kvdb, key, SLEN(key), val, sizeof(val))) {
+            kvdb_close(kvdb);
+            TRACE(0);
+            return -1;
+        }
+    }
+
+    /* n readers looking up random keys, nothing else running */
+
+    for (n = 1; n <= ARRAY_SIZE(threads); n *= 2) {
+        stop = 0;
+        for (i = 0; i < n; ++i) {
+            memset(&args[i], 0, sizeof(args[i]));
+            args[i].kvdb = kvdb;
+            args[i].keys = N;
+            args[i].seed = (unsigned)(i + 1);
+            args[i].stop = &stop;
+            if (pthread_create(&threads[i], NULL, rww_reader, &args[i])) {
+                EXIT("pthread_create()");
+            }
+        }
+        t = ref_time();
+        us_sleep(1000000);
+        stop = 1;
+        reads = 0;
+        for (i = 0; i < n; ++i) {
+            pthread_join(threads[i], NULL);
+            if (args[i].err) {
+                kvdb_close(kvdb);
+                TRACE(0);
+                return -1;
+            }
+            reads += args[i].ops;
+        }
+        t = ref_time() - t;
+        printf("\t cache=%2luMB readers=%lu %10.0f lookups/s\n",
+               (unsigned long)(cache_budget >> 20),
+               (unsigned long)n,
+               1e6 * (double)reads / MAX(t, 1));
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+/* a cache much smaller than the data, then one that holds all of it */
+
+static int
+readrandom_bench(void) {
+    return readrandom(1 << 20) || readrandom(32 << 20);
+}
+
+static int
+lookup_ref_bench(void) {
+    const uint64_t N = 2000, VAL = 8192;
+    struct kvdb_options options;
+    struct kvdb_ref ref;
+    struct kvdb *kvdb;
+    uint64_t i, n, t, val_len, sum;
+    unsigned seed = 1;
+    char key[32], *val;
+    int pass;
+
+    memset(&options, 0, sizeof(options));
+    options.cache_budget = 32 << 20;
+    if (!(val = malloc(VAL))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        FREE(val);
+        TRACE(0);
+        return -1;
+    }
+    memset(val, 'v', VAL);
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "k%08lu", (unsigned long)i);
+        if (kvdb_insert(kvdb, key, SLEN(key), val, VAL)) {
+            EXIT("insert");
+        }
+    }
+
+    /* 8KB values, all cached: a warmup, copying lookups, then views */
+
+    sum = 0;
+    for (pass = 0; pass < 3; ++pass) {
+        n = 0;
+        t = ref_time();
+        while ((ref_time() - t) < 1000000) {
+            safe_sprintf(key, sizeof(key), "k%08lu", (unsigned long)(rand_r(&seed) % N));
+            val_len = VAL;
+            if ((2 == pass) && !kvdb_lookup_ref(kvdb, key, SLEN(key), &ref)) {
+                sum += ((const char *)ref.view.iov[0].iov_base)[0];
+                kvdb_release(kvdb, &ref);
+            } else if ((2 > pass) && !kvdb_lookup(kvdb, key, SLEN(key), val, &val_len)) {
+                sum += val[0];
+            } else {
+                EXIT("lookup");
+            }
+            ++n;
+        }
+        t = ref_time() - t;
+        if (pass) {
+            printf("\t %-10s %10.0f lookups/s\n",
+                   (1 == pass) ? "lookup" : "lookup_ref",
+                   1e6 * (double)n / MAX(t, 1));
+        }
+    }
+    kvdb_close(kvdb);
+    FREE(val);
+    return sum ? 0 : -1;
+}
+
+static int
+readwhilewriting_bench(void) {
+    const uint64_t N = 100000;
+    struct rww_bench_arg args[9];
+    pthread_t threads[9];
+    volatile int stop;
+    struct kvdb *kvdb;
+    uint64_t i, n, t, reads;
+    char key[32], val[100];
+
+    if (!(kvdb = kvdb_open(PATHNAME))) {
+        TRACE(0);
+        return -1;
+    }
+    memset(val, 'v', sizeof(val));
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(key, sizeof(key), "k%08lu", (unsigned long)i);
+        if (kvdb_insert(kvdb, key, SLEN(key), val, sizeof(val))) {
+            kvdb_close(kvdb);
+            TRACE(0);
+            return -1;
+        }
+    }
+
+    /* one writer updating random keys, n readers looking up random keys */
+
+    for (n = 1; n < ARRAY_SIZE(threads); n *= 2) {
+        stop = 0;
+        for (i = 0; i <= n; ++i) {
+            memset(&args[i], 0, sizeof(args[i]));
+            args[i].kvdb = kvdb;
+            args[i].keys = N;
+            args[i].seed = (unsigned)(i + 1);
+            args[i].stop = &stop;
+            if (pthread_create(&threads[i],
+                               NULL,
+                               i ? rww_reader : rww_writer,
+                               &args[i])) {
+                EXIT("pthread_create()");
+            }
+        }
+        t = ref_time();
+        us_sleep(1000000);
+        stop = 1;
+        reads = 0;
+        for (i = 0; i <= n; ++i) {
+            pthread_join(threads[i], NULL);
+            if (args[i].err) {
+                kvdb_close(kvdb);
+                TRACE(0);
+                return -1;
+            }
+            reads += i ? args[i].ops : 0;
+        }
+        t = ref_time() - t;
+        printf("\t readers=%lu %10.0f lookups/s %10.0f updates/s\n",
+               (unsigned long)n,
+               1e6 * (double)reads / MAX(t, 1),
+               1e6 * (double)args[0].ops / MAX(t, 1));
+    }
+    kvdb_close(kvdb);
+    return 0;
+}
+
+struct sync_bench_arg {
+    struct kvdb *kvdb;
+    uint64_t id;
+    uint64_t *lat;
+    uint64_t n;
+    uint64_t max;
+    volatile int *stop;
+    int err;
+};
+
+static void *
+sync_bench_thread(void *arg_) {
+    struct sync_bench_arg *arg = (struct sync_bench_arg *)arg_;
+    char key[32], val[100];
+    uint64_t t;
+
+    memset(val, 's', sizeof(val));
+    while (!(*arg->stop) && (arg->n < arg->max)) {
+        safe_sprintf(key, sizeof(key), "t%lu.%lu",
+                     (unsigned long)arg->id, (unsigned long)(arg->n % 1000));
+        t = ref_time();
+        if (kvdb_update(arg->kvdb, key, SLEN(key), val, sizeof(val))) {
+            arg->err = -1;
+            break;
+        }
+        arg->lat[arg->n++] = ref_time() - t;
+    }
+    return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b) {
+    uint64_t a_ = *(const uint64_t *)a, b_ = *(const uint64_t *)b;
+
+    return (a_ > b_) - (a_ < b_);
+}
+
+static int
+sync_bench(void) {
+    const char *names[] = {"none", "periodic", "batch", "op"};
+    const int policies[] = {KVDB_SYNC_NONE, KVDB_SYNC_PERIODIC, KVDB_SYNC_BATCH, KVDB_SYNC_OP};
+    const uint64_t MAX_OPS = 200000;
+    struct sync_bench_arg args[4];
+    pthread_t threads[4];
+    struct kvdb_options options;
+    volatile int stop;
+    struct kvdb *kvdb;
+    uint64_t i, p, n, t, *lat;
+
+    if (!(lat = malloc(ARRAY_SIZE(threads) * MAX_OPS * sizeof(lat[0])))) {
+        TRACE("out of memory");
+        return -1;
+    }
+
+    /* n writers updating for a second; commit latency of each update */
+
+    for (p = 0; p < ARRAY_SIZE(policies); ++p) {
+        memset(&options, 0, sizeof(options));
+        options.sync = policies[p];
+        options.sync_interval = 10000;
+        if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+            FREE(lat);
+            TRACE(0);
+            return -1;
+        }
+        stop = 0;
+        for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+            memset(&args[i], 0, sizeof(args[i]));
+            args[i].kvdb = kvdb;
+            args[i].id = i;
+            args[i].lat = lat + i * MAX_OPS;
+            args[i].max = MAX_OPS;
+            args[i].stop = &stop;
+            if (pthread_create(&threads[i], NULL, sync_bench_thread, &args[i])) {
+                EXIT("pthread_create()");
+            }
+        }
+        t = ref_time();
+        us_sleep(1000000);
+        stop = 1;
+        n = 0;
+        for (i = 0; i < ARRAY_SIZE(threads); ++i) {
+            pthread_join(threads[i], NULL);
+            if (args[i].err) {
+                kvdb_close(kvdb);
+                FREE(lat);
+                TRACE(0);
+                return -1;
+            }
+            memmove(lat + n, args[i].lat, args[i].n * sizeof(lat[0]));
+            n += args[i].n;
+        }
+        t = ref_time() - t;
+        kvdb_close(kvdb);
+        qsort(lat, n, sizeof(lat[0]), cmp_u64);
+        printf("	 %-8s %10.0f updates/s p50 %6luus p99 %6luus p999 %6luus\n",
+               names[p],
+               1e6 * (double)n / MAX(t, 1),
+               (unsigned long)(n ? lat[n / 2] : 0),
+               (unsigned long)(n ? lat[n * 99 / 100] : 0),
+               (unsigned long)(n ? lat[n * 999 / 1000] : 0));
+    }
+    FREE(lat);
+    return 0;
+}
+
+static int
+device_bench(void) {
+    const unsigned depths[] = {1, 8, 32};
+    struct device_io ios[32];
+    struct device *device;
+    uint64_t i, d, n, t, block, blocks;
+    unsigned seed = 1;
+    char *mem;
+    int write;
+
+    /* random block reads, then writes, issued depth at a time */
+
+    for (d = 0; d < ARRAY_SIZE(depths); ++d) {
+        if (!(device = device_open_queue(PATHNAME, depths[d]))) {
+            TRACE(0);
+            return -1;
+        }
+        block = device_block(device);
+        blocks = device_size(device) / block;
+        if (!(mem = aligned_alloc(block, depths[d] * block))) {
+            device_close(device);
+            TRACE("out of memory");
+            return -1;
+        }
+        memset(mem, 'd', depths[d] * block);
+        for (write = 0; write < 2; ++write) {
+            n = 0;
+            t = ref_time();
+            while ((ref_time() - t) < 1000000) {
+                for (i = 0; i < depths[d]; ++i) {
+                    ios[i].buf = mem + i * block;
+                    ios[i].off = (rand_r(&seed) % blocks) * block;
+                    ios[i].len = block;
+                    ios[i].write = write;
+                }
+                if (device_submit(device, ios, depths[d])) {
+                    FREE(mem);
+                    device_close(device);
+                    TRACE(0);
+                    return -1;
+                }
+                n += depths[d];
+            }
+            t = ref_time() - t;
+            printf("\t %-12s qd=%-2u %-6s %10.0f IOPS %8.1f MB/s\n",
+                   device_backend(device),
+                   device_depth(device),
+                   write ? "write" : "read",
+                   1e6 * (double)n / MAX(t, 1),
+                   (double)n * block / MAX(t, 1));
+        }
+        FREE(mem);
+        device_close(device);
+    }
+    return 0;
+}
+
+static int
+append_bench(void) {
+    const uint64_t N = 100000, UNIT = 256;
+    struct logfs *logfs;
+    uint64_t i, t, *lat;
+    char buf[256];
+
+    if (!(lat = malloc(N * sizeof(lat[0])))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    if (!(logfs = logfs_open(PATHNAME, false, NULL))) {
+        FREE(lat);
+        TRACE(0);
+        return -1;
+    }
+
+    /* latency of each small append while the flusher writes behind it */
+
+    memset(buf, 'a', sizeof(buf));
+    t = ref_time();
+    for (i = 0; i < N; ++i) {
+        lat[i] = ref_time();
+        if (logfs_append(logfs, buf, UNIT)) {
+            logfs_close(logfs);
+            FREE(lat);
+            TRACE(0);
+            return -1;
+        }
+        lat[i] = ref_time() - lat[i];
+    }
+    t = ref_time() - t;
+    logfs_close(logfs);
+    qsort(lat, N, sizeof(lat[0]), cmp_u64);
+    printf("\t %10.0f appends/s p50 %6luus p99 %6luus p999 %6luus max %6luus\n",
+           1e6 * (double)N / MAX(t, 1),
+           (unsigned long)lat[N / 2],
+           (unsigned long)lat[N * 99 / 100],
+           (unsigned long)lat[N * 999 / 1000],
+           (unsigned long)lat[N - 1]);
+    FREE(lat);
+    return 0;
+}
+
+static uint64_t
+bytewise_hash(const void *buf, uint64_t len) {
+    uint64_t i, a, b, c, d;
+    const char *p;
+
+    assert(!len || buf);
+
+    p = (const char *)buf;
+    a = b = c = d = len * 414507281407;
+    for (i = 0; i < len; ++i) {
+        a += (uint64_t)p[i] * 592821132889;
+        b += (uint64_t)p[i] * 963726515729;
+        c += (uint64_t)p[i] * 1765037224331;
+        d += (uint64_t)p[i] * 2428095424619;
+        d ^= c;
+        c = (c << 15) | (c >> (64 - 15));
+        d += c;
+        a ^= d;
+        d = (d << 52) | (d >> (64 - 52));
+        a += d;
+        b ^= a;
+        a = (a << 26) | (a >> (64 - 26));
+        b += a;
+        c ^= b;
+        b = (b << 51) | (b >> (64 - 51));
+        c += b;
+        d ^= c;
+        c = (c << 28) | (c >> (64 - 28));
+        d += c;
+        a ^= d;
+        d = (d << 9) | (d >> (64 - 9));
+        a += d;
+        b ^= a;
+        a = (a << 47) | (a >> (64 - 47));
+        b += a;
+        c ^= b;
+        b = (b << 54) | (b >> (64 - 54));
+        c += b;
+        d ^= c;
+        c = (c << 32) | (c >> (64 - 32));
+        d += c;
+        a ^= d;
+        d = (d << 25) | (d >> (64 - 25));
+        a += d;
+        b ^= a;
+        a = (a << 63) | (a >> (64 - 63));
+        b += a;
+    }
+    return a + b + c + d;
+}
+
+static int
+hash_bench(void) {
+    const uint64_t BYTES = 64 * 1024 * 1024, LENS[] = {8, 64, 1024};
+    uint64_t (*const fns[])(const void *, uint64_t) = {bytewise_hash, hash_portable, hash};
+    const char *const names[] = {"bytewise", "portable", hash_backend()};
+    uint64_t i, j, l, n, t, sum;
+    char key[1024];
+
+    memset(key, 'k', sizeof(key));
+    sum = 0;
+    for (l = 0; l < (sizeof(LENS) / sizeof(LENS[0])); ++l) {
+        n = BYTES / LENS[l];
+        for (j = 0; j < (sizeof(fns) / sizeof(fns[0])); ++j) {
+            t = ref_time();
+            for (i = 0; i < n; ++i) {
+                memcpy(key, &i, sizeof(i));
+                sum += fns[j](key, LENS[l]);
+            }
+            t = ref_time() - t;
+            printf("\t hash %4lu B keys %-8s %8.1f ns/key %8.0f MB/s\n",
+                   LENS[l],
+                   names[j],
+                   1e3 * (double)t / (double)n,
+                   (double)BYTES / MAX(t, 1));
+        }
+    }
+    return sum ? 0 : -1;
+}
+
+static int
+index_bench(void) {
+    const uint64_t N = 10000000;
+    struct image image;
+    struct index *index;
+    uint64_t i, j, k, t, now, last, worst, *off;
+    u64 len;
+    u8 *buf;
+
+    /* 8 byte binary keys, inserted in order, looked up in a scattered order */
+
+    for (j = 0; j < 2; ++j) {
+        if (!(index = index_open()) || (j && index_reserve(index, N))) {
+            index_close(index);
+            TRACE(0);
+            return -1;
+        }
+        worst = 0;
+        t = now = ref_time();
+        for (i = 0; i < N; ++i) {
+            k = i + 1;
+            if (!(off = index_update(index, &k, sizeof(k)))) {
+                index_close(index);
+                TRACE(0);
+                return -1;
+            }
+            (*off) = k;
+            last = now;
+            now = ref_time();
+            worst = MAX(worst, now - last);
+        }
+        t = ref_time() - t;
+        printf("\t index_update %10.0f ops/s, worst %lu us (%s)\n",
+               1e6 * (double)N / MAX(t, 1),
+               worst,
+               j ? "pre-sized" : "grown");
+        if (!j) {
+            index_close(index);
+        }
+    }
+    for (j = 0; j < 2; ++j) {
+        t = ref_time();
+        for (i = 0; i < N; ++i) {
+            k = (i * 7919 % N) + 1 + (j ? N : 0);
+            off = index_lookup(index, (const char *)&k, sizeof(k));
+            if (j ? (off && (k == (*off))) : (!off || (k != (*off)))) {
+                index_close(index);
+                TRACE("software");
+                return -1;
+            }
+        }
+        t = ref_time() - t;
+        printf("\t index_lookup %10.0f ops/s (%s)\n",
+               1e6 * (double)N / MAX(t, 1),
+               j ? "missing" : "present");
+    }
+
+    /* a saved copy of the full index, attached then paged in */
+
+    if (!(buf = index_serialize(index, &len))) {
+        index_close(index);
+        TRACE(0);
+        return -1;
+    }
+    index_close(index);
+    memset(&image, 0, sizeof(image));
+    image.buf = buf;
+    t = ref_time();
+    k = 1;
+    if (!(index = index_attach(len, fetch_image, &image)) ||
+        (index_find(index, (const char *)&k, sizeof(k)) != k)) {
+        index_close(index);
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    t = ref_time() - t;
+    printf("\t index_attach %10.1f ms to the first lookup (%lu MB)\n", 1e-3 * t, (unsigned long)(len >> 20));
+    t = ref_time();
+    if (+1 != index_warm(index, UINT64_MAX)) {
+        index_close(index);
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    t = ref_time() - t;
+    printf("\t index_warm   %10.1f ms\n", 1e-3 * t);
+    index_close(index);
+    FREE(buf);
+    return 0;
+}
+
+static int
+scan_bench(void) {
+    const uint64_t N = 200000, SCANS = 20000, RANGE = 10;
+    struct kvdb_options options;
+    struct kvdb_iter *iter;
+    char key[32], val[16];
+    struct kvdb *kvdb;
+    uint64_t i, j, n, t, val_len;
+    int r;
+
+    memset(val, 'v', sizeof(val));
+
+    /* the cost of keeping the keys in order, then full and short scans */
+
+    for (j = 0; j < 2; ++j) {
+        memset(&options, 0, sizeof(options));
+        options.ordered = (int)j;
+        if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+            TRACE(0);
+            return -1;
+        }
+        t = ref_time();
+        for (i = 0; i < N; ++i) {
+            safe_sprintf(key, sizeof(key), "user%010lu", (unsigned long)(i * 7919 % N));
+            if (kvdb_update(kvdb, key, SLEN(key), val, sizeof(val))) {
+                kvdb_close(kvdb);
+                TRACE(0);
+                return -1;
+            }
+        }
+        t = ref_time() - t;
+        printf("\t scan update   %10.0f ops/s (%s)\n",
+               1e6 * (double)N / MAX(t, 1),
+               j ? "ordered" : "hash only");
+        if (j) {
+            break;
+        }
+        kvdb_close(kvdb);
+    }
+    if (!(iter = kvdb_iter_open(kvdb, "user", 4))) {
+        kvdb_close(kvdb);
+        TRACE(0);
+        return -1;
+    }
+    n = 0;
+    t = ref_time();
+    for (r = kvdb_iter_seek(iter, NULL, 0); !r; r = kvdb_iter_next(iter)) {
+        ++n;
+    }
+    t = ref_time() - t;
+    printf("\t scan keys     %10.0f keys/s\n", 1e6 * (double)n / MAX(t, 1));
+    if (N != n) {
+        kvdb_iter_close(iter);
+        kvdb_close(kvdb);
+        TRACE("software");
+        return -1;
+    }
+    t = ref_time();
+    for (i = 0; i < SCANS; ++i) {
+        safe_sprintf(key, sizeof(key), "user%010lu", (unsigned long)(i * 7919 % N));
+        r = kvdb_iter_seek(iter, key, SLEN(key));
+        for (j = 0; !r && (j < RANGE); ++j) {
+            val_len = sizeof(val);
+            if (kvdb_iter_value(iter, val, &val_len)) {
+                kvdb_iter_close(iter);
+                kvdb_close(kvdb);
+                TRACE(0);
+                return -1;
+            }
+            r = kvdb_iter_next(iter);
+        }
+    }
+    t = ref_time() - t;
+    printf("\t scan range    %10.0f scans/s, %lu keys with values each\n",
+           1e6 * (double)SCANS / MAX(t, 1),
+           RANGE);
+    kvdb_iter_close(iter);
+    kvdb_close(kvdb);
+    return 0;
+}
+
+static int
+readmissing_bench(void) {
+    const uint64_t N = 100000, M = 1000000, BITS[] = {1, 4, 10, 16};
+    struct kvdb_options options;
+    struct kvdb_stats stats;
+    struct kvdb *kvdb;
+    uint64_t i, j, t;
+    char key[32];
+
+    /* cache-aside probing for keys that are not there */
+
+    for (j = 0; j < ARRAY_SIZE(BITS); ++j) {
+        memset(&options, 0, sizeof(options));
+        options.bloom_bits = BITS[j];
+        if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+            TRACE(0);
+            return -1;
+        }
+        for (i = 0; i < N; ++i) {
+            safe_sprintf(key, sizeof(key), "present%lu", (unsigned long)i);
+            if (kvdb_update(kvdb, key, SLEN(key), key, SLEN(key))) {
+                kvdb_close(kvdb);
+                TRACE(0);
+                return -1;
+            }
+        }
+        t = ref_time();
+        for (i = 0; i < M; ++i) {
+            safe_sprintf(key, sizeof(key), "missing%lu", (unsigned long)i);
+            if (+1 != kvdb_lookup(kvdb, key, SLEN(key), NULL, NULL)) {
+                kvdb_close(kvdb);
+                TRACE("software");
+                return -1;
+            }
+        }
+        t = ref_time() - t;
+        kvdb_stats(kvdb, &stats);
+        printf("\t readmissing %10.0f ops/s, %2lu bits/key, %5.2f%% false positives\n",
+               1e6 * (double)M / MAX(t, 1),
+               BITS[j],
+               100.0 * stats.bloom_fp_rate);
+        kvdb_close(kvdb);
+    }
+    return 0;
+}
+
+static int
+multiget_bench(void) {
+    const uint64_t N = 300000, BATCHES = 2000, FANOUTS[] = {10, 100, 500};
+    struct kvdb_get *gets;
+    struct kvdb *kvdb;
+    uint64_t i, j, f, seed, t[2], val_len;
+    char *keys, *vals, val[128];
+
+    gets = malloc(500 * sizeof(gets[0]));
+    keys = malloc(500 * 32);
+    vals = malloc(500 * 128);
+    if (!gets || !keys || !vals || !(kvdb = kvdb_open(PATHNAME))) {
+        FREE(gets);
+        FREE(keys);
+        FREE(vals);
+        TRACE(0);
+        return -1;
+    }
+    memset(val, 'v', sizeof(val));
+    for (i = 0; i < N; ++i) {
+        safe_sprintf(keys, 32, "multi%lu", (unsigned long)i);
+        if (kvdb_update(kvdb, keys, SLEN(keys), val, 100)) {
+            EXIT("update");
+        }
+    }
+
+    /* random keys over a log far larger than the cache, one by one or together */
+
+    for (f = 0; f < ARRAY_SIZE(FANOUTS); ++f) {
+        seed = 1;
+        t[0] = t[1] = 0;
+        for (i = 0; i < BATCHES * 10 / FANOUTS[f]; ++i) {
+            for (j = 0; j < FANOUTS[f]; ++j) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                safe_sprintf(keys + j * 32, 32, "multi%lu", (unsigned long)((seed >> 33) % N));
+                gets[j].key = keys + j * 32;
+                gets[j].key_len = SLEN(keys + j * 32);
+                gets[j].val = vals + j * 128;
+                gets[j].val_len = 128;
+            }
+            t[0] -= ref_time();
+            for (j = 0; j < FANOUTS[f]; ++j) {
+                val_len = sizeof(val);
+                if (kvdb_lookup(kvdb, gets[j].key, gets[j].key_len, val, &val_len)) {
+                    EXIT("lookup");
+                }
+            }
+            t[0] += ref_time();
+
+            /* other keys, so the first pass did not warm the cache for them */
+
+            for (j = 0; j < FANOUTS[f]; ++j) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                safe_sprintf(keys + j * 32, 32, "multi%lu", (unsigned long)((seed >> 33) % N));
+                gets[j].key_len = SLEN(keys + j * 32);
+            }
+            t[1] -= ref_time();
+            if (kvdb_multi_lookup(kvdb, gets, FANOUTS[f])) {
+                EXIT("multi_lookup");
+            }
+            t[1] += ref_time();
+            for (j = 0; j < FANOUTS[f]; ++j) {
+                if (gets[j].result) {
+                    EXIT("multi_lookup");
+                }
+            }
+        }
+        printf("	 multiget %3lu keys: %8.1f us one by one, %8.1f us batched (%.1fx)\n",
+               (unsigned long)FANOUTS[f],
+               (double)t[0] / i,
+               (double)t[1] / i,
+               (double)t[0] / MAX(t[1], 1));
+    }
+    kvdb_close(kvdb);
+    FREE(gets);
+    FREE(keys);
+    FREE(vals);
+    return 0;
+}
+
+static int
+compress_bench(void) {
+    const uint64_t N = 20000, LEN = 1000;
+    struct kvdb_options options;
+    struct kvdb_stats stats;
+    uint64_t i, j, k, t, w, val_len;
+    char key[32], *val, *noise;
+    struct kvdb *kvdb;
+
+    if (!(val = malloc(LEN)) || !(noise = malloc(LEN))) {
+        FREE(val);
+        TRACE("out of memory");
+        return -1;
+    }
+    for (i = 0; i < LEN; ++i) {
+        noise[i] = (char)rand();
+    }
+
+    /* text and noise, with the codec off and on */
+
+    for (j = 0; j < 2; ++j) {
+        for (k = 0; k < 2; ++k) {
+            memset(&options, 0, sizeof(options));
+            options.compress_min = k ? 64 : 0;
+            if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+                FREE(val);
+                FREE(noise);
+                TRACE(0);
+                return -1;
+            }
+            t = ref_time();
+            for (i = 0; i < N; ++i) {
+                safe_sprintf(key, sizeof(key), "key%lu", (unsigned long)i);
+                if (j) {
+                    noise[i % LEN] ^= (char)i;
+                } else {
+                    mk_json(val, LEN, i);
+                }
+                if (kvdb_update(kvdb, key, SLEN(key), j ? noise : val, LEN)) {
+                    kvdb_close(kvdb);
+                    FREE(val);
+                    FREE(noise);
+                    TRACE(0);
+                    return -1;
+                }
+            }
+            w = ref_time() - t;
+            t = ref_time();
+            for (i = 0; i < N; ++i) {
+                safe_sprintf(key, sizeof(key), "key%lu", (unsigned long)((i * 7919) % N));
+                val_len = LEN;
+                if (kvdb_lookup(kvdb, key, SLEN(key), val, &val_len) || (LEN != val_len)) {
+                    kvdb_close(kvdb);
+                    FREE(val);
+                    FREE(noise);
+                    TRACE("software");
+                    return -1;
+                }
+            }
+            t = ref_time() - t;
+            kvdb_stats(kvdb, &stats);
+            printf("\t %-5s %-3s %8.0f writes/s %8.0f reads/s %6.1f MB log (%4.2fx)\n",
+                   j ? "noise" : "text",
+                   k ? "lz" : "raw",
+                   1e6 * (double)N / MAX(w, 1),
+                   1e6 * (double)N / MAX(t, 1),
+                   stats.log_bytes / 1e6,
+                   (double)(N * LEN) / MAX(stats.log_bytes, 1));
+            kvdb_close(kvdb);
+        }
+    }
+    FREE(val);
+    FREE(noise);
+    return 0;
+}
+
+static int
+recover_bench(void) {
+    const uint64_t SIZE = 32 * 1024 * 1024, LEN = 1000, UNIT = 1024 * 1024;
+    uint64_t i, n, off, size, t;
+    struct device *device;
+    struct kvraw *kvraw;
+    char key[32], *buf;
+
+    if (!(buf = aligned_alloc(4096, UNIT))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    for (i = 0; i < UNIT; ++i) {
+        buf[i] = (char)rand();
+    }
+    for (i = 0; i < 2; ++i) {
+        t = ref_time();
+        for (n = 0; n < 256; ++n) {
+            off = i ? crc32c_portable(0, buf, UNIT) : crc32c(0, buf, UNIT);
+        }
+        t = ref_time() - t;
+        printf("\t crc32c %-8s %6.2f GB/s\n",
+               i ? "portable" : crc32c_backend(),
+               1e-3 * 256 * UNIT / MAX(t, 1));
+    }
+
+    /* a log of 1KB records, then a cold scan of all of it */
+
+    if (!(kvraw = kvraw_open(PATHNAME, false, NULL))) {
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    for (i = 0; kvraw_size(kvraw) < SIZE; ++i) {
+        safe_sprintf(key, sizeof(key), "key%lu", (unsigned long)i);
+        off = 0;
+        if (kvraw_append(kvraw, key, SLEN(key), buf + (i % 1000), LEN, &off)) {
+            kvraw_close(kvraw);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+    size = kvraw_size(kvraw);
+    if (kvraw_sync(kvraw, size)) {
+        kvraw_close(kvraw);
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    n = off = 0;
+    t = ref_time();
+    if (kvraw_recover(kvraw, &off, size, count_record, &n) || (off != size)) {
+        kvraw_close(kvraw);
+        FREE(buf);
+        TRACE("software");
+        return -1;
+    }
+    t = ref_time() - t;
+    printf("\t recover  %8.1f MB/s %8.0f records/s\n",
+           (double)size / MAX(t, 1),
+           1e6 * (double)n / MAX(t, 1));
+    kvraw_close(kvraw);
+
+    /* the same bytes straight off the device, for reference */
+
+    if (!(device = device_open(PATHNAME))) {
+        FREE(buf);
+        TRACE(0);
+        return -1;
+    }
+    t = ref_time();
+    for (off = 0; off < size; off += UNIT) {
+        if (device_read(device, buf, device_block(device) + off, UNIT)) {
+            device_close(device);
+            FREE(buf);
+            TRACE(0);
+            return -1;
+        }
+    }
+    t = ref_time() - t;
+    printf("\t device   %8.1f MB/s\n", (double)size / MAX(t, 1));
+    device_close(device);
+    FREE(buf);
+    return 0;
+}
+
+/* n writes from key start on, each batch synced, then a clean close or none */
+
+static int
+restart_fill(uint64_t n, uint64_t start, int clean) {
+    const uint64_t BATCH = 1000;
+    struct kvdb_options options;
+    struct kvdb_op ops[1000];
+    struct kvdb *kvdb;
+    char *keys, val[100];
+    uint64_t i, j;
+
+    memset(&options, 0, sizeof(options));
+    options.persistent = 1;
+    options.sync = KVDB_SYNC_BATCH;
+    if (!(keys = malloc(BATCH * 16))) {
+        TRACE("out of memory");
+        return -1;
+    }
+    if (!(kvdb = kvdb_open_options(PATHNAME, &options))) {
+        FREE(keys);
+        TRACE(0);
+        return -1;
+    }
+    memset(val, 'v', sizeof(val));
+    for (i = 0; i < n; i += BATCH) {
+        for (j = 0; j < BATCH; ++j) {
+            safe_sprintf(keys + j * 16, 16, "r%lu", (unsigned long)(start + i + j));
+            ops[j].type = KVDB_OP_UPDATE;
+            ops[j].key = keys + j * 16;
+            ops[j].key_len = SLEN(keys + j * 16);
+            ops[j].val = val;
+            ops[j].val_len = sizeof(val);
+        }
+        if (kvdb_write_batch(kvdb, ops, BATCH)) {
+            kvdb_close(kvdb);
+            FREE(keys);
+            TRACE(0);
+            return -1;
+        }
+    }
+    if (clean) {
+        kvdb_close(kvdb);
+    }
+    FREE(keys);
+    return 0;
+}
+
+static int
+restart_bench(void) {
+    const uint64_t SINCE = 20000, KEYS[] = {10000, 200000};
+    struct kvdb_stats stats;
+    struct kvdb *kvdb;
+    int status, pass;
+    uint64_t t;
+    pid_t pid;
+
+    /**
+     * A clean close checkpoints; then a crash after the same number of
+     * writes. Open time follows the log past the checkpoint, whatever the
+     * size of the kvdb.
+     */
+
+    for (pass = 0; pass < 2; ++pass) {
+        if (!(kvdb = kvdb_open(PATHNAME))) {
+            TRACE(0);
+            return -1;
+        }
+        kvdb_close(kvdb);
+        if (0 > (pid = fork())) {
+            TRACE("fork()");
+            return -1;
+        }
+        if (!pid) {
+            _exit((restart_fill(KEYS[pass], 0, 1) || restart_fill(SINCE, KEYS[pass], 0)) ? 1 : 0);
+        }
+        if ((pid != waitpid(pid, &status, 0)) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            TRACE("child");
+            return -1;
+        }
+        t = ref_time();
+        if (!(kvdb = kvdb_open_persistent(PATHNAME))) {
+            TRACE(0);
+            return -1;
+        }
+        t = ref_time() - t;
+        kvdb_stats(kvdb, &stats);
+        printf("\t keys %8lu replayed %6.1f MB open %8.1f ms\n",
+               (unsigned long)kvdb_size(kvdb),
+               1e-6 * stats.replay_bytes,
+               1e-3 * t);
+        if ((KEYS[pass] + SINCE) != kvdb_size(kvdb)) {
+            kvdb_close(kvdb);
+            TRACE("lost keys");
+            return -1;
+        }
+        kvdb_close(kvdb);
+    }
+    return 0;
+}
+
+static int
+batch_bench(void) {
+    const uint64_t N = 200000, BATCH = 1000;
+    struct kvdb_op *ops;
+    struct kvdb *kvdb;
+    uint64_t i, j, t;
+    char *keys, val[16];
+    int pass;
+
+    if (!(ops = malloc(BATCH * sizeof(ops[0]))) || !(keys = malloc(BATCH * 16))) {
+        FREE(ops);
+        TRACE("out of memory");
+        return -1;
+    }
+    memset(val, 'v', sizeof(val));
+
+    /* the same small-key load, one call per key, then one call per batch */
+
+    for (pass = 0; pass < 2; ++pass) {
+        if (!(kvdb = kvdb_open(PATHNAME))) {
+            FREE(ops);
+            FREE(keys);
+            TRACE(0);
+            return -1;
+        }
+        t = ref_time();
+        for (i = 0; i < N; i += BATCH) {
+            for (j = 0; j < BATCH; ++j) {
+                safe_sprintf(keys + j * 16, 16, "k%lu", (unsigned long)(i + j));
+                ops[j].type = KVDB_OP_INSERT;
+                ops[j].key = keys + j * 16;
+                ops[j].key_len = SLEN(keys + j * 16);
+                ops[j].val = val;
+                ops[j].val_len = sizeof(val);
+                if (!pass && kvdb_insert(kvdb, ops[j].key, ops[j].key_len, val, sizeof(val))) {
+                    EXIT("insert");
+                }
+            }
+            if (pass && kvdb_write_batch(kvdb, ops, BATCH)) {
+                EXIT("write_batch");
+            }
+        }
+        t = ref_time() - t;
+        printf("\t %-12s %10.0f inserts/s\n",
+               pass ? "write_batch" : "insert",
+               1e6 * (double)N / MAX(t, 1));
+        kvdb_close(kvdb);
+    }
+    FREE(ops);
+    FREE(keys);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if ((2 != argc) && ((3 != argc) || strcmp(argv[2], "bench"))) {
+        printf("usage: %s block-device [bench]\n", argv[0]);
+        return -1;
+    }
+
+    /* initialize */
+
+    PATHNAME = argv[1];
+    term_init(0);
+
+    if (3 == argc) {
+        term_bold();
+        term_color(TERM_COLOR_BLUE);
+        printf("---------- BENCH BEG ----------\n");
+        term_reset();
+        TEST(device_bench, "device_bench");
+        TEST(read_bench, "read_bench");
+        TEST(admission_bench, "admission_bench");
+        TEST(append_bench, "append_bench");
+        TEST(readrandom_bench, "readrandom");
+        TEST(lookup_ref_bench, "lookup_ref_bench");
+        TEST(readwhilewriting_bench, "readwhilewriting");
+        TEST(hash_bench, "hash_bench");
+        TEST(index_bench, "index_bench");
+        TEST(batch_bench, "batch_bench");
+        TEST(sync_bench, "sync_bench");
+        TEST(scan_bench, "scan_bench");
+        TEST(readmissing_bench, "readmissing");
+        TEST(multiget_bench, "multiget_bench");
+        TEST(compress_bench, "compress_bench");
+        TEST(recover_bench, "recover_bench");
+        TEST(restart_bench, "restart_bench");
+        term_bold();
+        term_color(TERM_COLOR_BLUE);
+        printf("---------- BENCH END ----------\n");
+        term_reset();
+        return 0;
+    }
 
     /* prelude */
 
@@ -340,11 +3362,30 @@ int main(int argc, char *argv[]) {
 
     /* test */
 
+    TEST(read_cache, "read_cache");
+    TEST(admission, "admission");
     TEST(basic_logic, "basic_logic");
-    // TEST(heavy_rewrite, "heavy_rewrite");
-    // TEST(read_write_single, "read_write_single");
-    // TEST(read_write_small, "read_write_small");
-    // TEST(read_write_large, "read_write_large");
+    TEST(heavy_rewrite, "heavy_rewrite");
+    TEST(read_write_single, "read_write_single");
+    TEST(read_write_small, "read_write_small");
+    TEST(read_write_large, "read_write_large");
+    TEST(write_batch, "write_batch");
+    TEST(concurrent_writers, "concurrent_writers");
+    TEST(sync_writers, "sync_writers");
+    TEST(lookup_ref, "lookup_ref");
+    TEST(compaction, "compaction");
+    TEST(compaction_wrap, "compaction_wrap");
+    TEST(index_resize, "index_resize");
+    TEST(hash_quality, "hash_quality");
+    TEST(ordered_scan, "ordered_scan");
+    TEST(bloom_filter, "bloom_filter");
+    TEST(compression, "compression");
+    TEST(checksums, "checksums");
+    TEST(append_failure, "append_failure");
+    TEST(persistence, "persistence");
+    TEST(memtable, "memtable");
+    TEST(multi_lookup, "multi_lookup");
+    TEST(statistics, "statistics");
 
     /* postlude */
 
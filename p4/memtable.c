@@ -0,0 +1,274 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * memtable.c
+ */
+
+#include <pthread.h>
+
+#include "memtable.h"
+
+#define STRIPES 64
+/* bytes of budget per bucket, about one entry of a small key and value */
+#define BUCKET_BYTES 128
+#define MIN_BUCKETS 1024
+/* a value larger than this fraction of the budget is not kept */
+#define MAX_FRACTION 8
+
+/**
+ * An entry is on the chain of its bucket, for lookups, and on the list of
+ * all entries in the order they were written, for eviction. The key is
+ * followed by the value.
+ */
+struct entry {
+    struct entry *next;
+    struct entry *older;
+    struct entry *newer;
+    uint64_t hash;
+    uint64_t off;
+    uint64_t key_len;
+    uint64_t val_len;
+    char data[];
+};
+
+/* one per cache line so readers on different stripes do not share lines */
+struct stripe {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
+/**
+ * Readers hold the stripe of the bucket they look in, the writer holds it
+ * to change the chain. Only the writer walks the list, so it needs no lock.
+ */
+struct memtable {
+    uint64_t budget;
+    uint64_t bytes; /* of the entries, headers included */
+    uint64_t mask; /* buckets - 1 */
+    struct entry **buckets;
+    struct entry *oldest;
+    struct entry *newest;
+    struct stripe stripes[STRIPES];
+};
+
+static inline uint64_t
+entry_bytes(const struct entry *entry) {
+    return sizeof(struct entry) + entry->key_len + entry->val_len;
+}
+
+static inline uint64_t
+bucket(const struct memtable *memtable, uint64_t hash) {
+    /* the slot key keeps the length in its low bits, the hash above */
+    return (hash >> 16) & memtable->mask;
+}
+
+static inline struct stripe *
+stripe(struct memtable *memtable, uint64_t b) {
+    return &memtable->stripes[b % STRIPES];
+}
+
+struct memtable *
+memtable_open(uint64_t budget) {
+    pthread_rwlockattr_t attr;
+    struct memtable *memtable;
+    uint64_t i, n;
+
+    assert(budget);
+
+    if (!(memtable = aligned_alloc(64, sizeof(struct memtable)))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(memtable, 0, sizeof(struct memtable));
+    memtable->budget = budget;
+    for (n = MIN_BUCKETS; n < budget / BUCKET_BYTES; n <<= 1) {
+    }
+    memtable->mask = n - 1;
+    if (!(memtable->buckets = calloc(n, sizeof(struct entry *)))) {
+        FREE(memtable);
+        TRACE("out of memory");
+        return NULL;
+    }
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (i = 0; i < STRIPES; ++i) {
+        pthread_rwlock_init(&memtable->stripes[i].lock, &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+    return memtable;
+}
+
+void
+memtable_close(struct memtable *memtable) {
+    struct entry *entry, *older;
+    uint64_t i;
+
+    if (memtable) {
+        for (entry = memtable->newest; entry; entry = older) {
+            older = entry->older;
+            FREE(entry);
+        }
+        for (i = 0; i < STRIPES; ++i) {
+            pthread_rwlock_destroy(&memtable->stripes[i].lock);
+        }
+        FREE(memtable->buckets);
+        memset(memtable, 0, sizeof(struct memtable));
+    }
+    FREE(memtable);
+}
+
+/* takes entry off the list, the caller has taken it off its chain */
+
+static void
+unlist(struct memtable *memtable, struct entry *entry) {
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        memtable->oldest = entry->newer;
+    }
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        memtable->newest = entry->older;
+    }
+    __atomic_store_n(&memtable->bytes, memtable->bytes - entry_bytes(entry), __ATOMIC_RELAXED);
+    FREE(entry);
+}
+
+/**
+ * Puts entry, or nothing if it is NULL, in place of the entry of key on the
+ * chain of bucket b. Returns the entry replaced, or NULL.
+ */
+
+static struct entry *
+swap(struct memtable *memtable,
+     uint64_t b,
+     uint64_t hash,
+     const void *key,
+     uint64_t key_len,
+     struct entry *entry) {
+    struct entry **link, *old;
+
+    pthread_rwlock_wrlock(&stripe(memtable, b)->lock);
+    for (link = &memtable->buckets[b]; (old = (*link)); link = &old->next) {
+        if ((old->hash == hash) &&
+            (old->key_len == key_len) &&
+            !memcmp(old->data, key, key_len)) {
+            (*link) = old->next;
+            break;
+        }
+    }
+    if (entry) {
+        entry->next = memtable->buckets[b];
+        memtable->buckets[b] = entry;
+    }
+    pthread_rwlock_unlock(&stripe(memtable, b)->lock);
+    return old;
+}
+
+void
+memtable_put(struct memtable *memtable,
+             uint64_t hash,
+             const void *key,
+             uint64_t key_len,
+             const void *val,
+             uint64_t val_len,
+             uint64_t off) {
+    struct entry *entry, *old;
+    uint64_t b;
+
+    assert(memtable);
+    assert(key && key_len);
+    assert(!val_len || val);
+
+    entry = NULL;
+    if ((val_len <= (memtable->budget / MAX_FRACTION)) &&
+        (entry = malloc(sizeof(struct entry) + key_len + val_len))) {
+        entry->hash = hash;
+        entry->off = off;
+        entry->key_len = key_len;
+        entry->val_len = val_len;
+        memcpy(entry->data, key, key_len);
+        if (val_len) {
+            memcpy(entry->data + key_len, val, val_len);
+        }
+    }
+    b = bucket(memtable, hash);
+    if ((old = swap(memtable, b, hash, key, key_len, entry))) {
+        unlist(memtable, old);
+    }
+    if (entry) {
+        entry->older = memtable->newest;
+        entry->newer = NULL;
+        if (memtable->newest) {
+            memtable->newest->newer = entry;
+        } else {
+            memtable->oldest = entry;
+        }
+        memtable->newest = entry;
+        __atomic_store_n(&memtable->bytes, memtable->bytes + entry_bytes(entry), __ATOMIC_RELAXED);
+    }
+}
+
+int /* 0|+1 */
+memtable_get(struct memtable *memtable,
+             uint64_t hash,
+             const void *key,
+             uint64_t key_len,
+             void *val,
+             uint64_t *val_len) {
+    struct entry *entry;
+    struct stripe *s;
+    uint64_t b;
+
+    assert(memtable);
+    assert(key && key_len);
+    assert(val_len && (!(*val_len) || val));
+
+    b = bucket(memtable, hash);
+    s = stripe(memtable, b);
+    pthread_rwlock_rdlock(&s->lock);
+    for (entry = memtable->buckets[b]; entry; entry = entry->next) {
+        if ((entry->hash == hash) &&
+            (entry->key_len == key_len) &&
+            !memcmp(entry->data, key, key_len)) {
+            if (val) {
+                memcpy(val, entry->data + key_len, MIN(entry->val_len, (*val_len)));
+            }
+            (*val_len) = entry->val_len;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return entry ? 0 : +1;
+}
+
+int
+memtable_full(const struct memtable *memtable) {
+    assert(memtable);
+
+    return memtable->bytes > memtable->budget;
+}
+
+void
+memtable_evict(struct memtable *memtable, uint64_t flushed) {
+    struct entry *entry;
+
+    assert(memtable);
+
+    while ((entry = memtable->oldest) &&
+           (memtable->bytes > memtable->budget) &&
+           (entry->off < flushed)) {
+        swap(memtable, bucket(memtable, entry->hash), entry->hash, entry->data, entry->key_len, NULL);
+        unlist(memtable, entry);
+    }
+}
+
+uint64_t
+memtable_bytes(const struct memtable *memtable) {
+    assert(memtable);
+
+    return __atomic_load_n(&memtable->bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,74 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * memtable.h
+ */
+
+#ifndef _MEMTABLE_H_
+#define _MEMTABLE_H_
+
+#include "system.h"
+
+/*
+ * The keys and values of the most recent writes, a removal as an empty
+ * value, so that reading what was just written does not go to the log.
+ * Lookups are safe against a single writer calling the rest.
+ *
+ * Every call takes the hash of the key, which the caller has at hand.
+ */
+
+struct memtable;
+
+/* budget: bytes of keys and values kept, give or take what is not flushed */
+
+struct memtable *memtable_open(uint64_t budget);
+
+void memtable_close(struct memtable *memtable);
+
+/**
+ * Makes key map to val, which is a removal if val_len is 0, for the record
+ * at off. A value too large to be worth keeping, or no memory for it, takes
+ * the key out instead.
+ */
+
+void memtable_put(struct memtable *memtable,
+                  uint64_t hash,
+                  const void *key,
+                  uint64_t key_len,
+                  const void *val,
+                  uint64_t val_len,
+                  uint64_t off);
+
+/**
+ * Copies up to (*val_len) bytes of the value of key into val and sets
+ * (*val_len) to its length, 0 if the key was removed.
+ *
+ * return: 0 if the memtable knows the key, +1 if the log has to be asked
+ */
+
+int /* 0|+1 */
+memtable_get(struct memtable *memtable,
+             uint64_t hash,
+             const void *key,
+             uint64_t key_len,
+             void *val,
+             uint64_t *val_len); /* in/out */
+
+/* true once the memtable is past its budget */
+
+int memtable_full(const struct memtable *memtable);
+
+/**
+ * Drops the oldest writes, while past the budget, as long as their records
+ * start before flushed and so no longer have to be read from the write
+ * buffer.
+ */
+
+void memtable_evict(struct memtable *memtable, uint64_t flushed);
+
+uint64_t memtable_bytes(const struct memtable *memtable);
+
+#endif /* _MEMTABLE_H_ */
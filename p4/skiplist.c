@@ -0,0 +1,252 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * skiplist.c
+ */
+
+#include "skiplist.h"
+
+#include <pthread.h>
+
+/* with one in four nodes promoted, enough for billions of keys */
+#define MAX_HEIGHT 16
+
+/* the key follows next[height] in the same allocation */
+struct skiplist_node {
+    uint64_t key_len;
+    int height;
+    struct skiplist_node *next[];
+};
+
+/**
+ * The writer holds the lock exclusively while it links or unlinks a node,
+ * readers hold it shared while they walk. A removal bumps version, which
+ * tells a cursor that the node it stopped at may be gone and that it has
+ * to find its way back by key.
+ */
+struct skiplist {
+    pthread_rwlock_t lock;
+    struct skiplist_node *head;
+    uint64_t size;
+    uint64_t version;
+};
+
+#define KEY(node) ((const char *)&(node)->next[(node)->height])
+
+static int
+compare(const struct skiplist_node *node, const void *key, uint64_t key_len) {
+    int d;
+
+    if ((d = memcmp(KEY(node), key, MIN(node->key_len, key_len)))) {
+        return d;
+    }
+    return (node->key_len < key_len) ? -1 : (node->key_len > key_len);
+}
+
+/**
+ * Returns the first node at or after key, or past it. prev, if not NULL,
+ * receives the last node before that point on every level.
+ */
+
+static struct skiplist_node *
+find(const struct skiplist *skiplist,
+     const void *key,
+     uint64_t key_len,
+     int past,
+     struct skiplist_node **prev) {
+    struct skiplist_node *node, *next;
+    int level;
+
+    node = skiplist->head;
+    for (level = MAX_HEIGHT - 1; 0 <= level; --level) {
+        while ((next = node->next[level]) &&
+               (compare(next, key, key_len) < (past ? 1 : 0))) {
+            node = next;
+        }
+        if (prev) {
+            prev[level] = node;
+        }
+    }
+    return node->next[0];
+}
+
+static int
+copy(struct skiplist *skiplist,
+     struct skiplist_cursor *cursor,
+     const struct skiplist_node *node,
+     void *out,
+     uint64_t *out_len) {
+    cursor->node = node;
+    cursor->version = skiplist->version;
+    if (!node) {
+        return +1;
+    }
+    memcpy(out, KEY(node), node->key_len);
+    (*out_len) = node->key_len;
+    return 0;
+}
+
+struct skiplist *
+skiplist_open(void) {
+    struct skiplist *skiplist;
+
+    if (!(skiplist = malloc(sizeof(struct skiplist)))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    memset(skiplist, 0, sizeof(struct skiplist));
+    if (!(skiplist->head = skiplist_node("", 0))) {
+        FREE(skiplist);
+        TRACE(0);
+        return NULL;
+    }
+    pthread_rwlock_init(&skiplist->lock, NULL);
+    return skiplist;
+}
+
+void
+skiplist_close(struct skiplist *skiplist) {
+    struct skiplist_node *node, *next;
+
+    if (skiplist) {
+        for (node = skiplist->head; node; node = next) {
+            next = node->next[0];
+            FREE(node);
+        }
+        pthread_rwlock_destroy(&skiplist->lock);
+        memset(skiplist, 0, sizeof(struct skiplist));
+    }
+    FREE(skiplist);
+}
+
+struct skiplist_node *
+skiplist_node(const void *key, uint64_t key_len) {
+    static __thread uint64_t seed = 0x2545f4914f6cdd1dULL;
+    struct skiplist_node *node;
+    int height;
+
+    /* head nodes have every level, the rest one in four of the level below */
+
+    height = MAX_HEIGHT;
+    if (key_len) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        for (height = 1; (height < MAX_HEIGHT) && !((seed >> (2 * height)) & 3); ++height) {
+        }
+    }
+    if (!(node = malloc(sizeof(struct skiplist_node) + height * sizeof(node->next[0]) + key_len))) {
+        TRACE("out of memory");
+        return NULL;
+    }
+    node->key_len = key_len;
+    node->height = height;
+    memset(node->next, 0, height * sizeof(node->next[0]));
+    memcpy((char *)KEY(node), key, key_len);
+    return node;
+}
+
+void
+skiplist_free(struct skiplist_node *node) {
+    FREE(node);
+}
+
+void
+skiplist_insert(struct skiplist *skiplist, struct skiplist_node *node) {
+    struct skiplist_node *prev[MAX_HEIGHT], *next;
+    int level;
+
+    assert(skiplist && node);
+
+    pthread_rwlock_wrlock(&skiplist->lock);
+    next = find(skiplist, KEY(node), node->key_len, 0, prev);
+    if (next && !compare(next, KEY(node), node->key_len)) {
+        pthread_rwlock_unlock(&skiplist->lock);
+        FREE(node);
+        return;
+    }
+    for (level = 0; level < node->height; ++level) {
+        node->next[level] = prev[level]->next[level];
+        prev[level]->next[level] = node;
+    }
+    ++skiplist->size;
+    pthread_rwlock_unlock(&skiplist->lock);
+}
+
+void
+skiplist_remove(struct skiplist *skiplist, const void *key, uint64_t key_len) {
+    struct skiplist_node *prev[MAX_HEIGHT], *node;
+    int level;
+
+    assert(skiplist && key);
+
+    pthread_rwlock_wrlock(&skiplist->lock);
+    node = find(skiplist, key, key_len, 0, prev);
+    if (!node || compare(node, key, key_len)) {
+        pthread_rwlock_unlock(&skiplist->lock);
+        return;
+    }
+    for (level = 0; level < node->height; ++level) {
+        prev[level]->next[level] = node->next[level];
+    }
+    --skiplist->size;
+    ++skiplist->version;
+    pthread_rwlock_unlock(&skiplist->lock);
+    FREE(node);
+}
+
+uint64_t
+skiplist_size(struct skiplist *skiplist) {
+    uint64_t size;
+
+    pthread_rwlock_rdlock(&skiplist->lock);
+    size = skiplist->size;
+    pthread_rwlock_unlock(&skiplist->lock);
+    return size;
+}
+
+int
+skiplist_seek(struct skiplist *skiplist,
+              struct skiplist_cursor *cursor,
+              const void *key,
+              uint64_t key_len,
+              void *out,
+              uint64_t *out_len) {
+    int r;
+
+    assert(skiplist && cursor && out && out_len);
+
+    pthread_rwlock_rdlock(&skiplist->lock);
+    r = copy(skiplist,
+             cursor,
+             find(skiplist, key ? key : "", key ? key_len : 0, 0, NULL),
+             out,
+             out_len);
+    pthread_rwlock_unlock(&skiplist->lock);
+    return r;
+}
+
+int
+skiplist_next(struct skiplist *skiplist,
+              struct skiplist_cursor *cursor,
+              void *key,
+              uint64_t *key_len) {
+    const struct skiplist_node *node;
+    int r;
+
+    assert(skiplist && cursor && key && key_len);
+
+    pthread_rwlock_rdlock(&skiplist->lock);
+    if (cursor->node && (cursor->version == skiplist->version)) {
+        node = cursor->node->next[0];
+    }
+    else {
+        node = find(skiplist, key, (*key_len), 1, NULL);
+    }
+    r = copy(skiplist, cursor, node, key, key_len);
+    pthread_rwlock_unlock(&skiplist->lock);
+    return r;
+}
@@ -0,0 +1,70 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * skiplist.h
+ */
+
+#ifndef _SKIPLIST_H_
+#define _SKIPLIST_H_
+
+#include "system.h"
+
+/*
+ * A set of byte string keys in memcmp() order, shorter keys first on a tie.
+ * One writer and any number of readers may use it at the same time.
+ */
+
+struct skiplist;
+struct skiplist_node;
+
+/* a position in the list; follows the list cheaply until a key is removed */
+
+struct skiplist_cursor {
+	const struct skiplist_node *node;
+	uint64_t version;
+};
+
+struct skiplist *skiplist_open(void);
+
+void skiplist_close(struct skiplist *skiplist);
+
+/* allocates the node for a later skiplist_insert() */
+
+struct skiplist_node *skiplist_node(const void *key, uint64_t key_len);
+
+/* takes the node, which is freed instead if its key is already present */
+
+void skiplist_insert(struct skiplist *skiplist, struct skiplist_node *node);
+
+void skiplist_free(struct skiplist_node *node);
+
+void skiplist_remove(struct skiplist *skiplist, const void *key, uint64_t key_len);
+
+uint64_t skiplist_size(struct skiplist *skiplist);
+
+/*
+ * Positions the cursor at the first key at or after key and copies it out,
+ * key may be NULL for the first key of the list. out must have room for the
+ * longest key. Returns +1 if there is no such key.
+ */
+
+int /* 0|+1 */
+skiplist_seek(struct skiplist *skiplist,
+	      struct skiplist_cursor *cursor,
+	      const void *key,
+	      uint64_t key_len,
+	      void *out,
+	      uint64_t *out_len); /* out */
+
+/* moves past key, the key last copied out, and copies out the next one */
+
+int /* 0|+1 */
+skiplist_next(struct skiplist *skiplist,
+	      struct skiplist_cursor *cursor,
+	      void *key,
+	      uint64_t *key_len); /* in/out */
+
+#endif /* _SKIPLIST_H_ */